@@ -0,0 +1,1121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "wfs.h"
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MIN_DISKS 2
+#define RAID0 0
+#define RAID1 1
+#define RAID1V 2
+#define RAID5 3
+#define RAID6 4
+#define RAID10 5
+
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct wfs_dentry))
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(off_t))
+#define MAX_FILE_BLOCKS ((N_BLOCKS - 1) + POINTERS_PER_BLOCK)
+
+// Exit status, as for e2fsck
+#define FSCK_OK          (0) // no problems
+#define FSCK_FIXED       (1) // problems found and all of them fixed
+#define FSCK_UNCORRECTED (4) // problems left, -n or not fixable
+#define FSCK_ERROR       (8) // could not check the volume
+
+// State of an inode slot after the directory tree and version chains are walked
+#define INODE_FREE    (0)
+#define INODE_LOST    (1) // allocated, but no directory or version chain has it
+#define INODE_LINKED  (2) // in the directory tree
+#define INODE_VERSION (3) // an older version in its inode's chain
+#define INODE_ORPHAN  (4) // unlinked, wfs frees it at the next mount
+
+static struct wfs_sb super_block; // the first disk's
+static size_t num_disks = 0;
+static char **disk_files = NULL;
+static char **disk_map = NULL;
+static off_t *disk_sizes = NULL;
+static int raid_mode;
+static int repair = 0;
+static size_t num_threads = 1;
+
+static uint8_t *inode_state = NULL;   // INODE_* of every slot
+static uint32_t *dentry_refs = NULL;  // directory entries naming each inode
+static uint32_t *block_uses = NULL;   // block pointers to each data block
+static size_t *group_used = NULL;     // used data blocks per disk and group
+
+static size_t problems = 0;
+static size_t unfixable = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t parity_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Print a problem. With -y a fixable one is fixed by the caller, which is
+//said here; anything else is left for the user.
+__attribute__((format(printf, 2, 3)))
+static void report(int fixable, const char *fmt, ...) {
+    va_list args;
+    pthread_mutex_lock(&report_lock);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf(repair && fixable ? " (fixed)\n" : "\n");
+    problems++;
+    if (!fixable) {
+        unfixable++;
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+//======================GEOMETRY===========================//
+// The same layout rules as wfs: see wfs.h and the helpers of wfs.c
+
+//Parity blocks per row: P for RAID5, P and Q for RAID6
+static inline size_t parity_disks(void) {
+    return raid_mode == RAID5 ? 1 : raid_mode == RAID6 ? 2 : 0;
+}
+
+//Copies of each data block
+static inline size_t data_copies(void) {
+    if (raid_mode == RAID1 || raid_mode == RAID1V) {
+        return num_disks;
+    }
+    return raid_mode == RAID10 ? 2 : 1;
+}
+
+//Data block numbers in the volume
+static size_t volume_data_blocks(void) {
+    return raid_mode == RAID0 ? super_block.num_data_blocks * num_disks : super_block.num_data_blocks;
+}
+
+//Rows of each disk's data region
+static size_t data_region_blocks(void) {
+    if (raid_mode == RAID0 || raid_mode == RAID1 || raid_mode == RAID1V) {
+        return super_block.num_data_blocks;
+    }
+    if (raid_mode == RAID10) {
+        return super_block.num_data_blocks / (num_disks / 2);
+    }
+    return super_block.num_data_blocks / (num_disks - parity_disks());
+}
+
+//Disk and row of copy copy of data block block_num (0-based)
+static void block_place(size_t block_num, size_t copy, size_t *disk, size_t *row) {
+    if (raid_mode == RAID0) {
+        *disk = block_num % num_disks;
+        *row = block_num / num_disks;
+    } else if (parity_disks()) {
+        size_t data_disks = num_disks - parity_disks();
+        *row = block_num / data_disks;
+        size_t p_disk = num_disks - 1 - *row % num_disks;
+        *disk = (p_disk + parity_disks() + block_num % data_disks) % num_disks;
+    } else if (raid_mode == RAID10) {
+        *disk = 2 * (block_num % (num_disks / 2)) + copy;
+        *row = block_num / (num_disks / 2);
+    } else {
+        *disk = copy;
+        *row = block_num;
+    }
+}
+
+static char *block_data(size_t block_num, size_t copy) {
+    size_t disk, row;
+    block_place(block_num, copy, &disk, &row);
+    return disk_map[disk] + super_block.d_blocks_ptr + row * BLOCK_SIZE;
+}
+
+//Bit of data block block_num in the data bitmap: RAID0 keeps it on the
+//block's own disk, the other modes on every disk
+static size_t bitmap_bit(size_t block_num) {
+    return raid_mode == RAID0 ? block_num / num_disks : block_num;
+}
+
+static int bitmap_test(size_t disk, off_t bitmap_ptr, size_t bit) {
+    return (disk_map[disk][bitmap_ptr + bit / 8] >> (bit % 8)) & 1;
+}
+
+static void bitmap_set(size_t disk, off_t bitmap_ptr, size_t bit, int value) {
+    if (value) {
+        disk_map[disk][bitmap_ptr + bit / 8] |= 1 << (bit % 8);
+    } else {
+        disk_map[disk][bitmap_ptr + bit / 8] &= ~(1 << (bit % 8));
+    }
+}
+
+//Number of blocks or inodes in group, the last group may be short
+static size_t group_span(size_t group, size_t per_group, size_t total) {
+    size_t first = group * per_group;
+    if (first >= total) {
+        return 0;
+    }
+    return (total - first < per_group) ? total - first : per_group;
+}
+
+static struct wfs_group_desc *get_group_desc(size_t disk, size_t group) {
+    return (struct wfs_group_desc *)(disk_map[disk] + super_block.gd_ptr) + group;
+}
+
+static uint16_t *block_refs(size_t block_num, size_t disk) {
+    if (raid_mode == RAID0) {
+        return (uint16_t *)(disk_map[block_num % num_disks] + super_block.refcount_ptr) + block_num / num_disks;
+    }
+    return (uint16_t *)(disk_map[disk] + super_block.refcount_ptr) + block_num;
+}
+
+static uint64_t *block_fingerprint(size_t block_num, size_t disk) {
+    if (raid_mode == RAID0) {
+        return (uint64_t *)(disk_map[block_num % num_disks] + super_block.dedupe_ptr) + block_num / num_disks;
+    }
+    return (uint64_t *)(disk_map[disk] + super_block.dedupe_ptr) + block_num;
+}
+
+static struct wfs_inode *get_inode(size_t disk, size_t num) {
+    return (struct wfs_inode *)(disk_map[disk] + super_block.i_blocks_ptr + num * BLOCK_SIZE);
+}
+
+static int inode_allocated(size_t num) {
+    return bitmap_test(0, super_block.i_bitmap_ptr, num);
+}
+
+static struct wfs_inode_version *get_inode_version(size_t disk, size_t num) {
+    char *table = disk_map[disk] + super_block.snapshots_ptr + MAX_SNAPSHOTS * sizeof(struct wfs_snapshot);
+    return (struct wfs_inode_version *)table + num;
+}
+
+//Bytes of an inode slot wfs keeps the same on every disk
+static size_t inode_slot_size(void) {
+    return (super_block.features & (WFS_FEATURE_INLINE_DATA | WFS_FEATURE_COMPRESSION)) ?
+           BLOCK_SIZE : sizeof(struct wfs_inode);
+}
+
+//Copy inode num from the first disk to the others
+static void sync_inode(size_t num) {
+    for (size_t disk = 1; disk < num_disks; disk++) {
+        memcpy(get_inode(disk, num), get_inode(0, num), inode_slot_size());
+    }
+}
+
+static int is_inline(const struct wfs_inode *inode) {
+    return (inode->flags & WFS_INODE_INLINE) != 0;
+}
+
+//======================PARITY AND FINGERPRINTS===========================//
+
+typedef uint8_t parity_vec __attribute__((vector_size(16)));
+#define PARITY_VECS (BLOCK_SIZE / sizeof(parity_vec))
+
+//Multiply every byte by 2 in GF(2^8) with the RAID6 polynomial 0x11d
+static inline parity_vec gf_mul2(parity_vec v) {
+    return (v << 1) ^ ((parity_vec)(v > 0x7f) & 0x1d);
+}
+
+//Parity of row from its data blocks, into p and q (q only for RAID6), as
+//wfs computes it
+static void compute_parity(size_t row, char *p_out, char *q_out) {
+    size_t data_disks = num_disks - parity_disks();
+    size_t p_disk = num_disks - 1 - row % num_disks;
+    off_t offset = (off_t)row * BLOCK_SIZE + super_block.d_blocks_ptr;
+    for (size_t i = 0; i < PARITY_VECS; i++) {
+        parity_vec p, q, d;
+        size_t k = data_disks - 1;
+        memcpy(&d, disk_map[(p_disk + parity_disks() + k) % num_disks] + offset + i * sizeof(d), sizeof(d));
+        p = q = d;
+        while (k-- > 0) {
+            memcpy(&d, disk_map[(p_disk + parity_disks() + k) % num_disks] + offset + i * sizeof(d), sizeof(d));
+            p ^= d;
+            q = gf_mul2(q) ^ d;
+        }
+        memcpy(p_out + i * sizeof(p), &p, sizeof(p));
+        memcpy(q_out + i * sizeof(q), &q, sizeof(q));
+    }
+}
+
+//Parity blocks of row on disk
+static char *parity_block(size_t row, size_t which) {
+    size_t p_disk = num_disks - 1 - row % num_disks;
+    return disk_map[(p_disk + which) % num_disks] + super_block.d_blocks_ptr + row * BLOCK_SIZE;
+}
+
+//Bring the other copies of data block block_num up to date after the first
+//one was repaired: mirror it, or recompute its row's parity
+static void sync_block(size_t block_num) {
+    if (parity_disks()) {
+        size_t disk, row;
+        char p[BLOCK_SIZE], q[BLOCK_SIZE];
+        block_place(block_num, 0, &disk, &row);
+        pthread_mutex_lock(&parity_lock);
+        compute_parity(row, p, q);
+        memcpy(parity_block(row, 0), p, BLOCK_SIZE);
+        if (raid_mode == RAID6) {
+            memcpy(parity_block(row, 1), q, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&parity_lock);
+        return;
+    }
+    for (size_t copy = 1; copy < data_copies(); copy++) {
+        memcpy(block_data(block_num, copy), block_data(block_num, 0), BLOCK_SIZE);
+    }
+}
+
+#define XXH_PRIME1 (11400714785074694791ULL)
+#define XXH_PRIME2 (14029467366897019727ULL)
+#define XXH_PRIME3 (1609587929392839161ULL)
+#define XXH_PRIME4 (9650029242287828579ULL)
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * XXH_PRIME1;
+}
+
+//XXH64 of one block, as wfs fingerprints it for deduplication
+static uint64_t fingerprint(const char *data) {
+    uint64_t v[4] = { XXH_PRIME1 + XXH_PRIME2, XXH_PRIME2, 0, -XXH_PRIME1 };
+    for (size_t i = 0; i < BLOCK_SIZE; i += 4 * sizeof(uint64_t)) {
+        for (size_t lane = 0; lane < 4; lane++) {
+            uint64_t input;
+            memcpy(&input, data + i + lane * sizeof(uint64_t), sizeof(input));
+            v[lane] = xxh_round(v[lane], input);
+        }
+    }
+    uint64_t h = ((v[0] << 1) | (v[0] >> 63)) + ((v[1] << 7) | (v[1] >> 57)) +
+                 ((v[2] << 12) | (v[2] >> 52)) + ((v[3] << 18) | (v[3] >> 46));
+    for (size_t lane = 0; lane < 4; lane++) {
+        h = (h ^ xxh_round(0, v[lane])) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    h += BLOCK_SIZE;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h ? h : 1;
+}
+
+//======================PARALLEL PASSES===========================//
+
+struct range_job {
+    void (*fn)(size_t first, size_t end);
+    size_t first;
+    size_t end;
+};
+
+static void *range_worker(void *arg) {
+    struct range_job *job = arg;
+    job->fn(job->first, job->end);
+    return NULL;
+}
+
+//Run fn over [0, total) split into one range per thread. Ranges start at
+//multiples of align, so two threads never share a bitmap byte.
+static void run_parallel(void (*fn)(size_t first, size_t end), size_t total, size_t align) {
+    size_t chunk = (total + num_threads - 1) / num_threads;
+    chunk = (chunk + align - 1) / align * align;
+    pthread_t threads[num_threads];
+    struct range_job jobs[num_threads];
+    int started[num_threads];
+    size_t n = 0;
+    for (size_t first = 0; first < total && n < num_threads; first += chunk, n++) {
+        jobs[n].fn = fn;
+        jobs[n].first = first;
+        jobs[n].end = first + chunk < total ? first + chunk : total;
+        started[n] = pthread_create(&threads[n], NULL, range_worker, &jobs[n]) == 0;
+        if (!started[n]) {
+            range_worker(&jobs[n]);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+//Check a superblock read from disk_file. ref is the first disk's superblock
+//(NULL when checking the first disk); every disk has to agree on geometry.
+static int validate_superblock(const struct wfs_sb *sb, const struct wfs_sb *ref, off_t disk_size, const char *disk_file) {
+    if (sb->magic != WFS_MAGIC) {
+        fprintf(stderr, "%s: not a wfs disk (bad magic)\n", disk_file);
+        return -1;
+    }
+    if (sb->version != WFS_VERSION) {
+        fprintf(stderr, "%s: unsupported format version %d\n", disk_file, sb->version);
+        return -1;
+    }
+    if (sb->raid_mode != RAID0 && sb->raid_mode != RAID1 && sb->raid_mode != RAID1V &&
+        sb->raid_mode != RAID5 && sb->raid_mode != RAID6 && sb->raid_mode != RAID10) {
+        fprintf(stderr, "%s: invalid raid mode %d\n", disk_file, sb->raid_mode);
+        return -1;
+    }
+    //with parity or RAID10, num_data_blocks counts the data blocks of all the rows
+    int parity = sb->raid_mode == RAID5 ? 1 : sb->raid_mode == RAID6 ? 2 : 0;
+    if (parity && (sb->num_disks < parity + 2 || sb->num_data_blocks % (sb->num_disks - parity) != 0)) {
+        fprintf(stderr, "%s: %d disks do not fit raid mode %d\n", disk_file, sb->num_disks, sb->raid_mode);
+        return -1;
+    }
+    //RAID10 stripes over pairs of disks
+    if (sb->raid_mode == RAID10 && (sb->num_disks < 4 || sb->num_disks % 2 != 0 ||
+                                    sb->num_data_blocks % (sb->num_disks / 2) != 0)) {
+        fprintf(stderr, "%s: %d disks do not fit raid mode %d\n", disk_file, sb->num_disks, sb->raid_mode);
+        return -1;
+    }
+    size_t rows = parity ? sb->num_data_blocks / (sb->num_disks - parity) : sb->num_data_blocks;
+    if (sb->raid_mode == RAID10) {
+        rows = sb->num_data_blocks / (sb->num_disks / 2);
+    }
+    if (sb->num_inodes == 0 || sb->num_data_blocks == 0 ||
+        sb->num_inodes % 8 != 0 || sb->num_data_blocks % 8 != 0 ||
+        sb->i_bitmap_ptr < (off_t)sizeof(struct wfs_sb) ||
+        sb->d_bitmap_ptr != sb->i_bitmap_ptr + (off_t)(sb->num_inodes / 8) ||
+        sb->i_blocks_ptr < sb->d_bitmap_ptr + (off_t)(sb->num_data_blocks / 8) ||
+        sb->i_blocks_ptr % BLOCK_SIZE != 0 ||
+        sb->d_blocks_ptr != sb->i_blocks_ptr + (off_t)(sb->num_inodes * BLOCK_SIZE) ||
+        sb->d_blocks_ptr + (off_t)(rows * BLOCK_SIZE) > disk_size) {
+        fprintf(stderr, "%s: inconsistent disk layout\n", disk_file);
+        return -1;
+    }
+    if (sb->blocks_per_group == 0 || sb->blocks_per_group % 8 != 0 ||
+        sb->inodes_per_group == 0 || sb->inodes_per_group % 8 != 0 ||
+        sb->num_groups != (sb->num_data_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group ||
+        sb->num_groups * sb->inodes_per_group < sb->num_inodes ||
+        sb->gd_ptr < (off_t)sizeof(struct wfs_sb) ||
+        sb->i_bitmap_ptr < sb->gd_ptr + (off_t)(sb->num_groups * sizeof(struct wfs_group_desc))) {
+        fprintf(stderr, "%s: inconsistent allocation groups\n", disk_file);
+        return -1;
+    }
+    if (sb->features & ~WFS_FEATURES_SUPPORTED) {
+        fprintf(stderr, "%s: unsupported features 0x%x\n", disk_file, sb->features & ~WFS_FEATURES_SUPPORTED);
+        return -1;
+    }
+    if ((sb->features & WFS_FEATURE_REFLINK) &&
+        (sb->refcount_ptr < sb->gd_ptr + (off_t)(sb->num_groups * sizeof(struct wfs_group_desc)) ||
+         sb->i_bitmap_ptr < sb->refcount_ptr + (off_t)(sb->num_data_blocks * sizeof(uint16_t)))) {
+        fprintf(stderr, "%s: inconsistent refcount table\n", disk_file);
+        return -1;
+    }
+    if ((sb->features & WFS_FEATURE_SNAPSHOTS) &&
+        (!(sb->features & WFS_FEATURE_REFLINK) ||
+         sb->snapshots_ptr < sb->refcount_ptr + (off_t)(sb->num_data_blocks * sizeof(uint16_t)) ||
+         sb->i_bitmap_ptr < sb->snapshots_ptr + (off_t)(MAX_SNAPSHOTS * sizeof(struct wfs_snapshot) +
+                                                        sb->num_inodes * sizeof(struct wfs_inode_version)))) {
+        fprintf(stderr, "%s: inconsistent snapshot table\n", disk_file);
+        return -1;
+    }
+    if ((sb->features & WFS_FEATURE_DEDUPE) &&
+        (!(sb->features & WFS_FEATURE_REFLINK) ||
+         sb->dedupe_ptr < sb->refcount_ptr + (off_t)(sb->num_data_blocks * sizeof(uint16_t)) ||
+         ((sb->features & WFS_FEATURE_SNAPSHOTS) && sb->dedupe_ptr <= sb->snapshots_ptr) ||
+         sb->i_bitmap_ptr < sb->dedupe_ptr + (off_t)(sb->num_data_blocks * sizeof(uint64_t)))) {
+        fprintf(stderr, "%s: inconsistent fingerprint table\n", disk_file);
+        return -1;
+    }
+    if (sb->reshape_disks != 0 &&
+        (sb->raid_mode != RAID0 || sb->reshape_disks < 0 || sb->reshape_disks >= sb->num_disks ||
+         sb->reshape_pos >= sb->num_disks * sb->num_data_blocks)) {
+        fprintf(stderr, "%s: inconsistent reshape state\n", disk_file);
+        return -1;
+    }
+    if (sb->tier != WFS_TIER_FAST && sb->tier != WFS_TIER_SLOW) {
+        fprintf(stderr, "%s: invalid tier %d\n", disk_file, sb->tier);
+        return -1;
+    }
+    if (sb->num_disks != num_disks || sb->disk_id < 0 || sb->disk_id >= sb->num_disks) {
+        fprintf(stderr, "%s: disk %d of %d, but %zu disks were given\n",
+                disk_file, sb->disk_id, sb->num_disks, num_disks);
+        return -1;
+    }
+    if (ref && (sb->num_inodes != ref->num_inodes ||
+                sb->num_data_blocks != ref->num_data_blocks ||
+                sb->i_bitmap_ptr != ref->i_bitmap_ptr ||
+                sb->d_bitmap_ptr != ref->d_bitmap_ptr ||
+                sb->i_blocks_ptr != ref->i_blocks_ptr ||
+                sb->d_blocks_ptr != ref->d_blocks_ptr ||
+                sb->gd_ptr != ref->gd_ptr ||
+                sb->blocks_per_group != ref->blocks_per_group ||
+                sb->inodes_per_group != ref->inodes_per_group ||
+                sb->features != ref->features ||
+                sb->refcount_ptr != ref->refcount_ptr ||
+                sb->snapshots_ptr != ref->snapshots_ptr ||
+                sb->dedupe_ptr != ref->dedupe_ptr ||
+                sb->reshape_disks != ref->reshape_disks ||
+                sb->raid_mode != ref->raid_mode)) {
+        fprintf(stderr, "%s: geometry does not match the other disks\n", disk_file);
+        return -1;
+    }
+    return 0;
+}
+
+//======================DIRECTORY TREE===========================//
+
+//Entries of directory block block_idx on the first disk, or NULL if that
+//block is not allocated (or its pointer is out of range, which the inode
+//pass reports). An inline directory has a single, shorter block.
+static struct wfs_dentry *dir_entries(struct wfs_inode *dir, size_t block_idx, size_t *count) {
+    if (is_inline(dir)) {
+        *count = INLINE_DATA_SIZE / sizeof(struct wfs_dentry);
+        return block_idx == 0 ? (struct wfs_dentry *)((char *)dir + sizeof(struct wfs_inode)) : NULL;
+    }
+    off_t ptr = dir->blocks[block_idx];
+    if (ptr <= 0 || (size_t)ptr > volume_data_blocks()) {
+        return NULL;
+    }
+    *count = ENTRIES_PER_BLOCK;
+    return (struct wfs_dentry *)block_data(ptr - 1, 0);
+}
+
+//Remove entry i of directory block block_idx from every copy
+static void clear_dentry(struct wfs_inode *dir, size_t block_idx, size_t i) {
+    size_t count;
+    struct wfs_dentry *entries = dir_entries(dir, block_idx, &count);
+    memset(&entries[i], 0, sizeof(struct wfs_dentry));
+    if (!is_inline(dir)) {
+        sync_block(dir->blocks[block_idx] - 1);
+    }
+    dir->size -= sizeof(struct wfs_dentry);
+    dir->nlinks--;
+    sync_inode(dir->num);
+}
+
+//Release an inode slot nothing refers to. Its blocks are not counted, so
+//the block pass frees them.
+static void free_inode_slot(size_t num) {
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        bitmap_set(disk, super_block.i_bitmap_ptr, num, 0);
+        if (super_block.features & WFS_FEATURE_SNAPSHOTS) {
+            memset(get_inode_version(disk, num), 0, sizeof(struct wfs_inode_version));
+        }
+    }
+    inode_state[num] = INODE_FREE;
+}
+
+//Walk the live directory tree from the root, checking every entry and
+//counting the entries that name each inode. Returns 0 if the root itself is
+//unusable, in which case nothing can be called lost.
+static int check_tree(void) {
+    struct wfs_inode *root = get_inode(0, 0);
+    if (!inode_allocated(0) || !S_ISDIR(root->mode)) {
+        report(0, "Root inode is not an allocated directory");
+        return 0;
+    }
+    int *queue = malloc(super_block.num_inodes * sizeof(int));
+    if (!queue) {
+        perror("Error allocating directory queue");
+        exit(FSCK_ERROR);
+    }
+    size_t head = 0, tail = 0;
+    queue[tail++] = 0;
+    inode_state[0] = INODE_LINKED;
+    while (head < tail) {
+        struct wfs_inode *dir = get_inode(0, queue[head++]);
+        for (size_t block_idx = 0; block_idx < N_BLOCKS - 1; block_idx++) {
+            size_t count;
+            struct wfs_dentry *entries = dir_entries(dir, block_idx, &count);
+            if (!entries) {
+                continue;
+            }
+            for (size_t i = 0; i < count; i++) {
+                int num = entries[i].num;
+                //inode 0 is the root, which is never a directory entry
+                if (num == 0) {
+                    continue;
+                }
+                const char *problem = NULL;
+                if (num < 0 || (size_t)num >= super_block.num_inodes) {
+                    problem = "is out of range";
+                } else if (!inode_allocated(num)) {
+                    problem = "is free";
+                } else if (get_inode(0, num)->flags & (WFS_INODE_SNAPSHOT | WFS_INODE_DELETED)) {
+                    problem = "is only kept for snapshots";
+                } else if (entries[i].name[0] == '\0' || !memchr(entries[i].name, '\0', MAX_NAME)) {
+                    problem = "has a bad name";
+                } else if (S_ISDIR(get_inode(0, num)->mode) && inode_state[num] != INODE_FREE) {
+                    problem = "is a directory linked twice";
+                }
+                if (problem) {
+                    report(1, "Directory inode %d, entry %zu: inode %d %s", dir->num, block_idx * count + i, num, problem);
+                    if (repair) {
+                        clear_dentry(dir, block_idx, i);
+                    }
+                    continue;
+                }
+                dentry_refs[num]++;
+                if (inode_state[num] == INODE_FREE) {
+                    inode_state[num] = INODE_LINKED;
+                    if (S_ISDIR(get_inode(0, num)->mode)) {
+                        queue[tail++] = num;
+                    }
+                }
+            }
+        }
+    }
+    free(queue);
+    return 1;
+}
+
+//Follow the version chain of every inode to the copies kept for snapshots
+static void check_versions(void) {
+    for (size_t num = 0; num < super_block.num_inodes; num++) {
+        struct wfs_inode *inode = get_inode(0, num);
+        if (!inode_allocated(num) || (inode->flags & WFS_INODE_SNAPSHOT)) {
+            continue;  // copies are reached through the chain of their inode
+        }
+        size_t newer = num;
+        int n = get_inode_version(0, num)->prev;
+        while (n != 0) {
+            if (n < 0 || (size_t)n >= super_block.num_inodes || !inode_allocated(n) ||
+                !(get_inode(0, n)->flags & WFS_INODE_SNAPSHOT) || inode_state[n] != INODE_FREE) {
+                report(1, "Inode %zu: version chain links to inode %d, which is not a copy of it", num, n);
+                if (repair) {
+                    for (size_t disk = 0; disk < num_disks; disk++) {
+                        get_inode_version(disk, newer)->prev = 0;
+                    }
+                }
+                break;
+            }
+            inode_state[n] = INODE_VERSION;
+            newer = n;
+            n = get_inode_version(0, n)->prev;
+        }
+        //a deleted inode's slot is kept while snapshots see older versions
+        if ((inode->flags & WFS_INODE_DELETED) && get_inode_version(0, num)->prev != 0) {
+            inode_state[num] = INODE_VERSION;
+        }
+    }
+}
+
+//Sort out the allocated inodes neither the tree nor a version chain reached
+static void check_lost_inodes(void) {
+    for (size_t num = 1; num < super_block.num_inodes; num++) {
+        if (!inode_allocated(num) || inode_state[num] != INODE_FREE) {
+            continue;
+        }
+        struct wfs_inode *inode = get_inode(0, num);
+        if (inode->flags & WFS_INODE_SNAPSHOT) {
+            report(1, "Inode %zu: snapshot copy in no version chain", num);
+        } else if (inode->flags & WFS_INODE_DELETED) {
+            report(1, "Inode %zu: deleted, and no snapshot sees it", num);
+        } else if (inode->nlinks == 0) {
+            //an unclean shutdown leaves these behind; wfs frees them at the next mount
+            inode_state[num] = INODE_ORPHAN;
+            if (super_block.state == WFS_STATE_CLEAN) {
+                report(1, "Inode %zu: unlinked but still allocated on a clean volume", num);
+                if (repair) {
+                    for (size_t disk = 0; disk < num_disks; disk++) {
+                        ((struct wfs_sb *)disk_map[disk])->state = WFS_STATE_DIRTY;
+                    }
+                }
+            }
+            continue;
+        } else {
+            report(1, "Inode %zu: allocated, but in no directory", num);
+        }
+        inode_state[num] = INODE_LOST;
+        if (repair) {
+            free_inode_slot(num);
+        }
+    }
+}
+
+//======================INODES===========================//
+
+static int valid_block_ptr(off_t ptr) {
+    return ptr > 0 && (size_t)ptr <= volume_data_blocks();
+}
+
+//Count the blocks an inode points to, dropping pointers out of range
+static void count_inode_blocks(size_t num, struct wfs_inode *inode) {
+    for (size_t b = 0; b < N_BLOCKS; b++) {
+        off_t ptr = inode->blocks[b];
+        if (ptr == 0) {
+            continue;
+        }
+        if (!valid_block_ptr(ptr)) {
+            report(1, "Inode %zu: block pointer %zu is out of range (%ld)", num, b, (long)ptr);
+            if (repair) {
+                inode->blocks[b] = 0;
+                sync_inode(num);
+            }
+            continue;
+        }
+        __atomic_add_fetch(&block_uses[ptr - 1], 1, __ATOMIC_RELAXED);
+    }
+    off_t indirect = inode->blocks[N_BLOCKS - 1];
+    if (indirect == 0) {
+        return;
+    }
+    off_t *ptrs = (off_t *)block_data(indirect - 1, 0);
+    int changed = 0;
+    for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+        if (ptrs[i] == 0) {
+            continue;
+        }
+        if (!valid_block_ptr(ptrs[i])) {
+            report(1, "Inode %zu: indirect block pointer %zu is out of range (%ld)", num, i, (long)ptrs[i]);
+            if (repair) {
+                ptrs[i] = 0;
+                changed = 1;
+            }
+            continue;
+        }
+        __atomic_add_fetch(&block_uses[ptrs[i] - 1], 1, __ATOMIC_RELAXED);
+    }
+    if (changed) {
+        sync_block(indirect - 1);
+    }
+}
+
+//Check the allocated inodes in [first, end): the same on every disk, sane
+//fields, block pointers in range (and counted for the block pass), entry
+//counts of directories and link counts of files
+static void check_inodes(size_t first, size_t end) {
+    for (size_t num = first; num < end; num++) {
+        if (!inode_allocated(num)) {
+            continue;
+        }
+        struct wfs_inode *inode = get_inode(0, num);
+        for (size_t disk = 1; disk < num_disks; disk++) {
+            if (memcmp(get_inode(disk, num), inode, inode_slot_size()) != 0) {
+                report(1, "Inode %zu: differs between disk 0 and disk %zu", num, disk);
+                if (repair) {
+                    memcpy(get_inode(disk, num), inode, inode_slot_size());
+                }
+            }
+        }
+        if (inode->num != (int)num) {
+            report(1, "Inode %zu: records number %d", num, inode->num);
+            if (repair) {
+                inode->num = num;
+                sync_inode(num);
+            }
+        }
+        if (!S_ISREG(inode->mode) && !S_ISDIR(inode->mode) && !S_ISLNK(inode->mode) && !S_ISCHR(inode->mode) &&
+            !S_ISBLK(inode->mode) && !S_ISFIFO(inode->mode) && !S_ISSOCK(inode->mode)) {
+            report(0, "Inode %zu: unknown file type, mode 0%o", num, (unsigned int)inode->mode);
+            continue;
+        }
+        //inline data lives in the slot, the block pointers are unused
+        if (!is_inline(inode)) {
+            count_inode_blocks(num, inode);
+        }
+
+        if (S_ISDIR(inode->mode)) {
+            size_t entries_used = 0;
+            for (size_t block_idx = 0; block_idx < N_BLOCKS - 1; block_idx++) {
+                size_t count;
+                struct wfs_dentry *entries = dir_entries(inode, block_idx, &count);
+                for (size_t i = 0; entries && i < count; i++) {
+                    entries_used += entries[i].num != 0;
+                }
+            }
+            off_t size = entries_used * sizeof(struct wfs_dentry);
+            if (inode->size != size) {
+                report(1, "Directory inode %zu: size %ld, %zu entries", num, (long)inode->size, entries_used);
+                if (repair) {
+                    inode->size = size;
+                    sync_inode(num);
+                }
+            }
+        } else if (S_ISREG(inode->mode)) {
+            off_t max_size = is_inline(inode) ? (off_t)INLINE_DATA_SIZE : (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+            if (inode->size < 0 || inode->size > max_size) {
+                report(1, "Inode %zu: size %ld, at most %ld fits", num, (long)inode->size, (long)max_size);
+                if (repair) {
+                    inode->size = inode->size < 0 ? 0 : max_size;
+                    sync_inode(num);
+                }
+            }
+            if (inode_state[num] == INODE_LINKED && inode->nlinks != (int)dentry_refs[num]) {
+                report(1, "Inode %zu: link count %d, %u directory entries", num, inode->nlinks, dentry_refs[num]);
+                if (repair) {
+                    inode->nlinks = dentry_refs[num];
+                    sync_inode(num);
+                }
+            }
+        }
+    }
+}
+
+//======================BLOCKS===========================//
+
+//Check data blocks [first, end) against the block pointers counted: the
+//bitmap bit, reference count and fingerprint of each, on every disk that
+//keeps them. Used blocks are counted per disk and group for check_counts().
+static void check_blocks(size_t first, size_t end) {
+    size_t *used = calloc(num_disks * super_block.num_groups, sizeof(size_t));
+    if (!used) {
+        perror("Error allocating group counts");
+        exit(FSCK_ERROR);
+    }
+    int reflink = super_block.features & WFS_FEATURE_REFLINK;
+    int dedupe = super_block.features & WFS_FEATURE_DEDUPE;
+    for (size_t n = first; n < end; n++) {
+        size_t uses = block_uses[n];
+        size_t bit = bitmap_bit(n);
+        size_t first_disk = raid_mode == RAID0 ? n % num_disks : 0;
+        size_t end_disk = raid_mode == RAID0 ? first_disk + 1 : num_disks;
+
+        for (size_t disk = first_disk; disk < end_disk; disk++) {
+            if (bitmap_test(disk, super_block.d_bitmap_ptr, bit) != (uses > 0)) {
+                report(1, uses ? "Block %zu: in use but marked free" : "Block %zu: marked in use, but no file has it", n);
+                for (size_t d = first_disk; repair && d < end_disk; d++) {
+                    bitmap_set(d, super_block.d_bitmap_ptr, bit, uses > 0);
+                }
+                break;
+            }
+        }
+        for (size_t disk = first_disk; disk < end_disk; disk++) {
+            used[disk * super_block.num_groups + bit / super_block.blocks_per_group] +=
+                bitmap_test(disk, super_block.d_bitmap_ptr, bit);
+        }
+
+        if (reflink) {
+            //a block's first file is not counted
+            size_t refs = uses > 1 ? uses - 1 : 0;
+            if (refs >= MAX_BLOCK_REFS) {
+                report(0, "Block %zu: shared by %zu files, more than wfs can count", n, uses);
+            } else {
+                for (size_t disk = first_disk; disk < end_disk; disk++) {
+                    if (*block_refs(n, disk) != refs) {
+                        report(1, "Block %zu: reference count %u, shared by %zu files", n, *block_refs(n, disk), uses);
+                        for (size_t d = first_disk; repair && d < end_disk; d++) {
+                            *block_refs(n, d) = refs;
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+
+        //a fingerprint has to match the block's contents, 0 always does
+        if (dedupe) {
+            uint64_t fp = *block_fingerprint(n, first_disk);
+            int stale = fp != 0 && (uses == 0 || fp != fingerprint(block_data(n, 0)));
+            for (size_t disk = first_disk; disk < end_disk; disk++) {
+                stale |= *block_fingerprint(n, disk) != fp;
+            }
+            if (stale) {
+                report(1, "Block %zu: stale fingerprint", n);
+                for (size_t d = first_disk; repair && d < end_disk; d++) {
+                    *block_fingerprint(n, d) = 0;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < num_disks * super_block.num_groups; i++) {
+        if (used[i]) {
+            __atomic_add_fetch(&group_used[i], used[i], __ATOMIC_RELAXED);
+        }
+    }
+    free(used);
+}
+
+//Compare the mirrored metadata tables, then the group descriptors and the
+//superblock counters with what the bitmaps say
+static void check_counts(void) {
+    size_t ibitmap_size = super_block.num_inodes / 8;
+    for (size_t disk = 1; disk < num_disks; disk++) {
+        if (memcmp(disk_map[disk] + super_block.i_bitmap_ptr, disk_map[0] + super_block.i_bitmap_ptr, ibitmap_size) != 0) {
+            report(1, "Inode bitmap differs between disk 0 and disk %zu", disk);
+            if (repair) {
+                memcpy(disk_map[disk] + super_block.i_bitmap_ptr, disk_map[0] + super_block.i_bitmap_ptr, ibitmap_size);
+            }
+        }
+    }
+    if (super_block.features & WFS_FEATURE_SNAPSHOTS) {
+        size_t table_size = MAX_SNAPSHOTS * sizeof(struct wfs_snapshot) +
+                            super_block.num_inodes * sizeof(struct wfs_inode_version);
+        for (size_t disk = 1; disk < num_disks; disk++) {
+            if (memcmp(disk_map[disk] + super_block.snapshots_ptr, disk_map[0] + super_block.snapshots_ptr, table_size) != 0) {
+                report(1, "Snapshot table differs between disk 0 and disk %zu", disk);
+                if (repair) {
+                    memcpy(disk_map[disk] + super_block.snapshots_ptr, disk_map[0] + super_block.snapshots_ptr, table_size);
+                }
+            }
+        }
+    }
+
+    size_t used_inodes = 0;
+    size_t used_blocks = 0;
+    for (size_t num = 0; num < super_block.num_inodes; num++) {
+        used_inodes += inode_allocated(num);
+    }
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        size_t disk_used = 0;
+        for (size_t g = 0; g < super_block.num_groups; g++) {
+            size_t span = group_span(g, super_block.inodes_per_group, super_block.num_inodes);
+            size_t free_inodes = span;
+            for (size_t num = g * super_block.inodes_per_group; num < g * super_block.inodes_per_group + span; num++) {
+                free_inodes -= inode_allocated(num);
+            }
+            size_t free_blocks = group_span(g, super_block.blocks_per_group, super_block.num_data_blocks) -
+                                 group_used[disk * super_block.num_groups + g];
+            struct wfs_group_desc *desc = get_group_desc(disk, g);
+            if (desc->free_blocks != free_blocks || desc->free_inodes != free_inodes) {
+                report(1, "Group %zu on disk %zu: %zu free blocks and %zu free inodes recorded, %zu and %zu counted",
+                       g, disk, desc->free_blocks, desc->free_inodes, free_blocks, free_inodes);
+                if (repair) {
+                    desc->free_blocks = free_blocks;
+                    desc->free_inodes = free_inodes;
+                }
+            }
+            disk_used += group_used[disk * super_block.num_groups + g];
+        }
+        //RAID0 disks each own a slice of the volume, mirrors and parity count once
+        if (raid_mode == RAID0 || disk == 0) {
+            used_blocks += disk_used;
+        }
+        struct wfs_sb *sb = (struct wfs_sb *)disk_map[disk];
+        if (sb->disk_free_blocks != super_block.num_data_blocks - disk_used) {
+            report(1, "Disk %zu: %zu free blocks recorded in its bitmap, %zu counted",
+                   disk, sb->disk_free_blocks, super_block.num_data_blocks - disk_used);
+            if (repair) {
+                sb->disk_free_blocks = super_block.num_data_blocks - disk_used;
+            }
+        }
+    }
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        struct wfs_sb *sb = (struct wfs_sb *)disk_map[disk];
+        if (sb->free_blocks != volume_data_blocks() - used_blocks ||
+            sb->free_inodes != super_block.num_inodes - used_inodes) {
+            report(1, "Disk %zu: superblock records %zu free blocks and %zu free inodes, %zu and %zu counted",
+                   disk, sb->free_blocks, sb->free_inodes, volume_data_blocks() - used_blocks,
+                   super_block.num_inodes - used_inodes);
+            if (repair) {
+                sb->free_blocks = volume_data_blocks() - used_blocks;
+                sb->free_inodes = super_block.num_inodes - used_inodes;
+            }
+        }
+    }
+    printf("%zu/%zu inodes, %zu/%zu blocks used\n", used_inodes, super_block.num_inodes,
+           used_blocks, volume_data_blocks());
+}
+
+//======================REDUNDANCY===========================//
+
+//Compare the copies of the allocated data blocks in [first, end) across the
+//mirrors (or the members of a RAID10 pair). A copy the others outvote is
+//rewritten; without a majority the first disk's copy wins, as it is the
+//one wfs reads.
+static void check_mirrors(size_t first, size_t end) {
+    size_t copies = data_copies();
+    for (size_t n = first; n < end; n++) {
+        if (!bitmap_test(0, super_block.d_bitmap_ptr, n)) {
+            continue;
+        }
+        size_t best = 0, best_votes = 0;
+        for (size_t c = 0; c < copies; c++) {
+            size_t votes = 0;
+            for (size_t other = 0; other < copies; other++) {
+                votes += memcmp(block_data(n, c), block_data(n, other), BLOCK_SIZE) == 0;
+            }
+            if (votes > best_votes) {
+                best = c;
+                best_votes = votes;
+            }
+        }
+        if (best_votes == copies) {
+            continue;
+        }
+        if (best_votes * 2 <= copies) {
+            best = 0;
+        }
+        report(1, "Block %zu: copies differ, %zu of %zu agree", n, best_votes, copies);
+        for (size_t c = 0; repair && c < copies; c++) {
+            if (c != best) {
+                memcpy(block_data(n, c), block_data(n, best), BLOCK_SIZE);
+            }
+        }
+    }
+}
+
+//Recompute the parity of rows [first, end) and compare it with what is stored.
+//Every row is checked, free blocks included: wfs keeps parity over whole rows.
+static void check_parity(size_t first, size_t end) {
+    char p[BLOCK_SIZE], q[BLOCK_SIZE];
+    for (size_t row = first; row < end; row++) {
+        compute_parity(row, p, q);
+        int bad_p = memcmp(parity_block(row, 0), p, BLOCK_SIZE) != 0;
+        int bad_q = raid_mode == RAID6 && memcmp(parity_block(row, 1), q, BLOCK_SIZE) != 0;
+        if (bad_p || bad_q) {
+            report(1, "Row %zu: %s does not match the data", row, bad_p && bad_q ? "P and Q parity" : bad_p ? "P parity" : "Q parity");
+            if (repair) {
+                memcpy(parity_block(row, 0), p, BLOCK_SIZE);
+                if (raid_mode == RAID6) {
+                    memcpy(parity_block(row, 1), q, BLOCK_SIZE);
+                }
+            }
+        }
+    }
+}
+
+static double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+//Check (and with -y repair) an unmounted wfs volume. The passes over inodes,
+//blocks and rows run on every CPU; the directory tree is walked on one.
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+        switch (opt) {
+            case 'n':
+                repair = 0;
+                break;
+
+            case 'y':
+                repair = 1;
+                break;
+
+            case 'j':
+                threads = atol(optarg);
+                if (threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads\n");
+                    exit(FSCK_ERROR);
+                }
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-n | -y] [-j threads] disk_file...\n", argv[0]);
+                exit(FSCK_ERROR);
+        }
+    }
+    num_threads = threads > 0 ? threads : 1;
+    num_disks = argc - optind;
+    if (num_disks < MIN_DISKS) {
+        fprintf(stderr, "Error: At least %d disk files are required.\n", MIN_DISKS);
+        exit(FSCK_ERROR);
+    }
+
+    //disks go in disk_id order, whatever order they were given in
+    disk_files = calloc(num_disks, sizeof(char *));
+    disk_map = calloc(num_disks, sizeof(char *));
+    disk_sizes = calloc(num_disks, sizeof(off_t));
+    int *disk_fds = malloc(num_disks * sizeof(int));
+    if (!disk_files || !disk_map || !disk_sizes || !disk_fds) {
+        perror("Error allocating disk state");
+        exit(FSCK_ERROR);
+    }
+    struct wfs_sb first_sb;
+    unsigned long events = 0;
+    for (size_t i = 0; i < num_disks; i++) {
+        const char *file = argv[optind + i];
+        int fd = open(file, repair ? O_RDWR : O_RDONLY);
+        struct stat st;
+        struct wfs_sb sb;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(file);
+            exit(FSCK_ERROR);
+        }
+        memset(&sb, 0, sizeof(sb));
+        if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+            fprintf(stderr, "%s: not a wfs disk (too small)\n", file);
+            exit(FSCK_ERROR);
+        }
+        if (validate_superblock(&sb, i ? &first_sb : NULL, st.st_size, file) < 0) {
+            exit(FSCK_ERROR);
+        }
+        if (i == 0) {
+            first_sb = sb;
+            events = sb.events;
+        }
+        if (disk_files[sb.disk_id]) {
+            fprintf(stderr, "%s: disk %d, like %s\n", file, sb.disk_id, disk_files[sb.disk_id]);
+            exit(FSCK_ERROR);
+        }
+        //work wfs finishes by itself is not second-guessed
+        if (sb.reshape_disks != 0) {
+            fprintf(stderr, "%s: a disk is being added; mount the volume to finish restriping first\n", file);
+            exit(FSCK_ERROR);
+        }
+        if (sb.rebuilding || sb.events != events) {
+            fprintf(stderr, "%s: %s; mount the volume to rebuild it first\n", file,
+                    sb.rebuilding ? "being rebuilt" : "out of date with the other disks");
+            exit(FSCK_ERROR);
+        }
+        disk_files[sb.disk_id] = (char *)file;
+        disk_sizes[sb.disk_id] = st.st_size;
+        disk_fds[sb.disk_id] = fd;
+    }
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        //read-only unless repairing, so a check can never write
+        disk_map[disk] = mmap(NULL, disk_sizes[disk], repair ? PROT_READ | PROT_WRITE : PROT_READ,
+                              MAP_SHARED, disk_fds[disk], 0);
+        if (disk_map[disk] == MAP_FAILED) {
+            perror("Error mapping disk file");
+            exit(FSCK_ERROR);
+        }
+    }
+    super_block = *(struct wfs_sb *)disk_map[0];
+    raid_mode = super_block.raid_mode;
+    if (super_block.state != WFS_STATE_CLEAN) {
+        printf("Volume was not unmounted cleanly\n");
+    }
+
+    inode_state = calloc(super_block.num_inodes, sizeof(uint8_t));
+    dentry_refs = calloc(super_block.num_inodes, sizeof(uint32_t));
+    block_uses = calloc(volume_data_blocks(), sizeof(uint32_t));
+    group_used = calloc(num_disks * super_block.num_groups, sizeof(size_t));
+    if (!inode_state || !dentry_refs || !block_uses || !group_used) {
+        perror("Error allocating check state");
+        exit(FSCK_ERROR);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("Pass 1: directory tree and version chains\n");
+    int root_ok = check_tree();
+    if (super_block.features & WFS_FEATURE_SNAPSHOTS) {
+        check_versions();
+    }
+    //without a root everything would look lost, so nothing is freed
+    if (root_ok) {
+        check_lost_inodes();
+    }
+    printf("Pass 2: inodes\n");
+    run_parallel(check_inodes, super_block.num_inodes, 8);
+    printf("Pass 3: data blocks\n");
+    //a bitmap byte covers 8 rows, which in RAID0 are 8 * num_disks block numbers
+    run_parallel(check_blocks, volume_data_blocks(), raid_mode == RAID0 ? 8 * num_disks : 8);
+    printf("Pass 4: group and volume counters\n");
+    check_counts();
+    if (data_copies() > 1) {
+        printf("Pass 5: mirrors\n");
+        run_parallel(check_mirrors, volume_data_blocks(), 1);
+    } else if (parity_disks()) {
+        printf("Pass 5: parity\n");
+        run_parallel(check_parity, data_region_blocks(), 1);
+    }
+
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        if (repair && msync(disk_map[disk], disk_sizes[disk], MS_SYNC) < 0) {
+            perror(disk_files[disk]);
+        }
+        munmap(disk_map[disk], disk_sizes[disk]);
+        close(disk_fds[disk]);
+    }
+    printf("%zu problems found%s in %.0f ms\n", problems,
+           !problems ? "" : repair ? (unfixable ? ", some could not be fixed," : ", all fixed,") : "",
+           elapsed_ms(&start));
+
+    free(inode_state);
+    free(dentry_refs);
+    free(block_uses);
+    free(group_used);
+    free(disk_fds);
+    free(disk_sizes);
+    free(disk_map);
+    free(disk_files);
+    if (!problems) {
+        return FSCK_OK;
+    }
+    return repair && !unfixable ? FSCK_FIXED : FSCK_UNCORRECTED;
+}
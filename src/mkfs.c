@@ -1,38 +1,202 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "wfs.h"
-#include <sys/mman.h>
 #include <getopt.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define MIN_DISKS 2
 #define RAID0 0
 #define RAID1 1
 #define RAID1V 2
+#define RAID5 3
+#define RAID6 4
+#define RAID10 5
+
+//Everything one format thread needs to lay out its disk image
+struct format_job {
+    const char *disk_file;
+    size_t disk_size;
+    struct wfs_sb super_block;          // already carries this disk's disk_id
+    const struct wfs_inode *root_inode;
+    const struct wfs_group_desc *gdt;   // initial group descriptors, same on every disk
+    int status;                         // 0 on success, set by the thread
+};
+
+//Parity blocks in each row of the data region: P for RAID5, P and Q for RAID6
+static int parity_disks(int raid_mode) {
+    return raid_mode == RAID5 ? 1 : raid_mode == RAID6 ? 2 : 0;
+}
+
+//Data blocks in a row of the data regions of all the disks, for the modes
+//whose block numbers cover the whole volume: RAID5/RAID6 leave out the
+//parity, RAID10 stripes over mirror pairs. 1 for RAID0 and mirrors.
+static int row_data_blocks(int raid_mode, int num_disks) {
+    if (raid_mode == RAID10) {
+        return num_disks / 2;
+    }
+    return parity_disks(raid_mode) ? num_disks - parity_disks(raid_mode) : 1;
+}
+
+//pwrite the whole buffer, retrying short writes
+static int write_full(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//Zero [offset, offset + len) without dirtying every page.
+//Punching a hole keeps the image sparse, zero-range is the next best thing,
+//and ftruncate down and back up works on any regular file when the region
+//runs to the end of the image. Only if all of those fail do we write zeros.
+static int zero_region(int fd, off_t offset, off_t len, size_t disk_size) {
+    if (len <= 0) {
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+    if ((size_t)(offset + len) >= disk_size &&
+        ftruncate(fd, offset) == 0 && ftruncate(fd, disk_size) == 0) {
+        return 0;
+    }
+
+    static const char zeros[64 * BLOCK_SIZE];
+    while (len > 0) {
+        size_t chunk = len < (off_t)sizeof(zeros) ? (size_t)len : sizeof(zeros);
+        if (write_full(fd, zeros, chunk, offset) < 0) {
+            return -1;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+//Format a single disk: write the superblock, both bitmaps and the root inode,
+//then sparse-zero the data region. Nothing else in the image is touched.
+static void *format_disk(void *arg) {
+    struct format_job *job = arg;
+    const struct wfs_sb *sb = &job->super_block;
+    job->status = -1;
+
+    int fd = open(job->disk_file, O_RDWR);
+    if (fd < 0) {
+        perror("Error opening disk file");
+        return NULL;
+    }
+
+    //superblock, padded out to a full block
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, sb, sizeof(struct wfs_sb));
+    if (write_full(fd, block, BLOCK_SIZE, 0) < 0) {
+        perror("Error writing superblock");
+        goto out;
+    }
+
+    //group descriptor table, padded out to the inode bitmap; this also
+    //clears the refcount, snapshot and fingerprint tables in between
+    size_t gdt_size = sb->i_bitmap_ptr - sb->gd_ptr;
+    char *gdt = calloc(1, gdt_size);
+    if (!gdt) {
+        perror("Error allocating group descriptors");
+        goto out;
+    }
+    memcpy(gdt, job->gdt, sb->num_groups * sizeof(struct wfs_group_desc));
+    if (write_full(fd, gdt, gdt_size, sb->gd_ptr) < 0) {
+        perror("Error writing group descriptors");
+        free(gdt);
+        goto out;
+    }
+    free(gdt);
+
+    //both bitmaps are written in one go, with only the root inode allocated
+    size_t bitmaps_size = sb->i_blocks_ptr - sb->i_bitmap_ptr;
+    char *bitmaps = calloc(1, bitmaps_size);
+    if (!bitmaps) {
+        perror("Error allocating bitmaps");
+        goto out;
+    }
+    bitmaps[0] |= 1;
+    if (write_full(fd, bitmaps, bitmaps_size, sb->i_bitmap_ptr) < 0) {
+        perror("Error writing bitmaps");
+        free(bitmaps);
+        goto out;
+    }
+    free(bitmaps);
+
+    //root inode gets a zeroed block of its own
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, job->root_inode, sizeof(struct wfs_inode));
+    if (write_full(fd, block, BLOCK_SIZE, sb->i_blocks_ptr) < 0) {
+        perror("Error writing root inode");
+        goto out;
+    }
+
+    // Zero out entire data block region; it has a row for every
+    // row_data_blocks() data blocks, and all-zero rows have zero parity
+    size_t rows = sb->num_data_blocks / row_data_blocks(sb->raid_mode, sb->num_disks);
+    off_t data_region_size = (off_t)rows * BLOCK_SIZE;
+    if (zero_region(fd, sb->d_blocks_ptr, data_region_size, job->disk_size) < 0) {
+        perror("Error zeroing data region");
+        goto out;
+    }
+
+    if (fsync(fd) < 0) {
+        perror("Error syncing disk file");
+        goto out;
+    }
+    job->status = 0;
+out:
+    close(fd);
+    return NULL;
+}
 
 //Block size is always 512 bytes (according to instructions)
 int main(int argc, char **argv) {
     struct wfs_sb super_block;
+    memset(&super_block, 0, sizeof(super_block));
     int num_blocks = -1;
     int num_inodes = -1;
     int raid_mode = -1;
+    int blocks_per_group = BLOCKS_PER_GROUP;
+    unsigned int features = 0;
     int num_disks = 0;
     char **disk_files = NULL;
+    int *disk_tiers = NULL;
     int opt;
 
     //parse and validate arguments
 
-    while ((opt = getopt(argc, argv, "d:i:b:r:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:s:i:b:r:g:IRSCD")) != -1) {
         switch (opt) {
             case 'd':
+            case 's':
+                //-s disks are on the slow tier
                 disk_files = realloc(disk_files, (num_disks + 1) * sizeof(char *));
-                if (!disk_files) {
+                disk_tiers = realloc(disk_tiers, (num_disks + 1) * sizeof(int));
+                if (!disk_files || !disk_tiers) {
                     perror("Error reallocating memory for disk files");
                     exit(EXIT_FAILURE);
                 }
+                disk_tiers[num_disks] = (opt == 's') ? WFS_TIER_SLOW : WFS_TIER_FAST;
                 disk_files[num_disks++] = optarg;
                 break;
             
@@ -52,6 +216,36 @@ int main(int argc, char **argv) {
                 }
                 break;
             
+            case 'g':
+                blocks_per_group = atoi(optarg);
+                if (blocks_per_group <= 0 || blocks_per_group % 8 != 0) {
+                    fprintf(stderr, "Invalid group size, must be a positive multiple of 8\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'I':
+                features |= WFS_FEATURE_INLINE_DATA;
+                break;
+
+            case 'R':
+                features |= WFS_FEATURE_REFLINK;
+                break;
+
+            case 'C':
+                features |= WFS_FEATURE_COMPRESSION;
+                break;
+
+            case 'D':
+                //duplicate blocks are shared through the refcounts
+                features |= WFS_FEATURE_DEDUPE | WFS_FEATURE_REFLINK;
+                break;
+
+            case 'S':
+                //snapshots share blocks with the live files through the refcounts
+                features |= WFS_FEATURE_SNAPSHOTS | WFS_FEATURE_REFLINK;
+                break;
+
             case 'r':
                 if (strcmp(optarg, "0") == 0) {
                     raid_mode = RAID0;
@@ -59,14 +253,20 @@ int main(int argc, char **argv) {
                     raid_mode = RAID1;
                 } else if (strcmp(optarg, "1v") == 0) {
                     raid_mode = RAID1V;
+                } else if (strcmp(optarg, "5") == 0) {
+                    raid_mode = RAID5;
+                } else if (strcmp(optarg, "6") == 0) {
+                    raid_mode = RAID6;
+                } else if (strcmp(optarg, "10") == 0) {
+                    raid_mode = RAID10;
                 } else {
-                    fprintf(stderr, "Invalid RAID mode. Must be 0, 1, or 1v\n");
+                    fprintf(stderr, "Invalid RAID mode. Must be 0, 1, 1v, 5, 6 or 10\n");
                     exit(EXIT_FAILURE);
                 }
                 break;
             
             default:
-                fprintf(stderr, "Usage: %s -d disk_file [-d disk_file ...] -i num_inodes -b num_blocks -r raid_mode\n", argv[0]);
+                fprintf(stderr, "Usage: %s -d disk_file [-d disk_file | -s slow_disk_file ...] -i num_inodes -b num_blocks -r raid_mode [-g blocks_per_group] [-I] [-R] [-S] [-C] [-D]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -76,6 +276,29 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (num_disks < MIN_DISKS + parity_disks(raid_mode)) {
+        fprintf(stderr, "Error: RAID%d needs at least %d disk files.\n",
+                raid_mode == RAID5 ? 5 : 6, MIN_DISKS + parity_disks(raid_mode));
+        exit(EXIT_FAILURE);
+    }
+
+    if (raid_mode == RAID10 && (num_disks < 2 * MIN_DISKS || num_disks % 2 != 0)) {
+        fprintf(stderr, "Error: RAID10 needs an even number of disk files, at least %d.\n", 2 * MIN_DISKS);
+        exit(EXIT_FAILURE);
+    }
+
+    //fast disks take the lowest ids: RAID0 reads metadata from disk 0
+    for (int i = 1; i < num_disks; i++) {
+        for (int j = i; j > 0 && disk_tiers[j - 1] > disk_tiers[j]; j--) {
+            char *file = disk_files[j];
+            int tier = disk_tiers[j];
+            disk_files[j] = disk_files[j - 1];
+            disk_tiers[j] = disk_tiers[j - 1];
+            disk_files[j - 1] = file;
+            disk_tiers[j - 1] = tier;
+        }
+    }
+
     if (num_inodes <= 0 || num_blocks <= 0) {
         fprintf(stderr, "Error: Number of inodes and data blocks must be greater than zero.\n");
         exit(EXIT_FAILURE);
@@ -87,15 +310,47 @@ int main(int argc, char **argv) {
     if (num_inodes % 32 != 0)
         num_inodes = (num_inodes - num_inodes % 32) + 32;
 
+    //with parity or RAID10 every disk holds num_blocks rows, and block
+    //numbers count the data blocks of all of them
+    int data_rows = num_blocks;
+    num_blocks *= row_data_blocks(raid_mode, num_disks);
+
+    //split blocks and inodes into the same number of allocation groups;
+    //group sizes are multiples of 8 so every group starts on a bitmap byte
+    size_t num_groups = ((size_t)num_blocks + blocks_per_group - 1) / blocks_per_group;
+    size_t inodes_per_group = ((size_t)num_inodes + num_groups - 1) / num_groups;
+    inodes_per_group = (inodes_per_group + 7) & ~(size_t)7;
+    size_t gdt_size = num_groups * sizeof(struct wfs_group_desc);
+    gdt_size = (gdt_size + BLOCK_SIZE - 1) & ~(size_t)(BLOCK_SIZE - 1);
+    //one reference count per data block, only with reflinks
+    size_t refs_size = 0;
+    if (features & WFS_FEATURE_REFLINK) {
+        refs_size = ((size_t)num_blocks * sizeof(uint16_t) + BLOCK_SIZE - 1) & ~(size_t)(BLOCK_SIZE - 1);
+    }
+    //snapshot table and one version entry per inode, only with snapshots
+    size_t snaps_size = 0;
+    if (features & WFS_FEATURE_SNAPSHOTS) {
+        snaps_size = MAX_SNAPSHOTS * sizeof(struct wfs_snapshot) + (size_t)num_inodes * sizeof(struct wfs_inode_version);
+        snaps_size = (snaps_size + BLOCK_SIZE - 1) & ~(size_t)(BLOCK_SIZE - 1);
+    }
+    //one fingerprint per data block, only with dedupe
+    size_t hashes_size = 0;
+    if (features & WFS_FEATURE_DEDUPE) {
+        hashes_size = ((size_t)num_blocks * sizeof(uint64_t) + BLOCK_SIZE - 1) & ~(size_t)(BLOCK_SIZE - 1);
+    }
 
 
     //Check disk sizes
     size_t required_size = 
     BLOCK_SIZE +                    //superblock
+    gdt_size +                      //group descriptor table
+    refs_size +                     //block reference counts
+    snaps_size +                    //snapshot table and inode versions
+    hashes_size +                   //block fingerprints
     (num_inodes / 8) +             //inode bitmap
     (num_blocks / 8) +             //data block bitmap
-    (num_inodes * BLOCK_SIZE) +    //inode blocks region
-    (num_blocks * BLOCK_SIZE);     //data blocks region
+    ((size_t)num_inodes * BLOCK_SIZE) +    //inode blocks region
+    ((size_t)data_rows * BLOCK_SIZE);      //data blocks region
 
     //round up to block alignment
     required_size = (required_size + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
@@ -124,14 +379,35 @@ int main(int argc, char **argv) {
     super_block.num_data_blocks = num_blocks;
     super_block.num_inodes = num_inodes;
     super_block.raid_mode = raid_mode;
-    super_block.i_bitmap_ptr = BLOCK_SIZE;
+    super_block.magic = WFS_MAGIC;
+    super_block.version = WFS_VERSION;
+    super_block.num_disks = num_disks;
+    super_block.state = WFS_STATE_CLEAN;
+    super_block.free_inodes = num_inodes - 1; //root inode
+    //RAID0 stripes, so every disk contributes its blocks; mirrors hold one copy
+    //and parity and RAID10 volumes already counted their data blocks
+    super_block.free_blocks = (raid_mode == RAID0) ? (size_t)num_blocks * num_disks : (size_t)num_blocks;
+    super_block.disk_free_blocks = num_blocks;
+    super_block.blocks_per_group = blocks_per_group;
+    super_block.inodes_per_group = inodes_per_group;
+    super_block.num_groups = num_groups;
+    super_block.gd_ptr = BLOCK_SIZE;
+    super_block.features = features;
+    super_block.refcount_ptr = (features & WFS_FEATURE_REFLINK) ? super_block.gd_ptr + gdt_size : 0;
+    super_block.snapshots_ptr = (features & WFS_FEATURE_SNAPSHOTS) ? super_block.gd_ptr + gdt_size + refs_size : 0;
+    super_block.snap_gen = 1;
+    super_block.dedupe_ptr = (features & WFS_FEATURE_DEDUPE) ? super_block.gd_ptr + gdt_size + refs_size + snaps_size : 0;
+    super_block.i_bitmap_ptr = super_block.gd_ptr + gdt_size + refs_size + snaps_size + hashes_size;
     super_block.d_bitmap_ptr = super_block.i_bitmap_ptr + (num_inodes / 8);
     //these should be block aligned
     super_block.i_blocks_ptr = (super_block.d_bitmap_ptr + (num_blocks / 8) + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
-    super_block.d_blocks_ptr = super_block.i_blocks_ptr + (num_inodes * BLOCK_SIZE);
+    super_block.d_blocks_ptr = super_block.i_blocks_ptr + ((off_t)num_inodes * BLOCK_SIZE);
+    //only the root inode slot is written here, wfs initializes the rest of the table after mount
+    super_block.i_init_hwm = 1;
 
     //initialize root inode
     struct wfs_inode root_inode;
+    memset(&root_inode, 0, sizeof(root_inode));
     root_inode.num = 0;
     root_inode.mode = S_IFDIR | 0755;
     root_inode.uid = getuid();
@@ -140,50 +416,68 @@ int main(int argc, char **argv) {
     root_inode.nlinks = 2; //for . and ..
     root_inode.atim = root_inode.mtim = root_inode.ctim = time(NULL);
     memset(root_inode.blocks, 0, N_BLOCKS * sizeof(off_t));
+    if (features & WFS_FEATURE_INLINE_DATA) {
+        root_inode.flags = WFS_INODE_INLINE;
+    }
+    //files created anywhere inherit compression from the root
+    if (features & WFS_FEATURE_COMPRESSION) {
+        root_inode.flags |= WFS_INODE_COMPRESSED;
+    }
 
-
-    //initialize disks and add super block to each disk and root inode to each disk
-    //Only doing raid for datablocks not inodes or any other metadata as per the instructions
-    for (size_t i = 0; i < num_disks; i++) {
-        struct wfs_sb disk_sb = super_block;
-        disk_sb.disk_id = i;  // Assign disk ID in order disks were specified
-        
-        int fd = open(disk_files[i], O_RDWR);
-        if (fd < 0) {
-            perror("Error opening disk file");
-            exit(EXIT_FAILURE);
+    //every group starts empty apart from the root inode in group 0
+    struct wfs_group_desc *gdt = calloc(num_groups, sizeof(struct wfs_group_desc));
+    if (!gdt) {
+        perror("Error allocating group descriptors");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t g = 0; g < num_groups; g++) {
+        size_t first_block = g * blocks_per_group;
+        size_t first_inode = g * inodes_per_group;
+        gdt[g].free_blocks = ((size_t)num_blocks - first_block < (size_t)blocks_per_group) ?
+                             (size_t)num_blocks - first_block : (size_t)blocks_per_group;
+        if (first_inode < (size_t)num_inodes) {
+            gdt[g].free_inodes = ((size_t)num_inodes - first_inode < inodes_per_group) ?
+                                 (size_t)num_inodes - first_inode : inodes_per_group;
         }
+    }
+    gdt[0].free_inodes--;
 
-        struct stat st;
-        if (fstat(fd, &st) == -1) {
-            perror("Error getting disk file size");
-            exit(EXIT_FAILURE);
-        }
 
-        char *disk = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (disk == MAP_FAILED) {
-            perror("Error mapping disk file");
+    //format every disk in its own thread; each one only touches its own image
+    pthread_t *threads = malloc(num_disks * sizeof(pthread_t));
+    struct format_job *jobs = malloc(num_disks * sizeof(struct format_job));
+    if (!threads || !jobs) {
+        perror("Error allocating memory for format threads");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < num_disks; i++) {
+        jobs[i].disk_file = disk_files[i];
+        jobs[i].disk_size = disk_sizes[i];
+        jobs[i].super_block = super_block;
+        jobs[i].super_block.disk_id = i;  // Assign disk ID in order disks were specified, fast ones first
+        jobs[i].super_block.tier = disk_tiers[i];
+        jobs[i].root_inode = &root_inode;
+        jobs[i].gdt = gdt;
+        jobs[i].status = 0;
+        if (pthread_create(&threads[i], NULL, format_disk, &jobs[i]) != 0) {
+            perror("Error creating format thread");
             exit(EXIT_FAILURE);
         }
+    }
 
-        //copy super block to disk
-        memcpy(disk, &disk_sb, BLOCK_SIZE);
-
-        //set inode bitmap to 1 for root inode
-        char *inode_bitmap = disk + super_block.i_bitmap_ptr;
-        inode_bitmap[0] |= 1;
-
-        //copy root inode to disk
-        //Should this table by BLOCK_SIZE aligned?
-        char *inode_table = disk + super_block.i_blocks_ptr;
-        memset(inode_table, 0, BLOCK_SIZE);
-        memcpy(inode_table, &root_inode, sizeof(struct wfs_inode));
-
-        // Zero out entire data block region
-        char *data_region = disk + super_block.d_blocks_ptr;
-        size_t data_region_size = super_block.num_data_blocks * BLOCK_SIZE;
-        memset(data_region, 0, data_region_size);
-        close(fd);
+    int failed = 0;
+    for (size_t i = 0; i < num_disks; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].status != 0) {
+            failed = 1;
+        }
+    }
+    free(threads);
+    free(jobs);
+    free(gdt);
+    if (failed) {
+        exit(EXIT_FAILURE);
     }
 
     //DEBUG print super block
@@ -195,5 +489,6 @@ int main(int argc, char **argv) {
 
     free(disk_sizes);
     free(disk_files);
+    free(disk_tiers);
     return 0;
 }
\ No newline at end of file
@@ -1,41 +1,195 @@
-#define FUSE_USE_VERSION 30
+#define FUSE_USE_VERSION 35
+#define _GNU_SOURCE
 
 #include "wfs.h"
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/capability.h>
 
 #define MIN_DISKS 2
 #define RAID0 0
 #define RAID1 1
 #define RAID1V 2
+#define RAID5 3
+#define RAID6 4
+#define RAID10 5
 
 #define ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct wfs_dentry))
 #define POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(off_t))
 
+// Default time the kernel may cache lookups, attributes and failed lookups,
+// in seconds. Every change goes through the kernel, which drops what it
+// caches for the inodes and directories involved, so these can be long.
+#define ENTRY_TIMEOUT (10.0)
+#define ATTR_TIMEOUT (10.0)
+#define NEGATIVE_TIMEOUT (10.0)
+
+// Largest write request we ask the kernel for
+#define MAX_WRITE (1024 * 1024)
+
+// Default mirror rebuild throttling: KiB/s copied, and ms one batch may hold
+// off writers (-o rebuild_rate=, -o rebuild_budget=)
+#define REBUILD_RATE (16 * 1024)
+#define REBUILD_BUDGET (2.0)
+
+// Mirror scrubbing: default KiB/s compared (-o scrub_rate=), data blocks
+// compared per batch, and how long the scrubber backs off when requests came
+// in during its last batch. It still runs one batch every SCRUB_MAX_YIELDS
+// back-offs, so a busy volume is scrubbed too, slowly.
+#define SCRUB_RATE (16 * 1024)
+#define SCRUB_BATCH (64)
+#define SCRUB_YIELD_MS (10)
+#define SCRUB_MAX_YIELDS (100)
+
+// Most blocks one RAID0 reshape batch moves; it is throttled like a rebuild
+#define RESHAPE_BATCH (256)
+
+// RAID0 tiering: default seconds between passes over the files (-o
+// tier_interval=), reads and writes since the last pass or two that make a
+// block on a slow disk hot, and the size up to which a file is small and
+// stays on the fast tier whatever its heat (its direct blocks)
+#define TIER_INTERVAL (300.0)
+#define TIER_HOT_HEAT (4)
+#define TIER_SMALL_FILE ((N_BLOCKS - 1) * BLOCK_SIZE)
+
+// Populating a range of a mapping without touching it, Linux 5.14 and later
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ (22)
+#endif
+
+// Print a line for every request, only with -d (-o debug)
+#define TRACE(...) do { if (trace_requests) printf(__VA_ARGS__); } while (0)
+
+// chattr flags ioctls, from <linux/fs.h> (which has its own BLOCK_SIZE)
+#define FS_IOC_GETFLAGS _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS _IOW('f', 2, long)
+#define FS_COMPR_FL (0x00000004)
+
+// Compression clusters, see WFS_CLUSTER_BLOCKS
+#define CLUSTER_SIZE (WFS_CLUSTER_BLOCKS * BLOCK_SIZE)
+#define MAX_FILE_BLOCKS ((N_BLOCKS - 1) + POINTERS_PER_BLOCK)
+
+// LZ4 block format: matches are at least LZ4_MIN_MATCH bytes, the last
+// LZ4_LAST_LITERALS bytes are always literals and no match starts in the
+// last LZ4_MATCH_LIMIT bytes
+#define LZ4_MIN_MATCH (4)
+#define LZ4_LAST_LITERALS (5)
+#define LZ4_MATCH_LIMIT (12)
+#define LZ4_HASH_BITS (10)
+
 
 //==================HELPER FUNCTION PROTOTYPES=======================//
 
 static inline off_t get_raid0_disk_offset(off_t offset);
 static size_t get_raid0_disk_index(off_t block_num);
 static off_t get_raid0_block_offset(off_t block_num);
+static int is_inline(struct wfs_inode *inode);
+static char *inline_data(struct wfs_inode *inode);
+static struct wfs_dentry *get_dir_entries(struct wfs_inode *dir, int block_idx, size_t *count);
 struct wfs_dentry *find_dir_entry(struct wfs_inode *dir_inode, const char *name);
-struct wfs_inode *get_inode(const char *path);
-char *get_parent_path(const char *path);
-char *get_file_name(const char *path);
-int allocate_data_block();
-struct wfs_inode *allocate_inode(mode_t mode);
+static inline fuse_ino_t num_to_ino(int num);
+static struct wfs_inode *get_inode_by_num(int num);
+static struct wfs_inode *get_inode_by_ino(fuse_ino_t ino);
+static void sync_inode(struct wfs_inode *inode);
+static void fill_stat(struct wfs_inode *inode, struct stat *stbuf);
+static struct wfs_group_desc *get_group_desc(size_t disk, size_t group);
+static size_t inode_group(int inode_num);
+static size_t block_group(off_t block_num);
+static size_t group_span(size_t group, size_t per_group, size_t total);
+static int allocate_block_in_group(size_t group, int tier);
+int allocate_data_block(size_t goal_group);
+static void zero_data_block(int block_num);
+static int data_block_is_free(size_t block_num);
+static int allocate_block_run(size_t group, size_t count, size_t *got);
+static int allocate_data_run(size_t goal_group, size_t count, size_t *got);
+static struct wfs_inode *allocate_inode_in_group(size_t group, mode_t mode);
+struct wfs_inode *allocate_inode(mode_t mode, size_t parent_group);
 int add_entry_to_parent_directory(struct wfs_inode *parent, const char *name, int inode_num);
-int handle_inode_insertion(const char *path, mode_t mode);
+static off_t *get_indirect_block(struct wfs_inode *inode);
+static void sync_indirect_block(struct wfs_inode *inode);
+static off_t get_block_ptr(struct wfs_inode *inode, size_t b);
+static off_t *block_ptr_slot(struct wfs_inode *inode, size_t b);
+static uint16_t *block_refs(off_t block_num, size_t disk);
+static int take_block_ref(off_t block_num);
+static int unshare_block(struct wfs_inode *inode, size_t b, int copy);
+static uint64_t *block_fingerprint(off_t block_num, size_t disk);
+static uint64_t fingerprint(const char *data);
+static off_t dedupe_find(uint64_t fp, const char *data);
+static void dedupe_insert(uint64_t fp, off_t block_ptr);
+static void forget_fingerprint(off_t block_num);
+static int build_dedupe_index(int verify);
+static off_t seek_data_or_hole(struct wfs_inode *inode, off_t offset, int whence);
+static int promote_inline_data(struct wfs_inode *inode);
+int handle_inode_insertion(struct wfs_inode *parent, const char *name, mode_t mode, struct wfs_inode **new_inode);
 static int remove_dir_entry(struct wfs_inode *parent, const char *name);
+static void set_dir_entry_num(struct wfs_dentry *entry, int num);
+static int dir_contains(struct wfs_inode *dir, int num);
+static void release_inode(struct wfs_inode *inode);
+static void reclaim_orphans(void);
+static char *block_data(off_t block_num, size_t copy);
+static int is_compressed(struct wfs_inode *inode);
+static uint16_t *cluster_map(struct wfs_inode *inode);
+static size_t cluster_blocks(size_t c);
+static int lz4_compress(const char *src, int len, char *dst, int cap);
+static int lz4_decompress(const char *src, int len, char *dst, int cap);
+static void write_block(off_t block_num, const char *data);
+static int load_cluster(struct wfs_inode *inode, size_t c, char *data);
+static int store_cluster(struct wfs_inode *inode, size_t c, const char *data);
+static struct fuse_bufvec *map_compressed_data(struct wfs_inode *inode, size_t size, off_t offset);
+static ssize_t write_compressed_data(struct wfs_inode *inode, struct fuse_bufvec *src, off_t offset);
+static int truncate_compressed(struct wfs_inode *inode, off_t size);
+static struct fuse_bufvec *map_inode_data(struct wfs_inode *inode, size_t size, off_t offset);
+static ssize_t allocate_range(struct wfs_inode *inode, off_t offset, size_t size, int zero_all);
+static ssize_t write_mapped(struct wfs_inode *inode, struct fuse_bufvec *src, off_t offset);
+static ssize_t write_deduped(struct wfs_inode *inode, const char *data, size_t size, off_t offset);
+static ssize_t write_inode_data(struct wfs_inode *inode, struct fuse_bufvec *src, off_t offset);
+static int zero_file_range(struct wfs_inode *inode, off_t offset, off_t len);
+static void release_file_blocks(struct wfs_inode *inode, size_t first, size_t end);
+static int truncate_inode(struct wfs_inode *inode, off_t size);
+static int preallocate_range(struct wfs_inode *inode, off_t offset, off_t len, int keep_size);
+static int punch_hole(struct wfs_inode *inode, off_t offset, off_t len);
+static ssize_t copy_range(struct wfs_inode *src, off_t off_in, struct wfs_inode *dst, off_t off_out, size_t len);
+static ssize_t clone_range(struct wfs_inode *src, off_t off_in, struct wfs_inode *dst, off_t off_out, size_t len);
+static void free_block_ptrs(const off_t *ptrs, size_t n);
+static void free_data_block(off_t block_num);
 static void free_data_blocks(struct wfs_inode *inode);
 static void free_inode(struct wfs_inode *inode);
+static struct wfs_snapshot *get_snapshot(size_t disk, size_t i);
+static struct wfs_inode_version *get_inode_version(size_t disk, int num);
+static void set_inode_version(int num, unsigned int gen, int prev);
+static inline int is_snapshot_ino(fuse_ino_t ino);
+static inline fuse_ino_t view_ino(fuse_ino_t ino, int num);
+static int find_snapshot(const char *name);
+static unsigned int newest_snapshot_gen(void);
+static struct wfs_inode *inode_at_gen(int num, unsigned int gen);
+static int share_block(off_t *ptr, size_t group);
+static int share_inode_blocks(struct wfs_inode *copy);
+static int cow_inode(struct wfs_inode *inode);
+static int take_snapshot(const char *name, size_t *slot);
+static void prune_inode_versions(void);
+static int delete_snapshot(const char *name);
+static int zero_disk_range(size_t disk, off_t offset, off_t len);
+static void *itable_init_worker(void *arg);
+static void *rebuild_worker(void *arg);
+static void *scrub_worker(void *arg);
+static void *reshape_worker(void *arg);
+static void *tier_worker(void *arg);
+static void start_tier_worker(void);
+static void adjust_free_counts(long inode_delta, long block_delta, int disk);
+static void recount_free_counts(void);
+static void set_volume_state(int state);
+static int validate_superblock(const struct wfs_sb *sb, const struct wfs_sb *ref, off_t disk_size, const char *disk_file);
 void debug_print_inode_bitmap();
 void debug_print_inodes(int disk_idx);
 void debug_print_data_bitmap();
@@ -53,8 +207,189 @@ size_t num_disks = 0;
 int raid_mode = -1;
 char **disk_files = NULL; // Array of disk file names
 void **disk_map = NULL; // Array of disk pointers
+int *disk_fds = NULL; // Open file descriptors, indexed like disk_map
+static struct fuse_session *session = NULL;
+static int trace_requests = 0; // -d, see TRACE()
+
+// Mount options handled by wfs itself (-o name[=value]); everything libfuse
+// knows about connection tuning (max_write, max_readahead, ...) is parsed
+// into conn_opts and applied in wfs_init()
+struct wfs_options {
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    int kernel_cache; // keep the page cache across opens (default)
+    int auto_cache;   // keep it only if the file did not change since the last open
+    int direct_io;    // bypass the page cache
+    unsigned int rebuild_rate; // KiB/s a mirror rebuild may copy, 0 for no limit
+    double rebuild_budget;     // ms a rebuild batch may hold off writers
+    int scrub;                 // start scrubbing mirrors at mount
+    unsigned int scrub_rate;   // KiB/s the scrubber compares at most, 0 for no limit
+    double tier_interval;      // seconds between RAID0 tiering passes
+    int discard;               // punch holes in the disk images where blocks are freed
+    int prefault;              // populate the metadata of every disk mapping at mount
+    int hugepages;             // ask for transparent huge pages on the disk mappings
+    int data_advice;           // madvise() hint for the data blocks of the disk mappings
+    char *rebuild;             // blank disk image a lost mirror may be rebuilt onto
+};
+static struct wfs_options options = {
+    .entry_timeout = ENTRY_TIMEOUT,
+    .attr_timeout = ATTR_TIMEOUT,
+    .negative_timeout = NEGATIVE_TIMEOUT,
+    .kernel_cache = 1,
+    .rebuild_rate = REBUILD_RATE,
+    .rebuild_budget = REBUILD_BUDGET,
+    .scrub_rate = SCRUB_RATE,
+    .tier_interval = TIER_INTERVAL,
+    .discard = 1,
+    .data_advice = MADV_NORMAL,
+};
+#define WFS_OPT(templ, field, value) { templ, offsetof(struct wfs_options, field), value }
+static const struct fuse_opt wfs_opt_spec[] = {
+    WFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    WFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    WFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    WFS_OPT("kernel_cache", kernel_cache, 1),
+    WFS_OPT("auto_cache", auto_cache, 1),
+    WFS_OPT("direct_io", direct_io, 1),
+    WFS_OPT("rebuild=%s", rebuild, 0),
+    WFS_OPT("rebuild_rate=%u", rebuild_rate, 0),
+    WFS_OPT("rebuild_budget=%lf", rebuild_budget, 0),
+    WFS_OPT("scrub", scrub, 1),
+    WFS_OPT("scrub_rate=%u", scrub_rate, 0),
+    WFS_OPT("tier_interval=%lf", tier_interval, 0),
+    WFS_OPT("discard", discard, 1),
+    WFS_OPT("nodiscard", discard, 0),
+    WFS_OPT("prefault", prefault, 1),
+    WFS_OPT("hugepages", hugepages, 1),
+    WFS_OPT("data_advice=normal", data_advice, MADV_NORMAL),
+    WFS_OPT("data_advice=random", data_advice, MADV_RANDOM),
+    WFS_OPT("data_advice=sequential", data_advice, MADV_SEQUENTIAL),
+    FUSE_OPT_END
+};
+static struct fuse_conn_info_opts *conn_opts = NULL;
 
-static size_t next_raid0_disk = 0; // Next disk to allocate datablock to in RAID0 mode
+// auto_cache: size and mtime of each file as of its last open
+struct cache_stamp {
+    off_t size;
+    time_t mtim;
+};
+static struct cache_stamp *cache_stamps = NULL;
+
+// Namespace and inode contents. Lookups, reads and getattr share it, and so
+// do writes, truncates and fallocate of a regular file, which hold the file's
+// lock in inode_locks exclusively as well. Anything else that changes a
+// directory, an inode or a block pointer holds it exclusively.
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Per-file locks, hashed by inode number; a snapshot's view of an inode
+// hashes to the live inode's lock. Writes to different files run concurrently
+// and allocate under group_locks[] alone; reads, lseek and getattr hold the
+// file's lock for reading. See write_lock_file() for what still takes fs_lock
+// exclusively.
+#define NUM_INODE_LOCKS (64)
+static pthread_rwlock_t inode_locks[NUM_INODE_LOCKS];
+
+// RAID5/RAID6 parity of a row is recomputed whole after each write to it.
+// Writes to different files can share a row, so its recomputation is
+// serialized by the row's lock here; the last one sees every new block.
+#define NUM_ROW_LOCKS (64)
+static pthread_mutex_t row_locks[NUM_ROW_LOCKS];
+
+// Kernel lookup count of every inode. An unlinked inode is only freed once
+// the kernel has forgotten it, see release_inode()
+static uint64_t *lookup_counts = NULL;
+static size_t orphan_count = 0;
+
+// Reads of holes point here instead of at a data block. A run of hole blocks
+// up to this long goes out as one segment.
+#define ZERO_RUN_SIZE (64 * 1024)
+static char zero_run[ZERO_RUN_SIZE];
+
+// Snapshots are seen through /.snapshots. FUSE inode numbers with a nonzero
+// high half belong to a snapshot: the high half is its record + 1, the low
+// half the inode's number in the live filesystem. /.snapshots itself comes
+// right after the last record.
+#define SNAPSHOTS_DIR ".snapshots"
+#define SNAPSHOT_INO_SHIFT (32)
+#define SNAPSHOTS_DIR_INO ((fuse_ino_t)(MAX_SNAPSHOTS + 1) << SNAPSHOT_INO_SHIFT)
+
+// Dedupe index: open addressing with linear probing over fingerprint -> block
+// pointer, built from the fingerprint table at mount. Like the table it is
+// only changed with fs_lock held for writing, so on a dedupe volume file
+// writes take it exclusively, see write_lock_file().
+struct dedupe_entry {
+    uint64_t fp;
+    off_t block_ptr; //1-based, 0 for an empty entry
+};
+static struct dedupe_entry *dedupe_index = NULL;
+static size_t dedupe_index_mask = 0;
+
+// One lock per allocation group. It covers the group's slice of the inode
+// and data bitmaps on every disk, its group descriptors and, for the lazy
+// initializer, its inode slots. Allocations in different groups never contend.
+static pthread_mutex_t *group_locks = NULL;
+
+// Lazy inode table initialization, see itable_init_worker()
+static pthread_t itable_init_thread;
+static int itable_init_running = 0;
+static int itable_init_stop = 0;
+
+// Health of each disk in disk_map. A RAID1/RAID1V, RAID5 or RAID6 volume
+// mounts with disks missing (their place is taken by anonymous memory, so
+// writes need no special casing) and rebuilds stale or blank ones online, see
+// rebuild_worker(). Mirrors put healthy disks first in disk_map, so disk 0
+// can always be read; RAID5/RAID6 give every disk standing in for a lost one
+// all of the metadata at mount, so disk 0 can be read there too.
+#define DISK_HEALTHY    (0)
+#define DISK_MISSING    (1)
+#define DISK_REBUILDING (2)
+static int *disk_health = NULL;
+
+// Degraded RAID5/RAID6. lost_disks are the disks whose data region cannot be
+// read (missing, or being rebuilt), at most parity_disks() of them. Every row
+// is reconstructed on them from the rest of it the first time it is used,
+// see ensure_row(), and has its bit in row_ready set from then on; writes
+// after that reach them like any other disk.
+static size_t lost_disks[2];
+static size_t num_lost = 0;
+static uint8_t *row_ready = NULL;
+static pthread_mutex_t recover_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t rebuild_thread;
+static int rebuild_running = 0;
+static int rebuild_stop = 0;
+
+// Mirror scrubber, see scrub_worker(). scrub holds its state and progress;
+// scrub_lock covers it, and scrub_cond wakes the worker when it changes.
+static struct wfs_scrub_ctl scrub;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t scrub_thread;
+static int scrub_running = 0;
+static int scrub_stop = 0;
+static uint64_t foreground_ops = 0; // reads and writes served, so the scrubber can tell it is busy
+
+// RAID0 reshape onto an added disk, see reshape_worker(). While one runs,
+// block numbers from reshape_pos on are still striped over the first
+// reshape_disks disks. Both only change with fs_lock held for writing.
+static size_t reshape_disks = 0;
+static size_t reshape_pos = 0;
+static pthread_t reshape_thread;
+static int reshape_running = 0;
+static int reshape_stop = 0;
+
+// RAID0 tiering, see tier_worker(). tiered is set when the volume has disks
+// on both tiers. block_heat counts the reads and writes of every block
+// number, halved after every pass; it is bumped without locks, so counts
+// are approximate.
+static int tiered = 0;
+static uint8_t *block_heat = NULL;
+static pthread_t tier_thread;
+static int tier_running = 0;
+static int tier_stop = 0;
+
+static size_t next_raid0_disk = 0; // Next disk to allocate datablock to in RAID0 mode (a hint, read and written atomically)
 
 
 
@@ -68,156 +403,548 @@ static inline off_t get_raid0_disk_offset(off_t offset) {
     return (stripe_number * BLOCK_SIZE) + super_block.d_blocks_ptr;
 }
 
+//Disks RAID0 block block_num is striped over: all of them, unless a reshape
+//has not reached it yet
+static inline size_t raid0_stripe_disks(off_t block_num) {
+    return (reshape_disks && (size_t)block_num >= reshape_pos) ? reshape_disks : num_disks;
+}
+
 static size_t get_raid0_disk_index(off_t block_num) {
-    return block_num % num_disks;
+    return block_num % raid0_stripe_disks(block_num);
+}
+
+//Row of RAID0 block block_num on its disk, its bit in that disk's data bitmap
+static size_t get_raid0_row(off_t block_num) {
+    return block_num / raid0_stripe_disks(block_num);
 }
 
 static off_t get_raid0_block_offset(off_t block_num) {
-    return (block_num / num_disks) * BLOCK_SIZE + super_block.d_blocks_ptr;
+    return get_raid0_row(block_num) * BLOCK_SIZE + super_block.d_blocks_ptr;
+}
+
+//RAID0 block number at row of disk, or -1 if the place belongs to no block:
+//during a reshape, a block has moved out of it and the one moving in has not
+//been reached yet
+static long get_raid0_block_at(size_t disk, size_t row) {
+    size_t block_num = row * num_disks + disk;
+    if (!reshape_disks || block_num < reshape_pos) {
+        return block_num;
+    }
+    block_num = row * reshape_disks + disk;
+    return (disk < reshape_disks && block_num >= reshape_pos) ? (long)block_num : -1;
+}
+
+//WFS_TIER_* of disk, as its superblock says
+static inline int disk_tier(size_t disk) {
+    return ((struct wfs_sb *)disk_map[disk])->tier;
+}
+
+//Whether a RAID0 volume has disks on both tiers, which is when it tiers
+static int is_tiered(void) {
+    int tiers = 0;
+    for (size_t disk = 0; raid_mode == RAID0 && disk < num_disks; disk++) {
+        tiers |= 1 << disk_tier(disk);
+    }
+    return tiers == 3;
+}
+
+//Data blocks in the volume. RAID0 has num_data_blocks on every disk, but the
+//share of a disk being added only counts once the reshape has reached it.
+static size_t volume_data_blocks(void) {
+    if (raid_mode != RAID0) {
+        return super_block.num_data_blocks;
+    }
+    size_t total = super_block.num_data_blocks * (reshape_disks ? reshape_disks : num_disks);
+    return (reshape_disks && reshape_pos > total) ? reshape_pos : total;
+}
+
+//Copies of each data block: one on every disk for RAID1/RAID1V, one on each
+//disk of a mirror pair for RAID10, else one (RAID0 stripes, RAID5/RAID6
+//stripe with parity). Metadata is on every disk in every mode but RAID0.
+static inline size_t data_copies(void) {
+    if (raid_mode == RAID1 || raid_mode == RAID1V) {
+        return num_disks;
+    }
+    return raid_mode == RAID10 ? 2 : 1;
+}
+
+//RAID10 stripes over the mirror pairs (disks 2p and 2p + 1) like RAID0 over
+//disks; copy 0 or 1 picks the member of the pair
+static size_t get_raid10_disk_index(off_t block_num, size_t copy) {
+    return 2 * (block_num % (num_disks / 2)) + copy;
+}
+
+static off_t get_raid10_block_offset(off_t block_num) {
+    return (block_num / (num_disks / 2)) * BLOCK_SIZE + super_block.d_blocks_ptr;
+}
+
+//Parity blocks per row: P for RAID5, P and Q for RAID6
+static inline size_t parity_disks(void) {
+    return raid_mode == RAID5 ? 1 : raid_mode == RAID6 ? 2 : 0;
+}
+
+//RAID5/RAID6 striping. Row r of every disk's data region forms a stripe of
+//num_disks - parity_disks() data blocks and the parity of the row, which
+//rotates backwards over the disks (P on disk num_disks - 1 - r % num_disks,
+//Q on the next one). Data blocks follow the parity, so consecutive block
+//numbers go to consecutive disks as in RAID0.
+static size_t get_parity_disk_index(off_t block_num) {
+    size_t data_disks = num_disks - parity_disks();
+    size_t row = block_num / data_disks;
+    size_t p_disk = num_disks - 1 - row % num_disks;
+    return (p_disk + parity_disks() + block_num % data_disks) % num_disks;
+}
+
+static off_t get_parity_block_offset(off_t block_num) {
+    return (block_num / (num_disks - parity_disks())) * BLOCK_SIZE + super_block.d_blocks_ptr;
+}
+
+// Parity is computed a vector at a time with GCC vector extensions, which
+// compile to SSE2 on x86-64, NEON on arm64 and word loops elsewhere
+typedef uint8_t parity_vec __attribute__((vector_size(16)));
+#define PARITY_VECS (BLOCK_SIZE / sizeof(parity_vec))
+
+//Multiply every byte by 2 in GF(2^8) with the RAID6 polynomial 0x11d
+static inline parity_vec gf_mul2(parity_vec v) {
+    return (v << 1) ^ ((parity_vec)(v > 0x7f) & 0x1d);
+}
+
+//Disk holding data block k (0-based within the row) of RAID5/RAID6 row row
+static inline size_t row_data_disk(size_t row, size_t k) {
+    size_t p_disk = num_disks - 1 - row % num_disks;
+    return (p_disk + parity_disks() + k) % num_disks;
+}
+
+//P and Q of the data blocks of row into p and q (q may be NULL): P is their
+//XOR, Q the sum of g^k * D_k over data blocks D_k with g = 2, by Horner's
+//rule from the last block. The blocks on the num_skip disks in skip count as
+//zeros.
+static void row_syndromes(size_t row, const size_t *skip, size_t num_skip, char *p_out, char *q_out) {
+    size_t data_disks = num_disks - parity_disks();
+    off_t offset = (off_t)row * BLOCK_SIZE + super_block.d_blocks_ptr;
+    const char *data[data_disks];
+    for (size_t k = 0; k < data_disks; k++) {
+        data[k] = (char *)disk_map[row_data_disk(row, k)] + offset;
+        for (size_t j = 0; j < num_skip; j++) {
+            if (skip[j] == row_data_disk(row, k)) {
+                data[k] = NULL;
+            }
+        }
+    }
+    for (size_t i = 0; i < PARITY_VECS; i++) {
+        parity_vec p = { 0 }, q = { 0 }, d = { 0 };
+        for (size_t k = data_disks; k-- > 0;) {
+            if (data[k]) {
+                memcpy(&d, data[k] + i * sizeof(d), sizeof(d));
+            } else {
+                memset(&d, 0, sizeof(d));
+            }
+            p ^= d;
+            q = gf_mul2(q) ^ d;
+        }
+        memcpy(p_out + i * sizeof(p), &p, sizeof(p));
+        if (q_out) {
+            memcpy(q_out + i * sizeof(q), &q, sizeof(q));
+        }
+    }
+}
+
+//Write the parity of a whole row from its data blocks
+static void write_row_parity(size_t row) {
+    size_t p_disk = num_disks - 1 - row % num_disks;
+    off_t offset = (off_t)row * BLOCK_SIZE + super_block.d_blocks_ptr;
+    row_syndromes(row, NULL, 0, (char *)disk_map[p_disk] + offset,
+                  raid_mode == RAID6 ? (char *)disk_map[(p_disk + 1) % num_disks] + offset : NULL);
+}
+
+// GF(2^8) logarithms and powers of g = 2 under the RAID6 polynomial, for
+// solving lost data out of Q
+static uint8_t gf_log[256];
+static uint8_t gf_exp[2 * 255];
+
+static void gf_init(void) {
+    unsigned int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x = (x << 1) ^ ((x & 0x80) ? 0x11d : 0);
+    }
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+//dst = c * src over a block, by split tables: the products of c with every
+//low and every high nibble, looked up per byte and XORed (what PSHUFB does
+//sixteen bytes at a time)
+static void gf_scale_block(char *dst, const char *src, uint8_t c) {
+    uint8_t lo[16], hi[16];
+    for (int n = 0; n < 16; n++) {
+        lo[n] = gf_mul(c, n);
+        hi[n] = gf_mul(c, n << 4);
+    }
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        uint8_t b = src[i];
+        dst[i] = lo[b & 15] ^ hi[b >> 4];
+    }
+}
+
+static void xor_block(char *dst, const char *src) {
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+//Reconstruct the places of the lost disks in row from the rest of it. With
+//P' and Q' the syndromes of the surviving data blocks, one lost data block
+//D_x is P ^ P', or (P lost too) (Q ^ Q') / g^x; two, x < y, solve
+//D_x ^ D_y = P ^ P' and g^x D_x ^ g^y D_y = Q ^ Q'. Lost parity is then
+//recomputed. Called with recover_lock held.
+static void recover_row(size_t row) {
+    size_t data_disks = num_disks - parity_disks();
+    size_t p_disk = num_disks - 1 - row % num_disks;
+    size_t q_disk = (p_disk + 1) % num_disks;
+    off_t offset = (off_t)row * BLOCK_SIZE + super_block.d_blocks_ptr;
+    size_t lost[2], num_lost_data = 0;
+    int p_lost = 0, parity_lost = 0;
+    for (size_t k = 0; k < data_disks; k++) {
+        for (size_t j = 0; j < num_lost; j++) {
+            if (lost_disks[j] == row_data_disk(row, k)) {
+                lost[num_lost_data++] = k;
+            }
+        }
+    }
+    for (size_t j = 0; j < num_lost; j++) {
+        p_lost |= lost_disks[j] == p_disk;
+        parity_lost |= lost_disks[j] == p_disk || (raid_mode == RAID6 && lost_disks[j] == q_disk);
+    }
+
+    char p[BLOCK_SIZE], q[BLOCK_SIZE];
+    row_syndromes(row, lost_disks, num_lost, p, q);
+    const char *p_block = (char *)disk_map[p_disk] + offset;
+    const char *q_block = (char *)disk_map[q_disk] + offset;
+    char *d_x = num_lost_data > 0 ? (char *)disk_map[row_data_disk(row, lost[0])] + offset : NULL;
+    size_t x = lost[0];
+    if (num_lost_data == 1 && !p_lost) {
+        xor_block(p, p_block);
+        memcpy(d_x, p, BLOCK_SIZE);
+    } else if (num_lost_data == 1) {
+        //only RAID6 gets here: P is the other lost disk
+        xor_block(q, q_block);
+        gf_scale_block(d_x, q, gf_exp[255 - x]);
+    } else if (num_lost_data == 2) {
+        size_t y = lost[1];
+        char *d_y = (char *)disk_map[row_data_disk(row, y)] + offset;
+        char scaled[BLOCK_SIZE];
+        xor_block(p, p_block);
+        xor_block(q, q_block);
+        uint8_t inv = gf_exp[255 - gf_log[gf_exp[x] ^ gf_exp[y]]];
+        gf_scale_block(d_x, q, inv);
+        gf_scale_block(scaled, p, gf_mul(inv, gf_exp[y]));
+        xor_block(d_x, scaled);
+        memcpy(d_y, p, BLOCK_SIZE);
+        xor_block(d_y, d_x);
+    }
+    if (parity_lost) {
+        write_row_parity(row);
+    }
+}
+
+//Make sure the places of the lost disks in row hold their contents before
+//any of the row is read or written; a no-op unless the volume is degraded
+static void ensure_row(size_t row) {
+    if (__atomic_load_n(&num_lost, __ATOMIC_ACQUIRE) == 0 ||
+        ((__atomic_load_n(&row_ready[row / 8], __ATOMIC_ACQUIRE) >> (row % 8)) & 1)) {
+        return;
+    }
+    pthread_mutex_lock(&recover_lock);
+    if (num_lost > 0 && !((row_ready[row / 8] >> (row % 8)) & 1)) {
+        recover_row(row);
+        __atomic_or_fetch(&row_ready[row / 8], (uint8_t)(1 << (row % 8)), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&recover_lock);
+}
+
+//Recompute the parity of a whole row from its data blocks. A row is always
+//recomputed whole, so writes never read old data and parity back, and a
+//write covering several blocks of one row pays for the row once.
+static void compute_parity(size_t row) {
+    ensure_row(row);
+    pthread_mutex_lock(&row_locks[row % NUM_ROW_LOCKS]);
+    write_row_parity(row);
+    pthread_mutex_unlock(&row_locks[row % NUM_ROW_LOCKS]);
+}
+
+//Blocks in each disk's data region. RAID0 counts num_data_blocks per disk,
+//the other modes over the whole volume.
+static size_t data_region_blocks(void) {
+    if (raid_mode == RAID10) {
+        return super_block.num_data_blocks / (num_disks / 2);
+    }
+    return super_block.num_data_blocks / (num_disks - parity_disks());
+}
+
+//Disk and row of the data block holding addr, if addr is in a disk's data region
+static int data_block_row(const void *addr, size_t *disk, size_t *row) {
+    for (size_t d = 0; d < num_disks; d++) {
+        const char *data = (const char *)disk_map[d] + super_block.d_blocks_ptr;
+        if ((const char *)addr >= data && (const char *)addr < data + data_region_blocks() * BLOCK_SIZE) {
+            *disk = d;
+            *row = ((const char *)addr - data) / BLOCK_SIZE;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Bring the parity of every row that [addr, addr + len) touches up to date,
+//skipping *last_row, which the caller has just done
+static void update_parity_span(const char *addr, size_t len, size_t *last_row) {
+    const char *end = addr + len;
+    while (addr < end) {
+        size_t disk, row;
+        if (data_block_row(addr, &disk, &row) && row != *last_row) {
+            compute_parity(row);
+            *last_row = row;
+        }
+        //on to the next block; mappings and the data region are block aligned
+        addr += BLOCK_SIZE - (uintptr_t)addr % BLOCK_SIZE;
+    }
+}
+
+//Update the parity of the row holding addr after data there changed.
+//Nothing to do without parity or for metadata, which is mirrored.
+static void update_parity(const void *addr) {
+    if (!parity_disks()) {
+        return;
+    }
+    size_t last_row = SIZE_MAX;
+    update_parity_span(addr, 1, &last_row);
+}
+
+//Bring the other copies of data block bytes [addr, addr + len), just changed
+//in one copy, up to date: mirror them to the other disks holding the block,
+//or update the parity of their rows. The range must lie in one disk's mapping.
+static void sync_block_data(const char *addr, size_t len) {
+    size_t disk, row;
+    if (parity_disks()) {
+        size_t last_row = SIZE_MAX;
+        update_parity_span(addr, len, &last_row);
+        return;
+    }
+    if (data_copies() == 1 || !data_block_row(addr, &disk, &row)) {
+        return;
+    }
+    size_t disk_offset = addr - (char *)disk_map[disk];
+    for (size_t other = 0; other < num_disks; other++) {
+        //RAID10 mirrors within the pair only
+        if (other != disk && (raid_mode != RAID10 || other / 2 == disk / 2)) {
+            memcpy((char *)disk_map[other] + disk_offset, addr, len);
+        }
+    }
+}
+
+//Inode data is stored in its slot rather than in data blocks
+static int is_inline(struct wfs_inode *inode) {
+    return (inode->flags & WFS_INODE_INLINE) != 0;
+}
+
+//Inline data area, right after the inode in its slot
+static char *inline_data(struct wfs_inode *inode) {
+    return (char *)inode + sizeof(struct wfs_inode);
+}
+
+//Entries of directory block block_idx on the first disk (or the disk
+//holding it, without mirrors), or NULL if that block is not allocated. count is set to the
+//number of entry slots. An inline directory has a single, shorter block.
+static struct wfs_dentry *get_dir_entries(struct wfs_inode *dir, int block_idx, size_t *count) {
+    if (is_inline(dir)) {
+        *count = INLINE_DATA_SIZE / sizeof(struct wfs_dentry);
+        return block_idx == 0 ? (struct wfs_dentry *)inline_data(dir) : NULL;
+    }
+    if (dir->blocks[block_idx] == 0) {
+        return NULL;
+    }
+    *count = ENTRIES_PER_BLOCK;
+    return (struct wfs_dentry *)block_data(dir->blocks[block_idx], 0);
 }
 
 //returns pointer to dir entry 
+//Entries are not packed: removing one leaves a free slot, so every slot of
+//every allocated block is checked.
 struct wfs_dentry *find_dir_entry(struct wfs_inode *dir_inode, const char *name) {
-    printf("find_dir_entry(): looking for %s\n", name);
     if (!dir_inode) {
         return NULL;
     }
-    int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
     // Check all direct blocks (except last indirect block)
     for (int block_idx = 0; block_idx < N_BLOCKS - 1; block_idx++) {
-        if (dir_inode->blocks[block_idx] == 0) {
+        size_t count;
+        struct wfs_dentry *entries = get_dir_entries(dir_inode, block_idx, &count);
+        if (!entries) {
             continue;  // Skip unallocated blocks
         }
-        size_t disk_idx;
-        off_t block_offset;
-        if (raid_mode == RAID0) {
-            disk_idx = get_raid0_disk_index(dir_inode->blocks[block_idx] - 1);
-            block_offset = get_raid0_block_offset(dir_inode->blocks[block_idx] - 1);
-        } else {
-            disk_idx = 0;
-            block_offset = super_block.d_blocks_ptr + 
-                          ((dir_inode->blocks[block_idx] - 1) * BLOCK_SIZE);
-        }
-        struct wfs_dentry *entries = (struct wfs_dentry *)((char *)disk_map[disk_idx] + block_offset);
-        // Calculate entries in this block
-        int start_entry = block_idx * entries_per_block;
-        int remaining_entries = (dir_inode->size / sizeof(struct wfs_dentry)) - start_entry;
-        int num_entries = remaining_entries < entries_per_block ? remaining_entries : entries_per_block;
-        for (int i = 0; i < num_entries; i++) {
-            if (strcmp(entries[i].name, name) == 0) {
-                // printf("find_dir_entry(): found %s at block %d, index %d\n", 
-                //        name, block_idx, i);
+        for (size_t i = 0; i < count; i++) {
+            //inode 0 is the root, which is never a directory entry
+            if (entries[i].num != 0 && strncmp(entries[i].name, name, MAX_NAME) == 0) {
                 return &entries[i];
             }
         }
     }
-    // printf("find_dir_entry(): %s not found in any block\n", name);
     return NULL;
 }
 
-struct wfs_inode *get_inode(const char *path) {
-    //printf("get_inode called: path: %s\n", path);
-    
-    if (strcmp(path, "/") == 0) {
-        struct wfs_inode *inode_table = (struct wfs_inode *)((char *)disk_map[0] + super_block.i_blocks_ptr);
-        return &inode_table[0];
-    }
+//FUSE reserves inode number 1 for the root, which is wfs inode 0
+static inline fuse_ino_t num_to_ino(int num) {
+    return (fuse_ino_t)num + 1;
+}
 
-    struct wfs_inode *current_inode = get_inode("/"); // Start at root inode
-    char *path_copy = strdup(path);
-    char *saveptr;
-    char *component = strtok_r(path_copy, "/", &saveptr); //
-    char *next_component = NULL;
-    
-    while (component != NULL) {
-        if (strlen(component) == 0) {
-            component = strtok_r(NULL, "/", &saveptr);
-            continue;
-        }
+//Inode slot on the first disk
+static struct wfs_inode *get_inode_by_num(int num) {
+    return (struct wfs_inode *)((char *)disk_map[0] + super_block.i_blocks_ptr + ((off_t)num * BLOCK_SIZE));
+}
 
-        // Peek at next component to check if we're at last one
-        next_component = strtok_r(NULL, "/", &saveptr);
-        
-        // Only check for directory if this isn't the last component
-        if (next_component != NULL && !S_ISDIR(current_inode->mode)) {
-            free(path_copy);
+//Inode for a FUSE inode number, or NULL if it is out of range or not allocated.
+//In a snapshot view it is the version that snapshot sees, which is read-only.
+static struct wfs_inode *get_inode_by_ino(fuse_ino_t ino) {
+    if (is_snapshot_ino(ino)) {
+        size_t snap = (ino >> SNAPSHOT_INO_SHIFT) - 1;
+        fuse_ino_t live_ino = ino & (((fuse_ino_t)1 << SNAPSHOT_INO_SHIFT) - 1);
+        if (!(super_block.features & WFS_FEATURE_SNAPSHOTS) || snap >= MAX_SNAPSHOTS ||
+            live_ino == 0 || live_ino > super_block.num_inodes || get_snapshot(0, snap)->gen == 0) {
             return NULL;
         }
+        return inode_at_gen(live_ino - 1, get_snapshot(0, snap)->gen);
+    }
+    if (ino == 0 || ino > super_block.num_inodes) {
+        return NULL;
+    }
+    int num = ino - 1;
+    char *bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
+    if (((bitmap[num / 8] >> (num % 8)) & 1) == 0) {
+        return NULL;
+    }
+    //slots kept for snapshots are not part of the live filesystem
+    struct wfs_inode *inode = get_inode_by_num(num);
+    return (inode->flags & (WFS_INODE_SNAPSHOT | WFS_INODE_DELETED)) ? NULL : inode;
+}
 
-        struct wfs_dentry *entry = find_dir_entry(current_inode, component);
-
-        if (!entry) {
-            printf("get_inode() NOT FOUND: path: %s, component: %s\n", path, component);
-            free(path_copy);
-            return NULL;
-        }
-        //debug print
-        //printf("get_inode(): path: %s, entry_num: %d\n", path, entry->num);
-        current_inode = (struct wfs_inode *)((char *)disk_map[0] + super_block.i_blocks_ptr + (entry->num * BLOCK_SIZE));
-        component = next_component;
-        //print current inode
-        printf("get_inode(): path: %s, inode_num: %d\n", path, current_inode->num);
+//Inodes are modified through their first disk copy; mirror it to the others.
+//With inline data or compression the whole slot is copied, so inline data
+//and cluster maps are mirrored on every disk in every RAID mode.
+static void sync_inode(struct wfs_inode *inode) {
+    size_t len = (super_block.features & (WFS_FEATURE_INLINE_DATA | WFS_FEATURE_COMPRESSION)) ?
+                 BLOCK_SIZE : sizeof(struct wfs_inode);
+    for (size_t disk = 1; disk < num_disks; disk++) {
+        char *inode_block = (char *)disk_map[disk] + super_block.i_blocks_ptr + 
+                           (inode->num * BLOCK_SIZE);
+        memcpy(inode_block, inode, len);
     }
-    printf("get_inode(): path: %s, inode_num: %d\n", path, current_inode->num);
-    free(path_copy);
-    return current_inode;
 }
 
-char *get_parent_path(const char *path){
-    int last_slash_index;
-    for (int i = 0; i < strlen(path) - 1; i++){
-        if (path[i] == '/'){
-            last_slash_index = i;
+//Fill stbuf with inode information
+//st_blocks counts the blocks actually allocated (data and indirect), so holes
+//in sparse files do not show up in du
+static void fill_stat(struct wfs_inode *inode, struct stat *stbuf) {
+    //calculate total number of blocks
+    int num_blocks = 0;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (inode->blocks[i] != 0) {
+            num_blocks++;
+        }
+    }
+    if (inode->blocks[N_BLOCKS-1] != 0) {
+        off_t *indirect_ptrs = get_indirect_block(inode);
+        for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+            num_blocks += (indirect_ptrs[i] != 0);
         }
     }
-    char *parent_path = strdup(path);
-    // seperate the parent path and child path
-    parent_path[last_slash_index + 1] = '\0';
-    return parent_path;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = num_to_ino(inode->num);
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_atime = inode->atim;
+    stbuf->st_mtime = inode->mtim;
+    stbuf->st_ctime = inode->ctim;
+    stbuf->st_mode = inode->mode;
+    stbuf->st_size = inode->size;
+    stbuf->st_nlink = inode->nlinks;
+    stbuf->st_blksize = BLOCK_SIZE;
+    stbuf->st_blocks = num_blocks;
 }
 
-char *get_file_name(const char *path){
-    int last_slash_index;
-    for (int i = 0; i < strlen(path) - 1; i++){
-        if (path[i] == '/'){
-            last_slash_index = i;
-        }
+//Group descriptor of group on disk
+static struct wfs_group_desc *get_group_desc(size_t disk, size_t group) {
+    return (struct wfs_group_desc *)((char *)disk_map[disk] + super_block.gd_ptr) + group;
+}
+
+//Allocation group an inode lives in; its data blocks are allocated from the same group
+static size_t inode_group(int inode_num) {
+    return inode_num / super_block.inodes_per_group;
+}
+
+//Allocation group of a data block (1-based block pointer value minus one)
+static size_t block_group(off_t block_num) {
+    size_t row = (raid_mode == RAID0) ? get_raid0_row(block_num) : block_num;
+    return row / super_block.blocks_per_group;
+}
+
+//Number of blocks or inodes in group, the last group may be short
+static size_t group_span(size_t group, size_t per_group, size_t total) {
+    size_t first = group * per_group;
+    if (first >= total) {
+        return 0;
     }
-    char *file_name = strdup(path + last_slash_index + 1);
-    return file_name;
+    return (total - first < per_group) ? total - first : per_group;
 }
 
-//Allocate a new data block by updating bitmap disks based on raid mode
-int allocate_data_block() {
+//Allocate a data block from one group, or return -ENOSPC if the group is full.
+//RAID0 keeps striping round-robin across the disks inside the group, only
+//over the disks of tier unless it is -1.
+static int allocate_block_in_group(size_t group, int tier) {
+    size_t first_byte = group * super_block.blocks_per_group / 8;
+    size_t end_byte = first_byte + group_span(group, super_block.blocks_per_group, super_block.num_data_blocks) / 8;
+
+    pthread_mutex_lock(&group_locks[group]);
     if (raid_mode == RAID0) {
         // Try each disk starting from next_raid0_disk
+        size_t start_disk = __atomic_load_n(&next_raid0_disk, __ATOMIC_RELAXED);
         for (size_t attempts = 0; attempts < num_disks; attempts++) {
-            size_t current_disk = next_raid0_disk;
+            size_t current_disk = (start_disk + attempts) % num_disks;
+            struct wfs_group_desc *desc = get_group_desc(current_disk, group);
+
+            // A full group is skipped without scanning its bitmap
+            if (desc->free_blocks == 0 || (tier >= 0 && disk_tier(current_disk) != tier)) {
+                continue;
+            }
+
             char *disk_bitmap = (char *)disk_map[current_disk] + super_block.d_bitmap_ptr;
-            
-            // Find free block in this disk's bitmap
-            for (int i = 0; i < (super_block.num_data_blocks / 8); i++) {
+            for (size_t i = first_byte; i < end_byte; i++) {
                 for (int j = 0; j < 8; j++) {
                     if (((disk_bitmap[i] >> j) & 1) == 0) {
                         // Found free block on current disk
-                        int local_block = (i * 8) + j;
+                        size_t local_block = (i * 8) + j;
+                        long block_num = get_raid0_block_at(current_disk, local_block);
+                        if (block_num < 0) {
+                            continue;  // left between two geometries by a reshape
+                        }
                         disk_bitmap[i] |= (1 << j);
-                        
+                        desc->free_blocks--;
+                        pthread_mutex_unlock(&group_locks[group]);
+
                         // Update next disk (round-robin)
-                        next_raid0_disk = (current_disk + 1) % num_disks;
-                        
-                        // Return global block number
-                        return (local_block * num_disks) + current_disk;
+                        __atomic_store_n(&next_raid0_disk, (current_disk + 1) % num_disks, __ATOMIC_RELAXED);
+                        adjust_free_counts(0, -1, current_disk);
+
+                        return block_num;
                     }
                 }
             }
-            // Try next disk
-            next_raid0_disk = (next_raid0_disk + 1) % num_disks;
         }
-    } else {
-        // RAID1: Original implementation
+    } else if (get_group_desc(0, group)->free_blocks > 0) {
         char *first_bitmap = (char *)disk_map[0] + super_block.d_bitmap_ptr;
-        for (int i = 0; i < (super_block.num_data_blocks / 8); i++) {
+        for (size_t i = first_byte; i < end_byte; i++) {
             for (int j = 0; j < 8; j++) {
                 if (((first_bitmap[i] >> j) & 1) == 0) {
                     int block_num = (i * 8) + j;
@@ -225,24 +952,162 @@ int allocate_data_block() {
                     for (size_t disk = 0; disk < num_disks; disk++) {
                         char *bitmap = (char *)disk_map[disk] + super_block.d_bitmap_ptr;
                         bitmap[i] |= (1 << j);
+                        get_group_desc(disk, group)->free_blocks--;
                     }
+                    pthread_mutex_unlock(&group_locks[group]);
+                    adjust_free_counts(0, -1, -1);
                     return block_num;
                 }
             }
         }
     }
+    pthread_mutex_unlock(&group_locks[group]);
     return -ENOSPC;
 }
 
-//Allocate a new inode on each disk
-//This function only updates bitmap and inode table on each disk (does not update parent directory)
-struct wfs_inode *allocate_inode(mode_t mode) {
+//Allocate a data block on a disk of tier (any disk for -1), goal_group first
+static int allocate_tier_block(size_t goal_group, int tier) {
+    for (size_t n = 0; n < super_block.num_groups; n++) {
+        int block_num = allocate_block_in_group((goal_group + n) % super_block.num_groups, tier);
+        if (block_num >= 0) {
+            return block_num;
+        }
+    }
+    return -ENOSPC;
+}
+
+//Allocate a new data block by updating bitmap disks based on raid mode.
+//goal_group is tried first so a file's blocks stay near its inode; the other
+//groups follow in order. A tiered volume fills its fast disks first.
+int allocate_data_block(size_t goal_group) {
+    int block_num = tiered ? allocate_tier_block(goal_group, WFS_TIER_FAST) : -ENOSPC;
+    return block_num >= 0 ? block_num : allocate_tier_block(goal_group, -1);
+}
+
+//Zero a newly allocated data block (0-based) on every disk that holds it,
+//so a recycled block never shows what it held before
+static void zero_data_block(int block_num) {
+    for (size_t copy = 0; copy < data_copies(); copy++) {
+        memset(block_data(block_num + 1, copy), 0, BLOCK_SIZE);
+    }
+    update_parity(block_data(block_num + 1, 0));
+}
+
+//Whether data block block_num (0-based) is free; called with its group lock held
+static int data_block_is_free(size_t block_num) {
+    if (raid_mode == RAID0) {
+        char *bitmap = (char *)disk_map[get_raid0_disk_index(block_num)] + super_block.d_bitmap_ptr;
+        size_t local_block = get_raid0_row(block_num);
+        return ((bitmap[local_block / 8] >> (local_block % 8)) & 1) == 0;
+    }
+    char *bitmap = (char *)disk_map[0] + super_block.d_bitmap_ptr;
+    return ((bitmap[block_num / 8] >> (block_num % 8)) & 1) == 0;
+}
+
+//Allocate up to count blocks with consecutive numbers from one group, so file
+//data is laid out contiguously (striped in order over the disks in RAID0).
+//Takes the first free run that is long enough, or else the longest one.
+//Returns its first block number and sets *got, or -ENOSPC if the group is full.
+static int allocate_block_run(size_t group, size_t count, size_t *got) {
+    //while a reshape runs, the block numbers of a group are not consecutive
+    if (reshape_disks) {
+        *got = 1;
+        return allocate_block_in_group(group, -1);
+    }
+    size_t per_row = (raid_mode == RAID0) ? num_disks : 1;
+    size_t first = group * super_block.blocks_per_group * per_row;
+    size_t end = first + group_span(group, super_block.blocks_per_group, super_block.num_data_blocks) * per_row;
+    size_t best_start = 0, best_len = 0;
+    size_t run_start = 0, run_len = 0;
+
+    pthread_mutex_lock(&group_locks[group]);
+    size_t group_free = 0;
+    for (size_t disk = 0; disk < (raid_mode == RAID0 ? num_disks : 1); disk++) {
+        group_free += get_group_desc(disk, group)->free_blocks;
+    }
+    for (size_t b = first; group_free > 0 && b < end && best_len < count; b++) {
+        if (!data_block_is_free(b)) {
+            run_len = 0;
+            continue;
+        }
+        if (run_len++ == 0) {
+            run_start = b;
+        }
+        if (run_len > best_len) {
+            best_start = run_start;
+            best_len = run_len;
+        }
+    }
+    if (best_len == 0) {
+        pthread_mutex_unlock(&group_locks[group]);
+        return -ENOSPC;
+    }
+
+    size_t taken[num_disks];
+    memset(taken, 0, sizeof(taken));
+    for (size_t b = best_start; b < best_start + best_len; b++) {
+        if (raid_mode == RAID0) {
+            size_t disk = get_raid0_disk_index(b);
+            size_t local_block = get_raid0_row(b);
+            char *bitmap = (char *)disk_map[disk] + super_block.d_bitmap_ptr;
+            bitmap[local_block / 8] |= (1 << (local_block % 8));
+            get_group_desc(disk, group)->free_blocks--;
+            taken[disk]++;
+        } else {
+            for (size_t disk = 0; disk < num_disks; disk++) {
+                char *bitmap = (char *)disk_map[disk] + super_block.d_bitmap_ptr;
+                bitmap[b / 8] |= (1 << (b % 8));
+                get_group_desc(disk, group)->free_blocks--;
+            }
+        }
+    }
+    pthread_mutex_unlock(&group_locks[group]);
+
+    if (raid_mode == RAID0) {
+        for (size_t disk = 0; disk < num_disks; disk++) {
+            if (taken[disk] > 0) {
+                adjust_free_counts(0, -(long)taken[disk], disk);
+            }
+        }
+    } else {
+        adjust_free_counts(0, -(long)best_len, -1);
+    }
+    *got = best_len;
+    return best_start;
+}
+
+//Allocate a run of up to count consecutive blocks, goal_group first.
+//Consecutive RAID0 blocks go to every disk, so a tiered volume allocates
+//one block at a time instead.
+static int allocate_data_run(size_t goal_group, size_t count, size_t *got) {
+    if (tiered) {
+        *got = 1;
+        return allocate_data_block(goal_group);
+    }
+    for (size_t n = 0; n < super_block.num_groups; n++) {
+        int block_num = allocate_block_run((goal_group + n) % super_block.num_groups, count, got);
+        if (block_num >= 0) {
+            return block_num;
+        }
+    }
+    return -ENOSPC;
+}
+
+//Allocate an inode from one group, or return NULL if the group is full
+static struct wfs_inode *allocate_inode_in_group(size_t group, mode_t mode) {
     int idx = -1;
     struct wfs_inode *inode_ptr = NULL;
-    
-    //Find a free inode number
+    size_t first = group * super_block.inodes_per_group;
+    size_t end = first + group_span(group, super_block.inodes_per_group, super_block.num_inodes);
+
+    //the group lock also keeps the background initializer off the slot we pick
+    pthread_mutex_lock(&group_locks[group]);
+    if (get_group_desc(0, group)->free_inodes == 0) {
+        pthread_mutex_unlock(&group_locks[group]);
+        return NULL;
+    }
     char *first_bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
-    for (int i = 0; i < (super_block.num_inodes / 8); i++) {
+    for (size_t i = first / 8; i < end / 8; i++) {
         char *currByte = (first_bitmap + i);
         for (int j = 0; j < 8; j++) {
             if (((*currByte >> j) & 1) == 0) {
@@ -251,6 +1116,7 @@ struct wfs_inode *allocate_inode(mode_t mode) {
             }
         }
     }
+    pthread_mutex_unlock(&group_locks[group]);
     return NULL;  // No free inodes
 
 found_idx:
@@ -259,6 +1125,7 @@ found_idx:
         // Set bitmap
         char *bitmap = (char *)disk_map[disk] + super_block.i_bitmap_ptr;
         bitmap[idx / 8] |= (1 << (idx % 8));
+        get_group_desc(disk, group)->free_inodes--;
 
         // Get pointer to full inode block
         char *inode_block = (char *)disk_map[disk] + super_block.i_blocks_ptr + (idx * BLOCK_SIZE);
@@ -277,62 +1144,112 @@ found_idx:
         disk_inode->mtim = time(NULL);
         disk_inode->ctim = time(NULL);
         memset(disk_inode->blocks, 0, N_BLOCKS * sizeof(off_t));
+        //files and directories start out inline and move to blocks as they grow
+        if ((super_block.features & WFS_FEATURE_INLINE_DATA) && (S_ISREG(mode) || S_ISDIR(mode))) {
+            disk_inode->flags = WFS_INODE_INLINE;
+        }
                 
         if (disk == 0) {
             inode_ptr = disk_inode;  // Save pointer from first disk
         }
     }
+    pthread_mutex_unlock(&group_locks[group]);
+    adjust_free_counts(-1, 0, -1);
+    //no snapshot taken so far can see the new inode
+    if (super_block.features & WFS_FEATURE_SNAPSHOTS) {
+        set_inode_version(idx, super_block.snap_gen, 0);
+    }
     //printf("Allocated new inode: index: %d\n", idx);
     return inode_ptr; // Return pointer to inode on first disk only
 }
 
+//Allocate a new inode on each disk
+//This function only updates bitmap and inode table on each disk (does not update parent directory)
+//Files go in their parent's group. Directories go to the group with the most
+//free inodes, which spreads unrelated trees over the disk, ext2 style.
+struct wfs_inode *allocate_inode(mode_t mode, size_t parent_group) {
+    size_t goal = parent_group;
+    if (S_ISDIR(mode)) {
+        size_t best_free = 0;
+        for (size_t g = 0; g < super_block.num_groups; g++) {
+            size_t free_inodes = __atomic_load_n(&get_group_desc(0, g)->free_inodes, __ATOMIC_RELAXED);
+            if (free_inodes > best_free) {
+                best_free = free_inodes;
+                goal = g;
+            }
+        }
+    }
+    for (size_t n = 0; n < super_block.num_groups; n++) {
+        struct wfs_inode *inode = allocate_inode_in_group((goal + n) % super_block.num_groups, mode);
+        if (inode) {
+            return inode;
+        }
+    }
+    return NULL;
+}
+
 //Add new entry to parent directory block based on raid mode
 int add_entry_to_parent_directory(struct wfs_inode *parent, const char *name, int inode_num) {
     // printf("Adding entry: %s (inode %d) to parent directory\n", name, inode_num);
     // printf("Parent initial size: %ld\n", parent->size);
     // printf("Parent blocks[0]: %ld\n", parent->blocks[0]);
 
+    //an inline directory takes entries in its slot until it is full;
+    //sync_inode() mirrors them with the rest of the slot
+    if (is_inline(parent)) {
+        size_t count;
+        struct wfs_dentry *entries = get_dir_entries(parent, 0, &count);
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].num == 0) {
+                strncpy(entries[i].name, name, MAX_NAME);
+                entries[i].num = inode_num;
+                parent->size += sizeof(struct wfs_dentry);
+                parent->nlinks++;
+                return 0;
+            }
+        }
+        //full: its entries move to block 0 at the same slots, so readdir offsets stay valid
+        int err = promote_inline_data(parent);
+        if (err < 0) {
+            return err;
+        }
+    }
+
     //traverse all allocated blocks in the parent inode
     for (int block_idx = 0; block_idx < N_BLOCKS - 1; block_idx++) {
         if (parent->blocks[block_idx] == 0) { //no allocated blocks
-            int block_num = allocate_data_block(); //allocate new data block based on raid mode
+            int block_num = allocate_data_block(inode_group(parent->num)); //allocate new data block based on raid mode
             if (block_num < 0) {
                 return -ENOSPC;
             }
             parent->blocks[block_idx] = block_num + 1;
-        }
 
-        if (raid_mode == RAID0) { // RAID0
-            size_t disk_idx = get_raid0_disk_index(parent->blocks[block_idx] -1);
-            off_t block_offset = get_raid0_block_offset(parent->blocks[block_idx] -1);
+            //a recycled block may hold old file data, every slot has to read as free
+            zero_data_block(block_num);
+        }
 
-            //debug print
-            // printf("Parent block offset: %ld\n", block_offset);
-            // printf("Parent disk index: %zu\n", disk_idx);
-            
-            struct wfs_dentry *entries = (struct wfs_dentry *)((char *)disk_map[disk_idx] + block_offset);
+        if (data_copies() == 1) { // RAID0/RAID5/RAID6
+            struct wfs_dentry *entries = (struct wfs_dentry *)block_data(parent->blocks[block_idx], 0);
             for (int i = 0; i < ENTRIES_PER_BLOCK; i++) {
                 if (entries[i].num == 0) {
                     strncpy(entries[i].name, name, MAX_NAME);
                     entries[i].num = inode_num;
+                    update_parity(entries);
                     parent->size += sizeof(struct wfs_dentry);
                     parent->nlinks++;
                     return 0;
                 }
             }
-        } else { // RAID1/RAID1V
-            off_t block_offset = super_block.d_blocks_ptr + 
-                        ((parent->blocks[block_idx] - 1) * BLOCK_SIZE);
-
-            //get first disk entries
-            struct wfs_dentry *first_entries = (struct wfs_dentry *)((char *)disk_map[0] + block_offset);
+        } else { // RAID1/RAID1V/RAID10
+            //get first copy entries
+            struct wfs_dentry *first_entries = (struct wfs_dentry *)block_data(parent->blocks[block_idx], 0);
             
             //traverse all entries in the block
             for (int i = 0; i < ENTRIES_PER_BLOCK; i++) {
                 if (first_entries[i].num == 0) { //free entry spot
-                    //update all disks
-                    for (size_t disk = 0; disk < num_disks; disk++) {
-                        struct wfs_dentry *entries = (struct wfs_dentry *)((char *)disk_map[disk] + block_offset);
+                    //update all copies
+                    for (size_t copy = 0; copy < data_copies(); copy++) {
+                        struct wfs_dentry *entries = (struct wfs_dentry *)block_data(parent->blocks[block_idx], copy);
                         strncpy(entries[i].name, name, MAX_NAME);
                         entries[i].num = inode_num;
                     }
@@ -347,14 +1264,12 @@ int add_entry_to_parent_directory(struct wfs_inode *parent, const char *name, in
 }
 
 // Helper to get/create indirect block
+// Returns the copy on the disk that holds it (the first copy for mirrors);
+// after changing it, sync_indirect_block() mirrors it to the other disks
+// or updates its parity.
 static off_t *get_indirect_block(struct wfs_inode *inode) {
-    for(int i = 0; i < N_BLOCKS; i++){
-        printf("inode->blocks[%d]: %ld\n", i, inode->blocks[i]);
-    }
-
-
     if (inode->blocks[N_BLOCKS-1] == 0) {
-        int new_block_num = allocate_data_block(); // Allocate new data block based on raid mode
+        int new_block_num = allocate_data_block(inode_group(inode->num)); // Allocate new data block based on raid mode
         if (new_block_num < 0){
             printf("Error allocating new data block\n");
             return NULL;
@@ -362,76 +1277,352 @@ static off_t *get_indirect_block(struct wfs_inode *inode) {
         inode->blocks[N_BLOCKS-1] = new_block_num + 1;
         
         //Initialize indirect block
-        if(raid_mode == RAID0) {
-            size_t disk_idx = get_raid0_disk_index(new_block_num);
-            off_t block_addr = get_raid0_block_offset(new_block_num);
-            memset((char *)disk_map[disk_idx] + block_addr, 0, BLOCK_SIZE);
-        }else{
-            off_t block_addr = super_block.d_blocks_ptr + (new_block_num * BLOCK_SIZE);
-            for (size_t disk = 0; disk < num_disks; disk++) {
-                memset((char *)disk_map[disk] + block_addr, 0, BLOCK_SIZE);
-            }
-        }
+        zero_data_block(new_block_num);
     }
 
-    // Return pointer to indirect block
-    // For RAID1, maintain a local copy of indirect block entries
-    // and update all disks when modified
-    static off_t local_indirect[BLOCK_SIZE/sizeof(off_t)];
-    
     // Get pointer to indirect block
-    if (raid_mode == RAID0) {
-        size_t disk_idx = get_raid0_disk_index(inode->blocks[N_BLOCKS-1] - 1);
-        off_t block_addr = get_raid0_block_offset(inode->blocks[N_BLOCKS-1] - 1);
-        return (off_t *)((char *)disk_map[disk_idx] + block_addr);
-    } else {
-        // // Read from first disk into local buffer
-        off_t block_addr = super_block.d_blocks_ptr + ((inode->blocks[N_BLOCKS-1] - 1) * BLOCK_SIZE);
-        memcpy(local_indirect, (char *)disk_map[0] + block_addr, BLOCK_SIZE);
-        
-        // Mirror changes to all disks when indirect block is modified
-        for (size_t disk = 1; disk < num_disks; disk++) {
-            memcpy((char *)disk_map[disk] + block_addr, local_indirect, BLOCK_SIZE);
-        }
-        return local_indirect;
-    }
+    return (off_t *)block_data(inode->blocks[N_BLOCKS-1], 0);
 }
 
-
-int handle_inode_insertion(const char *path, mode_t mode) {
-    char *file_name = get_file_name(path);
-    char *parent_path = get_parent_path(path);
-    
-    // Get parent inode
-    struct wfs_inode *parent = get_inode(parent_path);
-    if (parent == NULL) {
-        return -ENOENT;
+//Mirror the first copy of an indirect block to the other disks holding it,
+//or bring its row's parity up to date
+static void sync_indirect_block(struct wfs_inode *inode) {
+    if (raid_mode == RAID0 || inode->blocks[N_BLOCKS-1] == 0) {
+        return;
     }
+    sync_block_data(block_data(inode->blocks[N_BLOCKS-1], 0), BLOCK_SIZE);
+}
 
-    // Allocate new inode
-    struct wfs_inode *new_inode = allocate_inode(mode);
-    if (new_inode == NULL) {
-        return -ENOSPC;
+//Block pointer (block number + 1) for file block b, or 0 for a hole.
+//Never allocates.
+static off_t get_block_ptr(struct wfs_inode *inode, size_t b) {
+    if (b < N_BLOCKS - 1) {
+        return inode->blocks[b];
     }
+    if (b - (N_BLOCKS - 1) >= POINTERS_PER_BLOCK || inode->blocks[N_BLOCKS-1] == 0) {
+        return 0;
+    }
+    return get_indirect_block(inode)[b - (N_BLOCKS - 1)];
+}
 
+//Where the pointer of file block b is kept: the inode or its indirect block,
+//which is allocated if needed. NULL if that fails.
+static off_t *block_ptr_slot(struct wfs_inode *inode, size_t b) {
+    if (b < N_BLOCKS - 1) {
+        return &inode->blocks[b];
+    }
+    off_t *indirect_ptrs = get_indirect_block(inode);
+    return indirect_ptrs ? &indirect_ptrs[b - (N_BLOCKS - 1)] : NULL;
+}
 
-    int is_inserted = add_entry_to_parent_directory(parent, file_name, new_inode->num);
-    if (is_inserted < 0) {
-        printf("Error adding entry to parent directory\n");
-        return is_inserted;
+//Reference count of data block block_num (0-based) on disk: the number of
+//files sharing it besides the first. RAID0 keeps it on the block's own disk.
+static uint16_t *block_refs(off_t block_num, size_t disk) {
+    if (raid_mode == RAID0) {
+        return (uint16_t *)((char *)disk_map[get_raid0_disk_index(block_num)] + super_block.refcount_ptr) + get_raid0_row(block_num);
+    }
+    return (uint16_t *)((char *)disk_map[disk] + super_block.refcount_ptr) + block_num;
+}
+
+//Add a file to the sharers of data block block_num. Fails with -EMLINK once
+//MAX_BLOCK_REFS files share it; the caller copies the block instead.
+static int take_block_ref(off_t block_num) {
+    size_t group = block_group(block_num);
+    pthread_mutex_lock(&group_locks[group]);
+    if (*block_refs(block_num, 0) + 1 >= MAX_BLOCK_REFS) {
+        pthread_mutex_unlock(&group_locks[group]);
+        return -EMLINK;
+    }
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        (*block_refs(block_num, disk))++;
+        if (raid_mode == RAID0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&group_locks[group]);
+    return 0;
+}
+
+//Copy on write: give file block b a block of its own if other files share
+//it, copying the old contents unless copy is 0 (the caller overwrites all of
+//it). Returns 1 if the pointer changed, 0 if the block was not shared, or
+//-ENOSPC. The caller syncs the inode and indirect block.
+static int unshare_block(struct wfs_inode *inode, size_t b, int copy) {
+    if (!(super_block.features & WFS_FEATURE_REFLINK)) {
+        return 0;
+    }
+    off_t block_num = get_block_ptr(inode, b);
+    if (block_num == 0) {
+        return 0;
+    }
+    if (*block_refs(block_num - 1, 0) == 0) {
+        forget_fingerprint(block_num - 1);  // about to be written in place
+        return 0;
+    }
+    int new_block = allocate_data_block(inode_group(inode->num));
+    if (new_block < 0) {
+        return -ENOSPC;
+    }
+    for (size_t c = 0; copy && c < data_copies(); c++) {
+        memcpy(block_data(new_block + 1, c), block_data(block_num, c), BLOCK_SIZE);
+    }
+    if (copy) {
+        update_parity(block_data(new_block + 1, 0));
+    }
+    free_data_block(block_num - 1);  // drops our reference only
+    *block_ptr_slot(inode, b) = new_block + 1;
+    return 1;
+}
+
+//Fingerprint table entry of data block block_num, placed like its reference count
+static uint64_t *block_fingerprint(off_t block_num, size_t disk) {
+    if (raid_mode == RAID0) {
+        return (uint64_t *)((char *)disk_map[get_raid0_disk_index(block_num)] + super_block.dedupe_ptr) + get_raid0_row(block_num);
+    }
+    return (uint64_t *)((char *)disk_map[disk] + super_block.dedupe_ptr) + block_num;
+}
+
+#define XXH_PRIME1 (11400714785074694791ULL)
+#define XXH_PRIME2 (14029467366897019727ULL)
+#define XXH_PRIME3 (1609587929392839161ULL)
+#define XXH_PRIME4 (9650029242287828579ULL)
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * XXH_PRIME1;
+}
+
+//XXH64 of one block. Its four independent lanes keep the multipliers busy
+//(and let the compiler vectorize), so hashing runs near memory speed.
+//Never 0, which marks a block without a fingerprint.
+static uint64_t fingerprint(const char *data) {
+    uint64_t v[4] = { XXH_PRIME1 + XXH_PRIME2, XXH_PRIME2, 0, -XXH_PRIME1 };
+    for (size_t i = 0; i < BLOCK_SIZE; i += 4 * sizeof(uint64_t)) {
+        for (size_t lane = 0; lane < 4; lane++) {
+            uint64_t input;
+            memcpy(&input, data + i + lane * sizeof(uint64_t), sizeof(input));
+            v[lane] = xxh_round(v[lane], input);
+        }
     }
+    uint64_t h = ((v[0] << 1) | (v[0] >> 63)) + ((v[1] << 7) | (v[1] >> 57)) +
+                 ((v[2] << 12) | (v[2] >> 52)) + ((v[3] << 18) | (v[3] >> 46));
+    for (size_t lane = 0; lane < 4; lane++) {
+        h = (h ^ xxh_round(0, v[lane])) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    h += BLOCK_SIZE;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h ? h : 1;
+}
 
+//Indexed block holding exactly data (fingerprint fp), as a 1-based block
+//pointer, or 0. Contents are compared, so a hash collision never shares.
+static off_t dedupe_find(uint64_t fp, const char *data) {
+    for (size_t i = fp & dedupe_index_mask; dedupe_index[i].block_ptr != 0; i = (i + 1) & dedupe_index_mask) {
+        if (dedupe_index[i].fp == fp && memcmp(block_data(dedupe_index[i].block_ptr, 0), data, BLOCK_SIZE) == 0) {
+            return dedupe_index[i].block_ptr;
+        }
+    }
+    return 0;
+}
 
-    //Update parent inode on all disks
+//Index a file block just written whole, and record its fingerprint
+static void dedupe_insert(uint64_t fp, off_t block_ptr) {
+    size_t i = fp & dedupe_index_mask;
+    while (dedupe_index[i].block_ptr != 0) {
+        i = (i + 1) & dedupe_index_mask;
+    }
+    dedupe_index[i].fp = fp;
+    dedupe_index[i].block_ptr = block_ptr;
     for (size_t disk = 0; disk < num_disks; disk++) {
-        // Calculate block-aligned offset for parent inode
-        char *inode_block = (char *)disk_map[disk] + super_block.i_blocks_ptr + 
-                        (parent->num * BLOCK_SIZE);
-        // Write parent inode at start of its block
-        memcpy(inode_block, parent, sizeof(struct wfs_inode));
+        *block_fingerprint(block_ptr - 1, disk) = fp;
+        if (raid_mode == RAID0) {
+            break;
+        }
+    }
+}
+
+//Drop data block block_num from the index before it is written in place or
+//freed. Later entries of its probe run are shifted back over the hole, so
+//lookups never need tombstones.
+static void forget_fingerprint(off_t block_num) {
+    if (!(super_block.features & WFS_FEATURE_DEDUPE)) {
+        return;
+    }
+    uint64_t fp = *block_fingerprint(block_num, 0);
+    if (fp == 0) {
+        return;
+    }
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        *block_fingerprint(block_num, disk) = 0;
+        if (raid_mode == RAID0) {
+            break;
+        }
+    }
+    size_t i = fp & dedupe_index_mask;
+    while (dedupe_index[i].block_ptr != block_num + 1) {
+        if (dedupe_index[i].block_ptr == 0) {
+            return;
+        }
+        i = (i + 1) & dedupe_index_mask;
+    }
+    for (size_t j = (i + 1) & dedupe_index_mask; dedupe_index[j].block_ptr != 0; j = (j + 1) & dedupe_index_mask) {
+        //an entry may fill the hole if its home is not in (i, j]
+        size_t home = dedupe_index[j].fp & dedupe_index_mask;
+        if (((j - home) & dedupe_index_mask) >= ((j - i) & dedupe_index_mask)) {
+            dedupe_index[i] = dedupe_index[j];
+            i = j;
+        }
+    }
+    dedupe_index[i].block_ptr = 0;
+}
+
+//Make room in the dedupe index for total blocks, keeping its entries
+static int grow_dedupe_index(size_t total) {
+    size_t old_size = dedupe_index_mask + 1;
+    size_t size = old_size;
+    while (size < 2 * total) {
+        size <<= 1;
+    }
+    if (size == old_size) {
+        return 0;
+    }
+    struct dedupe_entry *old = dedupe_index;
+    dedupe_index = calloc(size, sizeof(struct dedupe_entry));
+    if (!dedupe_index) {
+        dedupe_index = old;
+        return -ENOMEM;
+    }
+    dedupe_index_mask = size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].block_ptr != 0) {
+            dedupe_insert(old[i].fp, old[i].block_ptr);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+//Build the dedupe index from the fingerprint table, with room for twice as
+//many entries as there are blocks. After an unclean unmount every
+//fingerprint is checked against its block first, and those of free or
+//rewritten blocks are dropped. Returns 0 or -ENOMEM.
+static int build_dedupe_index(int verify) {
+    size_t total = volume_data_blocks();
+    size_t size = 1;
+    while (size < 2 * total) {
+        size <<= 1;
+    }
+    dedupe_index = calloc(size, sizeof(struct dedupe_entry));
+    if (!dedupe_index) {
+        return -ENOMEM;
+    }
+    dedupe_index_mask = size - 1;
+    for (size_t block_num = 0; block_num < total; block_num++) {
+        uint64_t fp = *block_fingerprint(block_num, 0);
+        if (fp == 0) {
+            continue;
+        }
+        if (verify && (data_block_is_free(block_num) || fingerprint(block_data(block_num + 1, 0)) != fp)) {
+            for (size_t disk = 0; disk < num_disks; disk++) {
+                *block_fingerprint(block_num, disk) = 0;
+                if (raid_mode == RAID0) {
+                    break;
+                }
+            }
+            continue;
+        }
+        dedupe_insert(fp, block_num + 1);
+    }
+    return 0;
+}
+
+//SEEK_DATA / SEEK_HOLE: the first offset at or after offset that is in an
+//allocated block (data) or in a hole. The end of the file counts as a hole.
+//Returns -ENXIO if offset is at or past the end.
+static off_t seek_data_or_hole(struct wfs_inode *inode, off_t offset, int whence) {
+    if (offset >= inode->size) {
+        return -ENXIO;
+    }
+    if (is_inline(inode)) {
+        return whence == SEEK_DATA ? offset : inode->size;
+    }
+    size_t end_block = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (size_t b = offset / BLOCK_SIZE; b < end_block; b++) {
+        //all of a compressed cluster is data, though it only fills its first blocks
+        int allocated = get_block_ptr(inode, b) != 0 ||
+                        (is_compressed(inode) && cluster_map(inode)[b / WFS_CLUSTER_BLOCKS] != 0);
+        if (allocated == (whence == SEEK_DATA)) {
+            off_t found = (off_t)b * BLOCK_SIZE;
+            return found > offset ? found : offset;
+        }
+    }
+    return whence == SEEK_DATA ? -ENXIO : inode->size;
+}
+
+//Move an inline inode's data to a data block. Inline data is shorter than a
+//block, so it all becomes block 0, at the same offsets. An empty inode just
+//drops the flag. Returns 0 or -ENOSPC, in which case nothing changed.
+static int promote_inline_data(struct wfs_inode *inode) {
+    if (inode->size > 0) {
+        int block_num = allocate_data_block(inode_group(inode->num));
+        if (block_num < 0) {
+            return -ENOSPC;
+        }
+        //the new block may hold old data, so the tail past the inline data is cleared
+        for (size_t copy = 0; copy < data_copies(); copy++) {
+            char *block = block_data(block_num + 1, copy);
+            memcpy(block, inline_data(inode), INLINE_DATA_SIZE);
+            memset(block + INLINE_DATA_SIZE, 0, BLOCK_SIZE - INLINE_DATA_SIZE);
+        }
+        update_parity(block_data(block_num + 1, 0));
+        inode->blocks[0] = block_num + 1;
+    }
+    memset(inline_data(inode), 0, INLINE_DATA_SIZE);
+    inode->flags &= ~WFS_INODE_INLINE;
+    sync_inode(inode);
+    return 0;
+}
+
+
+//Create a new inode and link it into parent under name
+int handle_inode_insertion(struct wfs_inode *parent, const char *name, mode_t mode, struct wfs_inode **new_inode) {
+    if (strlen(name) >= MAX_NAME) {
+        return -ENAMETOOLONG;
+    }
+    if (find_dir_entry(parent, name)) {
+        return -EEXIST;
+    }
+    int err = cow_inode(parent);
+    if (err < 0) {
+        return err;
     }
-    free(file_name);
-    free(parent_path);
+
+    // Allocate new inode
+    struct wfs_inode *inode = allocate_inode(mode, inode_group(parent->num));
+    if (inode == NULL) {
+        return -ENOSPC;
+    }
+    //files and directories made in a compressed directory are compressed
+    if ((parent->flags & WFS_INODE_COMPRESSED) && (S_ISREG(mode) || S_ISDIR(mode))) {
+        inode->flags |= WFS_INODE_COMPRESSED;
+        sync_inode(inode);
+    }
+
+    int is_inserted = add_entry_to_parent_directory(parent, name, inode->num);
+    if (is_inserted < 0) {
+        printf("Error adding entry to parent directory\n");
+        free_inode(inode);
+        return is_inserted;
+    }
+
+    parent->mtim = parent->ctim = time(NULL);
+    sync_inode(parent);
+    *new_inode = inode;
     return 0;
 }
 
@@ -443,56 +1634,261 @@ static int remove_dir_entry(struct wfs_inode *parent, const char *name) {
     if (!entry) {
         return -ENOENT;
     }
-    // Calculate block offset and entry position
-    off_t block_offset = super_block.d_blocks_ptr + 
-                        ((parent->blocks[0] - 1) * BLOCK_SIZE);
-    size_t entry_offset = (char *)entry - ((char *)disk_map[0] + block_offset);
 
+    size_t disk, row;
     if (raid_mode == RAID0) {
         // Just clear entry in single disk for RAID0
         memset(entry, 0, sizeof(struct wfs_dentry));
+    } else if (data_block_row(entry, &disk, &row)) {
+        // In a directory block: clear it in every copy, or update the parity
+        memset(entry, 0, sizeof(struct wfs_dentry));
+        sync_block_data((char *)entry, sizeof(struct wfs_dentry));
     } else {
-        // Clear entry in all disks for RAID1
+        // Clear entry of an inline directory in all disks, at the same offset as on the first disk
+        size_t entry_offset = (char *)entry - (char *)disk_map[0];
         for (size_t disk = 0; disk < num_disks; disk++) {
-            struct wfs_dentry *disk_entry = (struct wfs_dentry *)
-                ((char *)disk_map[disk] + block_offset + entry_offset);
-            memset(disk_entry, 0, sizeof(struct wfs_dentry));
+            memset((char *)disk_map[disk] + entry_offset, 0, sizeof(struct wfs_dentry));
         }
     }
 
     // Update parent metadata
     parent->size -= sizeof(struct wfs_dentry);
     parent->nlinks--;
+    parent->mtim = parent->ctim = time(NULL);
+    sync_inode(parent);
 
-    // Update parent inode on all disks
+    return 0;
+}
+
+//Point an existing directory entry at another inode. It is a single store on
+//each disk, so the name refers to the old or the new inode at any moment and
+//never to neither. Entries of an inline directory are mirrored by the
+//caller's sync_inode() of the directory.
+static void set_dir_entry_num(struct wfs_dentry *entry, int num) {
+    size_t disk, row;
+    if (raid_mode == RAID0) {
+        entry->num = num;
+        return;
+    }
+    if (data_block_row(entry, &disk, &row)) {
+        entry->num = num;
+        sync_block_data((char *)&entry->num, sizeof(entry->num));
+        return;
+    }
+    size_t entry_offset = (char *)entry - (char *)disk_map[0];
     for (size_t disk = 0; disk < num_disks; disk++) {
-        char *inode_block = (char *)disk_map[disk] + super_block.i_blocks_ptr + 
-                           (parent->num * BLOCK_SIZE);
-        memcpy(inode_block, parent, sizeof(struct wfs_inode));
+        ((struct wfs_dentry *)((char *)disk_map[disk] + entry_offset))->num = num;
     }
+}
 
+//Whether inode num is dir itself or anywhere below it. Directories have no
+//".." entries on disk, so this walks dir's subtree; rename only needs it when
+//a directory moves to another parent.
+static int dir_contains(struct wfs_inode *dir, int num) {
+    if (dir->num == num) {
+        return 1;
+    }
+    for (int block_idx = 0; block_idx < N_BLOCKS - 1; block_idx++) {
+        size_t count;
+        struct wfs_dentry *entries = get_dir_entries(dir, block_idx, &count);
+        if (!entries) continue;
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].num == 0) continue;
+            struct wfs_inode *child = get_inode_by_num(entries[i].num);
+            if (S_ISDIR(child->mode) && dir_contains(child, num)) {
+                return 1;
+            }
+        }
+    }
     return 0;
 }
 
-//Helper to free data blocks
-static void free_data_blocks(struct wfs_inode *inode) {
-    // Handle direct blocks
-    for (int i = 0; i < N_BLOCKS - 1; i++) {
-        if (inode->blocks[i] == 0) continue; // Skip unallocated blocks
+//Rows [start, end) of one disk's data region, freed and waiting to be
+//discarded; empty when start == end
+struct discard_run {
+    size_t start;
+    size_t end;
+};
+
+//Whether row of disk's data region holds no allocated block of group, so
+//its contents can be dropped. A RAID5/RAID6 row only counts once all of its
+//data blocks are free, when its parity is all zeros as well. Called with the
+//group's lock held, so blocks of other groups never count as free.
+static int discard_row_is_free(size_t disk, size_t row, size_t group) {
+    size_t first = row, count = 1;
+    if (raid_mode == RAID0) {
+        first = row * num_disks + disk;
+    } else if (raid_mode == RAID10) {
+        first = row * (num_disks / 2) + disk / 2;
+    } else if (parity_disks()) {
+        count = num_disks - parity_disks();
+        first = row * count;
+    }
+    for (size_t block_num = first; block_num < first + count; block_num++) {
+        if (block_num >= volume_data_blocks() || block_group(block_num) != group ||
+            !data_block_is_free(block_num)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//Hand the rows of run back to the host filesystem. The host only frees whole
+//pages, so the run is first widened over free neighbouring rows of group to
+//page boundaries, and only the whole pages inside it are punched out: blocks
+//freed one at a time are released once the rest of their page follows.
+//Punched rows read as zeros, which also keeps RAID5/RAID6 parity right.
+static void discard_rows(size_t disk, struct discard_run *run, size_t group) {
+    size_t rows = (raid_mode == RAID0) ? super_block.num_data_blocks : data_region_blocks();
+    off_t page = sysconf(_SC_PAGESIZE);
+    size_t start = run->start, end = run->end;
+    run->start = run->end = 0;
+    if (start == end || disk_fds[disk] < 0) {
+        return;
+    }
+    while (start > 0 && (super_block.d_blocks_ptr + (off_t)start * BLOCK_SIZE) % page != 0 &&
+           discard_row_is_free(disk, start - 1, group)) {
+        start--;
+    }
+    while (end < rows && (super_block.d_blocks_ptr + (off_t)end * BLOCK_SIZE) % page != 0 &&
+           discard_row_is_free(disk, end, group)) {
+        end++;
+    }
+    off_t offset = super_block.d_blocks_ptr + (off_t)start * BLOCK_SIZE;
+    off_t offset_end = super_block.d_blocks_ptr + (off_t)end * BLOCK_SIZE;
+    offset += (page - offset % page) % page;
+    offset_end -= offset_end % page;
+    if (offset_end <= offset) {
+        return;
+    }
+    //MADV_REMOVE covers backing files that can only be punched through a mapping
+    if (fallocate(disk_fds[disk], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, offset_end - offset) != 0 &&
+        madvise((char *)disk_map[disk] + offset, offset_end - offset, MADV_REMOVE) != 0) {
+        __atomic_store_n(&options.discard, 0, __ATOMIC_RELAXED);  // the host cannot, stop trying
+    }
+}
+
+//Queue the places of freed data block block_num (0-based, in group) for
+//discarding, extending each disk's run when the block follows on from it
+static void discard_block(struct discard_run *runs, off_t block_num, size_t group) {
+    size_t row;
+    if (raid_mode == RAID0) {
+        row = get_raid0_row(block_num);
+    } else if (raid_mode == RAID10) {
+        row = block_num / (num_disks / 2);
+    } else if (parity_disks()) {
+        row = block_num / (num_disks - parity_disks());
+        if (!discard_row_is_free(0, row, group)) {
+            return;  // other data blocks of the row are still in use
+        }
+    } else {
+        row = block_num;
+    }
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        if ((raid_mode == RAID0 && disk != get_raid0_disk_index(block_num)) ||
+            (raid_mode == RAID10 && disk / 2 != block_num % (num_disks / 2))) {
+            continue;
+        }
+        struct discard_run *run = &runs[disk];
+        if (row >= run->start && row < run->end) {
+            continue;
+        }
+        if (row != run->end) {
+            discard_rows(disk, run, group);
+            run->start = row;
+        }
+        run->end = row + 1;
+    }
+}
 
+//Release the data blocks behind n block pointers in the bitmaps (0 pointers
+//are skipped); a block other files still share just loses a reference. A
+//group's lock is held across consecutive blocks of that group and the
+//summary counters are updated once at the end, so large files and long
+//truncates are freed in bulk. Unless discarding is off, the freed blocks are
+//punched out of the disk images in runs before the group is unlocked, so the
+//images stay as sparse as the volume is empty; a reshape moves blocks
+//between groups, so nothing is discarded while one runs.
+static void free_block_ptrs(const off_t *ptrs, size_t n) {
+    size_t freed[num_disks];
+    memset(freed, 0, sizeof(freed));
+    struct discard_run runs[num_disks];
+    memset(runs, 0, sizeof(runs));
+    int discard = __atomic_load_n(&options.discard, __ATOMIC_RELAXED) && !reshape_disks &&
+                  __atomic_load_n(&num_lost, __ATOMIC_RELAXED) == 0;
+    size_t locked = SIZE_MAX;
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == 0) continue;
+        off_t block_num = ptrs[i] - 1;
+        size_t group = block_group(block_num);
+        if (group != locked) {
+            if (locked != SIZE_MAX) {
+                for (size_t disk = 0; discard && disk < num_disks; disk++) {
+                    discard_rows(disk, &runs[disk], locked);
+                }
+                pthread_mutex_unlock(&group_locks[locked]);
+            }
+            pthread_mutex_lock(&group_locks[group]);
+            locked = group;
+        }
+        //a shared block only loses one of its sharers
+        if ((super_block.features & WFS_FEATURE_REFLINK) && *block_refs(block_num, 0) > 0) {
+            for (size_t disk = 0; disk < num_disks; disk++) {
+                (*block_refs(block_num, disk))--;
+                if (raid_mode == RAID0) {
+                    break;
+                }
+            }
+            continue;
+        }
+        forget_fingerprint(block_num);
         if (raid_mode == RAID0) {
-            size_t disk_idx = get_raid0_disk_index(inode->blocks[i] - 1);
+            size_t disk_idx = get_raid0_disk_index(block_num);
             char *disk_bitmap = (char *)disk_map[disk_idx] + super_block.d_bitmap_ptr;
-            int local_block = (inode->blocks[i] - 1) / num_disks;
+            size_t local_block = get_raid0_row(block_num);
             disk_bitmap[local_block / 8] &= ~(1 << (local_block % 8));
+            get_group_desc(disk_idx, group)->free_blocks++;
+            freed[disk_idx]++;
         } else {
-            int block_num = inode->blocks[i] - 1;
             for (size_t disk = 0; disk < num_disks; disk++) {
                 char *disk_bitmap = (char *)disk_map[disk] + super_block.d_bitmap_ptr;
                 disk_bitmap[block_num / 8] &= ~(1 << (block_num % 8));
+                get_group_desc(disk, group)->free_blocks++;
+            }
+            freed[0]++;
+        }
+        if (discard) {
+            discard_block(runs, block_num, group);
+        }
+    }
+    if (locked != SIZE_MAX) {
+        for (size_t disk = 0; discard && disk < num_disks; disk++) {
+            discard_rows(disk, &runs[disk], locked);
+        }
+        pthread_mutex_unlock(&group_locks[locked]);
+    }
+
+    if (raid_mode == RAID0) {
+        for (size_t disk = 0; disk < num_disks; disk++) {
+            if (freed[disk] > 0) {
+                adjust_free_counts(0, freed[disk], disk);
             }
         }
+    } else if (freed[0] > 0) {
+        adjust_free_counts(0, freed[0], -1);
     }
+}
+
+//Helper to release one data block (1-based block pointer value minus one) in the bitmaps
+static void free_data_block(off_t block_num) {
+    off_t ptr = block_num + 1;
+    free_block_ptrs(&ptr, 1);
+}
+
+//Helper to free data blocks
+static void free_data_blocks(struct wfs_inode *inode) {
+    // Handle direct blocks
+    free_block_ptrs(inode->blocks, N_BLOCKS - 1);
 
     //DEBUG
     // for(int i = 0; i < N_BLOCKS; i++){
@@ -504,109 +1900,1488 @@ static void free_data_blocks(struct wfs_inode *inode) {
     // Handle indirect block
     if (inode->blocks[N_BLOCKS-1] != 0) {
         off_t *indirect_ptrs = get_indirect_block(inode);
-        for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
-            printf("%ld ", indirect_ptrs[i]);
-        }
         // Clear indirect block's data blocks
-        for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
-            if (indirect_ptrs[i] == 0) continue; // Skip unallocated blocks
-            if (raid_mode == RAID0) {
-                size_t disk_idx = get_raid0_disk_index(indirect_ptrs[i] - 1);
-                char *disk_bitmap = (char *)disk_map[disk_idx] + super_block.d_bitmap_ptr;
-                int local_block = (indirect_ptrs[i] - 1) / num_disks;
-                disk_bitmap[local_block / 8] &= ~(1 << (local_block % 8));
-            } else {
-                int block_num = indirect_ptrs[i] - 1;
-                for (size_t disk = 0; disk < num_disks; disk++) {
-                    char *disk_bitmap = (char *)disk_map[disk] + super_block.d_bitmap_ptr;
-                    disk_bitmap[block_num / 8] &= ~(1 << (block_num % 8));
-                }
-            }
-        }
+        free_block_ptrs(indirect_ptrs, POINTERS_PER_BLOCK);
 
         // Clear indirect block itself
-        if (raid_mode == RAID0) {
-            size_t disk_idx = get_raid0_disk_index(inode->blocks[N_BLOCKS-1] - 1);
-            char *disk_bitmap = (char *)disk_map[disk_idx] + super_block.d_bitmap_ptr;
-            int local_block = (inode->blocks[N_BLOCKS-1] - 1) / num_disks;
-            disk_bitmap[local_block / 8] &= ~(1 << (local_block % 8));
-        } else {
-            int block_num = inode->blocks[N_BLOCKS-1] - 1;
-            for (size_t disk = 0; disk < num_disks; disk++) {
-                char *disk_bitmap = (char *)disk_map[disk] + super_block.d_bitmap_ptr;
-                disk_bitmap[block_num / 8] &= ~(1 << (block_num % 8));
-            }
-        }
+        free_data_block(inode->blocks[N_BLOCKS-1] - 1);
     }
 }
 
 //Helper to free inode
 static void free_inode(struct wfs_inode *inode) {
+    free_data_blocks(inode);
+
+    if (super_block.features & WFS_FEATURE_SNAPSHOTS) {
+        //snapshots find older versions of a deleted inode through its slot,
+        //which stays allocated until they are gone, see prune_inode_versions()
+        if (!(inode->flags & WFS_INODE_SNAPSHOT) && get_inode_version(0, inode->num)->prev != 0) {
+            memset(inode->blocks, 0, sizeof(inode->blocks));
+            memset(inline_data(inode), 0, INLINE_DATA_SIZE);
+            inode->size = 0;
+            inode->flags = WFS_INODE_DELETED;
+            sync_inode(inode);
+            return;
+        }
+        set_inode_version(inode->num, 0, 0);
+    }
+
     // Clear inode bitmap on all disks
+    size_t group = inode_group(inode->num);
+    pthread_mutex_lock(&group_locks[group]);
     for (size_t disk = 0; disk < num_disks; disk++) {
         char *inode_bitmap = (char *)disk_map[disk] + super_block.i_bitmap_ptr;
         inode_bitmap[inode->num / 8] &= ~(1 << (inode->num % 8));
+        get_group_desc(disk, group)->free_inodes++;
     }
-    free_data_blocks(inode);
+    pthread_mutex_unlock(&group_locks[group]);
+    adjust_free_counts(1, 0, -1);
 }
 
+//Drop an inode whose last link is gone. If the kernel still holds a lookup
+//reference (an open file, a cached dentry) it stays allocated as an orphan
+//and wfs_forget() frees it when the count drops to zero.
+//Called with fs_lock held for writing.
+static void release_inode(struct wfs_inode *inode) {
+    inode->nlinks = 0;
+    inode->ctim = time(NULL);
+    sync_inode(inode);
+    if (__atomic_load_n(&lookup_counts[inode->num], __ATOMIC_RELAXED) == 0) {
+        free_inode(inode);
+    } else {
+        orphan_count++;
+    }
+}
 
+//Free every orphan left in the inode table. Used at unmount, when the kernel
+//no longer holds references, and after an unclean shutdown.
+static void reclaim_orphans(void) {
+    char *bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
+    for (size_t num = 1; num < super_block.num_inodes; num++) {
+        if ((bitmap[num / 8] >> (num % 8)) & 1) {
+            struct wfs_inode *inode = get_inode_by_num(num);
+            if (inode->nlinks == 0 && !(inode->flags & WFS_INODE_DELETED)) {
+                free_inode(inode);
+            }
+        }
+    }
+    orphan_count = 0;
+}
 
-//======================DEBUG FUNCTIONS===========================//
 
+//Snapshot record i on disk
+static struct wfs_snapshot *get_snapshot(size_t disk, size_t i) {
+    return (struct wfs_snapshot *)((char *)disk_map[disk] + super_block.snapshots_ptr) + i;
+}
 
+//Version entry of inode slot num on disk; the table follows the snapshot records
+static struct wfs_inode_version *get_inode_version(size_t disk, int num) {
+    char *table = (char *)disk_map[disk] + super_block.snapshots_ptr + MAX_SNAPSHOTS * sizeof(struct wfs_snapshot);
+    return (struct wfs_inode_version *)table + num;
+}
 
-void debug_print_inode_bitmap() {
-    printf("\n=== Inode Bitmap Contents ===\n");
-    
+//Set the version entry of slot num on every disk
+static void set_inode_version(int num, unsigned int gen, int prev) {
     for (size_t disk = 0; disk < num_disks; disk++) {
-        printf("\nDisk %zu:\n", disk);
-        char *inode_bitmap = (char *)disk_map[disk] + super_block.i_bitmap_ptr;
-        
-        for (int i = 0; i < super_block.num_inodes; i++) {
-            int byte_offset = i / 8;
-            int bit_position = i % 8;
-            int is_allocated = (inode_bitmap[byte_offset] & (1 << bit_position)) ? 1 : 0;
-            
-            printf("%d", is_allocated);
-            if ((i + 1) % 8 == 0) printf(" "); // Space every 8 bits
-            if ((i + 1) % 32 == 0) printf("\n"); // Newline every 32 bits
+        struct wfs_inode_version *version = get_inode_version(disk, num);
+        version->gen = gen;
+        version->prev = prev;
+    }
+}
+
+//Whether a FUSE inode number belongs to a snapshot view or /.snapshots
+static inline int is_snapshot_ino(fuse_ino_t ino) {
+    return (ino >> SNAPSHOT_INO_SHIFT) != 0;
+}
+
+//FUSE inode number of inode num in the same view (live or snapshot) as ino
+static inline fuse_ino_t view_ino(fuse_ino_t ino, int num) {
+    return (ino & ~(((fuse_ino_t)1 << SNAPSHOT_INO_SHIFT) - 1)) | num_to_ino(num);
+}
+
+//Record index of the snapshot called name, or -1
+static int find_snapshot(const char *name) {
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        struct wfs_snapshot *snap = get_snapshot(0, i);
+        if (snap->gen != 0 && strncmp(snap->name, name, MAX_NAME) == 0) {
+            return i;
         }
-        printf("\n");
     }
-    printf("===========================\n");
+    return -1;
 }
 
-void debug_print_inodes(int disk_idx) {
-    printf("\n=== Allocated Inodes Contents ===\n");
-    
-    char *inode_region = (char *)disk_map[disk_idx] + super_block.i_blocks_ptr;
-    char *inode_bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
-    
-    for (int i = 0; i < super_block.num_inodes; i++) {
-        int byte_offset = i / 8;
-        int bit_position = i % 8;
-        int is_allocated = (inode_bitmap[byte_offset] & (1 << bit_position)) ? 1 : 0;
-        
-        if (is_allocated) {
-            struct wfs_inode *inode = (struct wfs_inode *)(inode_region + (i * BLOCK_SIZE));
-            printf("\nInode %d:\n", i);
-            printf("  mode: %d\n", inode->mode);
-            printf("  uid: %d\n", inode->uid);
-            printf("  gid: %d\n", inode->gid);
-            printf("  size: %ld\n", inode->size);
-            printf("  nlinks: %d\n", inode->nlinks);
-            printf("  blocks[0]: %ld\n", inode->blocks[0]);
-            printf("  atime: %ld\n", inode->atim);
-            printf("  mtime: %ld\n", inode->mtim);
-            printf("  ctime: %ld\n", inode->ctim);
+//Generation of the newest snapshot, 0 if there is none
+static unsigned int newest_snapshot_gen(void) {
+    unsigned int newest = 0;
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (get_snapshot(0, i)->gen > newest) {
+            newest = get_snapshot(0, i)->gen;
         }
     }
-    printf("===========================\n");
+    return newest;
 }
 
-void debug_print_data_bitmap(){
-    printf("\n=== Data Bitmap Contents ===\n");
+//The version of inode num a snapshot of generation gen sees: the live inode
+//if it has not changed since, else the newest copy that is old enough. NULL
+//if the inode did not exist yet.
+static struct wfs_inode *inode_at_gen(int num, unsigned int gen) {
+    struct wfs_inode *inode = get_inode_by_num(num);
+    char *bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
+    if (((bitmap[num / 8] >> (num % 8)) & 1) && !(inode->flags & (WFS_INODE_SNAPSHOT | WFS_INODE_DELETED)) &&
+        get_inode_version(0, num)->gen <= gen) {
+        return inode;
+    }
+    for (int n = get_inode_version(0, num)->prev; n != 0; n = get_inode_version(0, n)->prev) {
+        if (get_inode_version(0, n)->gen <= gen) {
+            return get_inode_by_num(n);
+        }
+    }
+    return NULL;
+}
+
+//Give a copy of an inode its own reference to the block behind *ptr, or its
+//own copy of the data once the block has MAX_BLOCK_REFS sharers
+static int share_block(off_t *ptr, size_t group) {
+    if (*ptr == 0 || take_block_ref(*ptr - 1) == 0) {
+        return 0;
+    }
+    int block_num = allocate_data_block(group);
+    if (block_num < 0) {
+        return -ENOSPC;
+    }
+    for (size_t copy = 0; copy < data_copies(); copy++) {
+        memcpy(block_data(block_num + 1, copy), block_data(*ptr, copy), BLOCK_SIZE);
+    }
+    update_parity(block_data(block_num + 1, 0));
+    *ptr = block_num + 1;
+    return 0;
+}
+
+//Make the block pointers of a freshly copied inode its own: data blocks are
+//shared with the original, the indirect block is copied since the original
+//keeps changing its pointers. On failure the pointers not yet taken over are
+//cleared, so freeing the copy releases exactly what it holds.
+static int share_inode_blocks(struct wfs_inode *copy) {
+    if (is_inline(copy)) {
+        return 0;
+    }
+    size_t group = inode_group(copy->num);
+    for (size_t b = 0; b < N_BLOCKS - 1; b++) {
+        if (share_block(&copy->blocks[b], group) < 0) {
+            memset(&copy->blocks[b], 0, (N_BLOCKS - b) * sizeof(off_t));
+            return -ENOSPC;
+        }
+    }
+    off_t indirect = copy->blocks[N_BLOCKS - 1];
+    if (indirect == 0) {
+        return 0;
+    }
+    copy->blocks[N_BLOCKS - 1] = 0;
+    off_t *indirect_ptrs = get_indirect_block(copy);
+    if (!indirect_ptrs) {
+        return -ENOSPC;
+    }
+    memcpy(indirect_ptrs, block_data(indirect, 0), BLOCK_SIZE);
+    int err = 0;
+    for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+        if (share_block(&indirect_ptrs[i], group) < 0) {
+            memset(&indirect_ptrs[i], 0, (POINTERS_PER_BLOCK - i) * sizeof(off_t));
+            err = -ENOSPC;
+            break;
+        }
+    }
+    sync_indirect_block(copy);
+    return err;
+}
+
+//Whether a snapshot sees the current version of inode, which cow_inode()
+//then copies first. An unlinked inode is in no snapshot taken since, and was copied
+//when it was unlinked.
+static int needs_cow(struct wfs_inode *inode) {
+    if (!(super_block.features & WFS_FEATURE_SNAPSHOTS)) {
+        return 0;
+    }
+    unsigned int newest = newest_snapshot_gen();
+    return newest != 0 && get_inode_version(0, inode->num)->gen <= newest && inode->nlinks > 0;
+}
+
+//Called before inode changes. If a snapshot sees its current version, that
+//version is first copied to a free slot sharing its data blocks and linked
+//into the inode's version chain; later changes find the inode already newer
+//than every snapshot. A directory's entry blocks are then unshared, since
+//entries are written in place. Returns 0 or -ENOSPC.
+static int cow_inode(struct wfs_inode *inode) {
+    if (!(super_block.features & WFS_FEATURE_SNAPSHOTS)) {
+        return 0;
+    }
+    if (needs_cow(inode)) {
+        struct wfs_inode_version *version = get_inode_version(0, inode->num);
+        struct wfs_inode *copy = allocate_inode(inode->mode, inode_group(inode->num));
+        if (!copy) {
+            return -ENOSPC;
+        }
+        int num = copy->num;
+        memcpy(copy, inode, BLOCK_SIZE);
+        copy->num = num;
+        copy->flags |= WFS_INODE_SNAPSHOT;
+        int err = share_inode_blocks(copy);
+        if (err < 0) {
+            free_inode(copy);
+            return err;
+        }
+        sync_inode(copy);
+        set_inode_version(num, version->gen, version->prev);
+        set_inode_version(inode->num, super_block.snap_gen, num);
+    }
+    if (S_ISDIR(inode->mode) && !is_inline(inode)) {
+        for (size_t b = 0; b < N_BLOCKS - 1; b++) {
+            int unshared = unshare_block(inode, b, 1);
+            if (unshared < 0) {
+                sync_inode(inode);
+                return unshared;
+            }
+        }
+        sync_inode(inode);
+    }
+    return 0;
+}
+
+//The lock of the file behind FUSE inode ino in inode_locks
+static pthread_rwlock_t *inode_lock(fuse_ino_t ino) {
+    return &inode_locks[(ino & (((fuse_ino_t)1 << SNAPSHOT_INO_SHIFT) - 1)) % NUM_INODE_LOCKS];
+}
+
+//Lock file ino for reading its data or attributes
+static void read_lock_file(fuse_ino_t ino) {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(inode_lock(ino));
+}
+
+//Lock file ino for a write, truncate or fallocate and return its inode, or
+//NULL. That holds fs_lock for reading and the file's lock for writing,
+//unless the change reaches beyond the file: on a dedupe volume (the index is
+//shared by all files), for the first change since a snapshot (the copy is
+//linked into a version chain lookups follow) and for anything but a regular
+//file (cow_inode() moves a directory's entry blocks) fs_lock is taken for
+//writing instead. *exclusive tells unlock_file() which.
+static struct wfs_inode *write_lock_file(fuse_ino_t ino, int *exclusive) {
+    *exclusive = (super_block.features & WFS_FEATURE_DEDUPE) != 0;
+    if (*exclusive) {
+        pthread_rwlock_wrlock(&fs_lock);
+        return get_inode_by_ino(ino);
+    }
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(inode_lock(ino));
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    if (inode && !is_snapshot_ino(ino) && (!S_ISREG(inode->mode) || needs_cow(inode))) {
+        pthread_rwlock_unlock(inode_lock(ino));
+        pthread_rwlock_unlock(&fs_lock);
+        pthread_rwlock_wrlock(&fs_lock);
+        *exclusive = 1;
+        inode = get_inode_by_ino(ino);
+    }
+    return inode;
+}
+
+//Undo read_lock_file() (exclusive 0) or write_lock_file()
+static void unlock_file(fuse_ino_t ino, int exclusive) {
+    if (!exclusive) {
+        pthread_rwlock_unlock(inode_lock(ino));
+    }
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+//Take a snapshot of the whole filesystem. Nothing is copied: the snapshot
+//gets the current generation and the live filesystem moves on to the next,
+//so inodes are copied by cow_inode() as they change. slot is set to the
+//snapshot's record. Called with fs_lock held for writing, which makes the
+//snapshot atomic with respect to every other change.
+static int take_snapshot(const char *name, size_t *slot) {
+    if (strlen(name) >= MAX_NAME) {
+        return -ENAMETOOLONG;
+    }
+    if (find_snapshot(name) >= 0) {
+        return -EEXIST;
+    }
+    size_t i = 0;
+    while (i < MAX_SNAPSHOTS && get_snapshot(0, i)->gen != 0) {
+        i++;
+    }
+    if (i == MAX_SNAPSHOTS) {
+        return -ENOSPC;
+    }
+    unsigned int gen = super_block.snap_gen;
+    super_block.snap_gen = gen + 1;
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        struct wfs_snapshot *snap = get_snapshot(disk, i);
+        memset(snap, 0, sizeof(struct wfs_snapshot));
+        strncpy(snap->name, name, MAX_NAME);
+        snap->gen = gen;
+        ((struct wfs_sb *)disk_map[disk])->snap_gen = gen + 1;
+    }
+    *slot = i;
+    return 0;
+}
+
+//Whether a remaining snapshot sees versions dating from generation from,
+//superseded at generation to
+static int snapshot_sees(unsigned int from, unsigned int to) {
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        unsigned int gen = get_snapshot(0, i)->gen;
+        if (gen != 0 && gen >= from && gen < to) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Free the inode copies no remaining snapshot sees, and the slots of deleted
+//inodes left without copies. Walks the whole inode table.
+static void prune_inode_versions(void) {
+    char *bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
+    for (size_t num = 0; num < super_block.num_inodes; num++) {
+        struct wfs_inode *inode = get_inode_by_num(num);
+        if (!((bitmap[num / 8] >> (num % 8)) & 1) || (inode->flags & WFS_INODE_SNAPSHOT)) {
+            continue;  // copies are reached through the chain of their inode
+        }
+        int newer = num;
+        unsigned int newer_gen = get_inode_version(0, num)->gen;
+        int n = get_inode_version(0, num)->prev;
+        while (n != 0) {
+            unsigned int gen = get_inode_version(0, n)->gen;
+            int older = get_inode_version(0, n)->prev;
+            if (snapshot_sees(gen, newer_gen)) {
+                newer = n;
+                newer_gen = gen;
+            } else {
+                set_inode_version(newer, get_inode_version(0, newer)->gen, older);
+                free_inode(get_inode_by_num(n));
+            }
+            n = older;
+        }
+        if ((inode->flags & WFS_INODE_DELETED) && get_inode_version(0, num)->prev == 0) {
+            inode->flags = 0;
+            sync_inode(inode);
+            free_inode(inode);
+        }
+    }
+}
+
+//Delete the snapshot called name and everything only it kept
+static int delete_snapshot(const char *name) {
+    int i = find_snapshot(name);
+    if (i < 0) {
+        return -ENOENT;
+    }
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        memset(get_snapshot(disk, i), 0, sizeof(struct wfs_snapshot));
+    }
+    prune_inode_versions();
+    return 0;
+}
+
+
+//Map a disk image of size bytes whose data blocks start at meta_size, with
+//the hints of the mount options. The metadata before the data blocks (the
+//bitmaps and inode table above all) is read ahead, or with -o prefault
+//mapped in whole now, so the first requests after mount take no page faults
+//on it; only read-only, so pages that are never written do not go back to
+//disk. The data blocks get the data_advice hint, and -o hugepages asks for
+//transparent huge pages, which the host only backs file mappings with on
+//some filesystems (tmpfs); elsewhere it changes nothing.
+static void *map_disk(int fd, off_t size, off_t meta_size) {
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return map;
+    }
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t data_start = meta_size + (page - meta_size % page) % page;
+    if (options.hugepages) {
+        madvise(map, size, MADV_HUGEPAGE);
+    }
+    if (options.data_advice != MADV_NORMAL && data_start < size) {
+        madvise(map + data_start, size - data_start, options.data_advice);
+    }
+    if (!options.prefault) {
+        madvise(map, meta_size, MADV_WILLNEED);
+    } else if (madvise(map, meta_size, MADV_POPULATE_READ) != 0) {
+        //older kernels: fault the pages in one by one
+        for (off_t offset = 0; offset < meta_size; offset += page) {
+            (void)*(volatile char *)(map + offset);
+        }
+    }
+    return map;
+}
+
+//Zero a byte range of one disk image. Punching a hole keeps the image sparse
+//and drops the pages from the mapping; memset is the fallback for backing
+//files that support neither punch nor zero-range.
+static int zero_disk_range(size_t disk, off_t offset, off_t len) {
+    if (len <= 0) {
+        return 0;
+    }
+    int fd = disk_fds[disk];
+    if (fd < 0) {
+        return 0;  // a missing disk keeps nothing
+    }
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0 ||
+        fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+    memset((char *)disk_map[disk] + offset, 0, len);
+    return 0;
+}
+
+//Background initialization of the inode table, ext4 lazy_itable_init style.
+//mkfs only writes the root inode, so slots at or above i_init_hwm may hold
+//whatever the image contained before. This zeroes the unallocated slots one
+//INODE_INIT_CHUNK at a time and advances the high-water mark on every disk.
+//Chunks never cross a group boundary, so only that group's lock is held.
+//Allocated slots are skipped: allocate_inode() initializes its own slot.
+static void *itable_init_worker(void *arg) {
+    for (;;) {
+        size_t start = super_block.i_init_hwm;
+        if (__atomic_load_n(&itable_init_stop, __ATOMIC_RELAXED) || start >= super_block.num_inodes) {
+            break;
+        }
+        size_t group = inode_group(start);
+        size_t end = start + INODE_INIT_CHUNK;
+        size_t group_end = (group + 1) * super_block.inodes_per_group;
+        if (end > group_end) {
+            end = group_end;
+        }
+        if (end > super_block.num_inodes) {
+            end = super_block.num_inodes;
+        }
+        pthread_mutex_lock(&group_locks[group]);
+
+        //zero each run of free slots in [start, end) with a single call
+        char *bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
+        size_t i = start;
+        while (i < end) {
+            if ((bitmap[i / 8] >> (i % 8)) & 1) {
+                i++;
+                continue;
+            }
+            size_t run_end = i;
+            while (run_end < end && !((bitmap[run_end / 8] >> (run_end % 8)) & 1)) {
+                run_end++;
+            }
+            for (size_t disk = 0; disk < num_disks; disk++) {
+                zero_disk_range(disk, super_block.i_blocks_ptr + (off_t)i * BLOCK_SIZE,
+                                (off_t)(run_end - i) * BLOCK_SIZE);
+            }
+            i = run_end;
+        }
+
+        super_block.i_init_hwm = end;
+        for (size_t disk = 0; disk < num_disks; disk++) {
+            ((struct wfs_sb *)disk_map[disk])->i_init_hwm = end;
+        }
+        pthread_mutex_unlock(&group_locks[group]);
+    }
+    return NULL;
+}
+
+static double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static void sleep_ms(double ms) {
+    struct timespec ts = { (time_t)(ms / 1e3), (long)(ms * 1e6) % 1000000000L };
+    nanosleep(&ts, NULL);
+}
+
+//Sleep as long as it takes for bytes done since start to stay under rate KiB/s
+static void throttle(const struct timespec *start, size_t bytes, unsigned int rate) {
+    if (rate == 0) {
+        return;
+    }
+    double ahead_ms = (double)bytes / (rate * 1024.0) * 1e3 - elapsed_ms(start);
+    if (ahead_ms > 0) {
+        sleep_ms(ahead_ms);
+    }
+}
+
+//Copy the slots of a region whose bit is set in its bitmap on disk 0 to the
+//same place on disk, count slots of BLOCK_SIZE from base. Slots that are free
+//are zeroed if zero_free is set. Batches hold fs_lock for writing, so no
+//write (file data is written under a shared fs_lock) changes what is being
+//copied, for at most options.rebuild_budget ms; everything written after a
+//batch goes to disk as well. Between batches the
+//worker sleeps as long as it takes to stay under options.rebuild_rate.
+//*copied counts bytes for the rate. Returns -1 if the rebuild was stopped.
+static int rebuild_region(size_t disk, off_t bitmap_ptr, off_t base, size_t count, int zero_free,
+                          const struct timespec *start, size_t *copied) {
+    size_t pos = 0;
+    while (pos < count) {
+        if (__atomic_load_n(&rebuild_stop, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+        struct timespec batch_start;
+        clock_gettime(CLOCK_MONOTONIC, &batch_start);
+        pthread_rwlock_wrlock(&fs_lock);
+        const char *bitmap = (const char *)disk_map[0] + bitmap_ptr;
+        while (pos < count) {
+            size_t run_end = pos;
+            int used = (bitmap[pos / 8] >> (pos % 8)) & 1;
+            while (run_end < count && run_end - pos < 64 && ((bitmap[run_end / 8] >> (run_end % 8)) & 1) == used) {
+                run_end++;
+            }
+            off_t offset = base + (off_t)pos * BLOCK_SIZE;
+            size_t len = (run_end - pos) * BLOCK_SIZE;
+            if (used) {
+                memcpy((char *)disk_map[disk] + offset, (char *)disk_map[0] + offset, len);
+                *copied += len;
+            } else if (zero_free) {
+                zero_disk_range(disk, offset, len);
+            }
+            pos = run_end;
+            if (elapsed_ms(&batch_start) >= options.rebuild_budget) {
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&fs_lock);
+        throttle(start, *copied, options.rebuild_rate);
+    }
+    return 0;
+}
+
+//Reconstruct every RAID5/RAID6 row not reconstructed yet, in batches like
+//rebuild_region(). All of the metadata was copied at mount, and *copied
+//counts the bytes of the rows' places on the lost disks. Writes reconstruct
+//a row before touching it, so fs_lock is only held for reading. Returns -1
+//if the rebuild was stopped.
+static int rebuild_rows(const struct timespec *start, size_t *copied) {
+    size_t rows = super_block.num_data_blocks / (num_disks - parity_disks());
+    size_t row = 0;
+    while (row < rows) {
+        if (__atomic_load_n(&rebuild_stop, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+        struct timespec batch_start;
+        clock_gettime(CLOCK_MONOTONIC, &batch_start);
+        pthread_rwlock_rdlock(&fs_lock);
+        while (row < rows) {
+            ensure_row(row++);
+            *copied += num_lost * BLOCK_SIZE;
+            if (row % 64 == 0 && elapsed_ms(&batch_start) >= options.rebuild_budget) {
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&fs_lock);
+        throttle(start, *copied, options.rebuild_rate);
+    }
+    return 0;
+}
+
+//Online rebuild of disks that came up stale or blank. Every write since
+//mount already reaches them, so for RAID1/RAID1V this only copies what was
+//allocated before: the inode slots and data blocks set in the bitmaps
+//(metadata up to the inode table was copied at mount). RAID5/RAID6 rebuild
+//all of their lost disks at once by reconstructing every row, see
+//rebuild_rows(). Once a disk is done its superblock stops saying it is
+//rebuilding; an interrupted rebuild starts over at the next mount.
+static void *rebuild_worker(void *arg) {
+    int parity = parity_disks() > 0;
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        if (disk_health[disk] != DISK_REBUILDING) {
+            continue;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t copied = 0;
+        if (parity ? rebuild_rows(&start, &copied) < 0
+                   : rebuild_region(disk, super_block.i_bitmap_ptr, super_block.i_blocks_ptr,
+                                    super_block.num_inodes, 1, &start, &copied) < 0 ||
+                         rebuild_region(disk, super_block.d_bitmap_ptr, super_block.d_blocks_ptr,
+                                        super_block.num_data_blocks, 0, &start, &copied) < 0) {
+            break;
+        }
+        pthread_rwlock_wrlock(&fs_lock);
+        ((struct wfs_sb *)disk_map[disk])->rebuilding = 0;
+        msync(disk_map[disk], BLOCK_SIZE, MS_SYNC);
+        disk_health[disk] = DISK_HEALTHY;
+        //every row is whole on it now; a disk still missing stays lost
+        pthread_mutex_lock(&recover_lock);
+        for (size_t j = 0; parity && j < num_lost; j++) {
+            if (lost_disks[j] == disk) {
+                lost_disks[j] = lost_disks[--num_lost];
+            }
+        }
+        pthread_mutex_unlock(&recover_lock);
+        pthread_rwlock_unlock(&fs_lock);
+        printf("Rebuilt disk %zu: %zu bytes in %.0f ms\n", disk, copied, elapsed_ms(&start));
+    }
+    return NULL;
+}
+
+//Whether two blocks are identical, compared a vector at a time
+static int blocks_equal(const char *a, const char *b) {
+    parity_vec diff = { 0 };
+    for (size_t i = 0; i < PARITY_VECS; i++) {
+        parity_vec va, vb;
+        memcpy(&va, a + i * sizeof(va), sizeof(va));
+        memcpy(&vb, b + i * sizeof(vb), sizeof(vb));
+        diff |= va ^ vb;
+    }
+    uint64_t words[sizeof(diff) / sizeof(uint64_t)];
+    memcpy(words, &diff, sizeof(diff));
+    uint64_t any = 0;
+    for (size_t i = 0; i < sizeof(diff) / sizeof(uint64_t); i++) {
+        any |= words[i];
+    }
+    return any == 0;
+}
+
+//Make the copies of data block block_num on the healthy disks agree: the
+//contents most copies have win if they are a majority, and are written over
+//the others. Called with fs_lock held for writing. Returns the number of
+//copies rewritten, or -1 if there is no majority. A two-way mirror never has
+//one: there a mismatch can only be detected, and is counted as unrepairable.
+static int repair_block(size_t block_num) {
+    size_t copies = 0;
+    while (copies < num_disks && disk_health[copies] == DISK_HEALTHY) {
+        copies++;
+    }
+    size_t best = 0, best_votes = 0;
+    for (size_t c = 0; c < copies; c++) {
+        size_t votes = 0;
+        for (size_t other = 0; other < copies; other++) {
+            votes += blocks_equal(block_data(block_num + 1, c), block_data(block_num + 1, other));
+        }
+        if (votes > best_votes) {
+            best = c;
+            best_votes = votes;
+        }
+    }
+    if (2 * best_votes <= copies) {
+        return -1;
+    }
+    int rewritten = 0;
+    for (size_t c = 0; c < copies; c++) {
+        if (!blocks_equal(block_data(block_num + 1, c), block_data(block_num + 1, best))) {
+            memcpy(block_data(block_num + 1, c), block_data(block_num + 1, best), BLOCK_SIZE);
+            rewritten++;
+        }
+    }
+    return rewritten;
+}
+
+//Background scrubbing of RAID1/RAID1V mirrors. A pass walks the data
+//bitmap and compares every allocated block across the healthy disks,
+//SCRUB_BATCH blocks at a time under fs_lock held for reading. Blocks that
+//differ are repaired by majority vote afterwards, with fs_lock held for
+//writing so nothing changes them in between; with only two healthy disks
+//they cannot be, see repair_block(), and are reported in the unrepairable
+//count of WFS_IOC_SCRUB_GET instead. Before each batch the worker
+//backs off if reads or writes came in during the last one, and between
+//batches it keeps under the scrub rate. Passes are started, paused and
+//cancelled with WFS_IOC_SCRUB_SET (or -o scrub at mount).
+static void *scrub_worker(void *arg) {
+    struct timespec start;
+    size_t compared = 0;
+    int yields = 0;
+    uint64_t last_ops = __atomic_load_n(&foreground_ops, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&scrub_lock);
+    for (;;) {
+        while (!scrub_stop && scrub.state != WFS_SCRUB_RUNNING) {
+            pthread_cond_wait(&scrub_cond, &scrub_lock);
+        }
+        if (scrub_stop) {
+            break;
+        }
+        if (scrub.position == 0 && scrub.checked == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            compared = 0;
+        }
+        unsigned int rate = scrub.rate;
+        size_t first = scrub.position;
+        pthread_mutex_unlock(&scrub_lock);
+
+        //foreground requests go first
+        uint64_t ops = __atomic_load_n(&foreground_ops, __ATOMIC_RELAXED);
+        if (ops != last_ops && ++yields < SCRUB_MAX_YIELDS) {
+            last_ops = ops;
+            sleep_ms(SCRUB_YIELD_MS);
+            pthread_mutex_lock(&scrub_lock);
+            continue;
+        }
+        yields = 0;
+        last_ops = ops;
+
+        size_t end = first + SCRUB_BATCH;
+        if (end > super_block.num_data_blocks) {
+            end = super_block.num_data_blocks;
+        }
+        size_t mismatched[SCRUB_BATCH];
+        size_t num_mismatched = 0, checked = 0;
+        pthread_rwlock_rdlock(&fs_lock);
+        const char *bitmap = (const char *)disk_map[0] + super_block.d_bitmap_ptr;
+        for (size_t b = first; b < end; b++) {
+            if (!((bitmap[b / 8] >> (b % 8)) & 1)) {
+                continue;
+            }
+            checked++;
+            for (size_t disk = 1; disk < num_disks && disk_health[disk] == DISK_HEALTHY; disk++) {
+                if (!blocks_equal(block_data(b + 1, 0), block_data(b + 1, disk))) {
+                    mismatched[num_mismatched++] = b;
+                    break;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&fs_lock);
+
+        size_t repaired = 0, unrepairable = 0;
+        if (num_mismatched > 0) {
+            pthread_rwlock_wrlock(&fs_lock);
+            for (size_t i = 0; i < num_mismatched; i++) {
+                //it may have been freed since
+                if (!((bitmap[mismatched[i] / 8] >> (mismatched[i] % 8)) & 1)) {
+                    continue;
+                }
+                int rewritten = repair_block(mismatched[i]);
+                if (rewritten < 0) {
+                    printf("Scrub: block %zu has no majority among its copies\n", mismatched[i]);
+                    unrepairable++;
+                } else {
+                    repaired += rewritten;
+                }
+            }
+            pthread_rwlock_unlock(&fs_lock);
+        }
+        compared += checked * BLOCK_SIZE;
+
+        pthread_mutex_lock(&scrub_lock);
+        scrub.checked += checked;
+        scrub.repaired += repaired;
+        scrub.unrepairable += unrepairable;
+        //a pass cancelled (or restarted) meanwhile keeps its new position
+        if (scrub.position == first) {
+            scrub.position = end;
+        }
+        if (scrub.position >= super_block.num_data_blocks) {
+            printf("Scrub pass done: %lu blocks checked, %lu copies repaired, %lu unrepairable, %.0f ms\n",
+                   (unsigned long)scrub.checked, (unsigned long)scrub.repaired,
+                   (unsigned long)scrub.unrepairable, elapsed_ms(&start));
+            scrub.state = WFS_SCRUB_IDLE;
+            scrub.position = 0;
+        }
+        pthread_mutex_unlock(&scrub_lock);
+        throttle(&start, compared, rate);
+        pthread_mutex_lock(&scrub_lock);
+    }
+    pthread_mutex_unlock(&scrub_lock);
+    return NULL;
+}
+
+//Whether the sender of req may manage the volume (scrubbing, adding disks):
+//root, or a process with CAP_SYS_ADMIN in its effective set
+static int req_is_admin(fuse_req_t req) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    if (ctx->uid == 0) {
+        return 1;
+    }
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)ctx->pid);
+    FILE *status = fopen(path, "r");
+    if (!status) {
+        return 0;
+    }
+    int admin = 0;
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, "CapEff:", 7) == 0) {
+            admin = (strtoull(line + 7, NULL, 16) >> CAP_SYS_ADMIN) & 1;
+            break;
+        }
+    }
+    fclose(status);
+    return admin;
+}
+
+//Apply WFS_IOC_SCRUB_SET: start, pause, resume or cancel a pass, change the rate
+static int set_scrub(const struct wfs_scrub_ctl *ctl) {
+    if (ctl->state > WFS_SCRUB_PAUSED) {
+        return -EINVAL;
+    }
+    if (!scrub_running) {
+        return -EOPNOTSUPP;  // not mirrored, or fewer than two disks to compare
+    }
+    pthread_mutex_lock(&scrub_lock);
+    //cancelling forgets the position, starting a new pass the count
+    if (ctl->state == WFS_SCRUB_IDLE ||
+        (ctl->state == WFS_SCRUB_RUNNING && scrub.state == WFS_SCRUB_IDLE)) {
+        scrub.position = 0;
+        scrub.checked = 0;
+    }
+    scrub.state = ctl->state;
+    scrub.rate = ctl->rate;
+    pthread_cond_signal(&scrub_cond);
+    pthread_mutex_unlock(&scrub_lock);
+    return 0;
+}
+
+//Flush [offset, offset + len) of a disk mapping, widened to whole pages
+static void sync_disk_range(size_t disk, off_t offset, off_t len) {
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = offset - offset % page;
+    msync((char *)disk_map[disk] + start, len + (offset - start), MS_SYNC);
+}
+
+//Move RAID0 block block_num from where it was striped over reshape_disks
+//disks to where it goes over num_disks, with its bitmap bit, group
+//descriptor counts, reference count and fingerprint. Free blocks and those
+//that do not move have nothing to copy. Returns the bytes copied.
+static size_t reshape_block(size_t block_num) {
+    size_t from = block_num % reshape_disks, from_row = block_num / reshape_disks;
+    size_t to = block_num % num_disks, to_row = block_num / num_disks;
+    if (block_num >= reshape_disks * super_block.num_data_blocks || (from == to && from_row == to_row)) {
+        return 0;
+    }
+    char *from_bitmap = (char *)disk_map[from] + super_block.d_bitmap_ptr;
+    char *to_bitmap = (char *)disk_map[to] + super_block.d_bitmap_ptr;
+    if (!((from_bitmap[from_row / 8] >> (from_row % 8)) & 1)) {
+        return 0;
+    }
+    memcpy((char *)disk_map[to] + super_block.d_blocks_ptr + to_row * BLOCK_SIZE,
+           (char *)disk_map[from] + super_block.d_blocks_ptr + from_row * BLOCK_SIZE, BLOCK_SIZE);
+    from_bitmap[from_row / 8] &= ~(1 << (from_row % 8));
+    to_bitmap[to_row / 8] |= (1 << (to_row % 8));
+    get_group_desc(from, from_row / super_block.blocks_per_group)->free_blocks++;
+    get_group_desc(to, to_row / super_block.blocks_per_group)->free_blocks--;
+    ((struct wfs_sb *)disk_map[from])->disk_free_blocks++;
+    ((struct wfs_sb *)disk_map[to])->disk_free_blocks--;
+    if (super_block.features & WFS_FEATURE_REFLINK) {
+        uint16_t *from_refs = (uint16_t *)((char *)disk_map[from] + super_block.refcount_ptr);
+        uint16_t *to_refs = (uint16_t *)((char *)disk_map[to] + super_block.refcount_ptr);
+        to_refs[to_row] = from_refs[from_row];
+        from_refs[from_row] = 0;
+    }
+    if (super_block.features & WFS_FEATURE_DEDUPE) {
+        uint64_t *from_fps = (uint64_t *)((char *)disk_map[from] + super_block.dedupe_ptr);
+        uint64_t *to_fps = (uint64_t *)((char *)disk_map[to] + super_block.dedupe_ptr);
+        to_fps[to_row] = from_fps[from_row];
+        from_fps[from_row] = 0;
+    }
+    return BLOCK_SIZE;
+}
+
+//Copy the snapshot table, inode bitmap and inode table of disk 0 to the disk
+//being added, one batch at a time under fs_lock held for writing; changes to
+//them already go to every disk. add_disk() only writes the superblock and
+//group descriptors, so this runs first in the reshape, before any block
+//moves: a reshape that resumes at reshape_pos 0 copies them again. Returns
+//0, or -1 if the worker was stopped first.
+static int copy_added_metadata(struct timespec *start, size_t *moved) {
+    size_t disk = reshape_disks;
+    off_t snaps_end = (super_block.features & WFS_FEATURE_DEDUPE) ? super_block.dedupe_ptr : super_block.i_bitmap_ptr;
+    off_t ranges[][2] = {
+        {super_block.snapshots_ptr, (super_block.features & WFS_FEATURE_SNAPSHOTS) ? snaps_end : 0},
+        {super_block.i_bitmap_ptr, super_block.d_bitmap_ptr},
+        {super_block.i_blocks_ptr, super_block.d_blocks_ptr},
+    };
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        off_t len;
+        for (off_t offset = ranges[r][0]; offset < ranges[r][1]; offset += len) {
+            if (__atomic_load_n(&reshape_stop, __ATOMIC_RELAXED)) {
+                return -1;
+            }
+            len = ranges[r][1] - offset;
+            if (len > RESHAPE_BATCH * BLOCK_SIZE) {
+                len = RESHAPE_BATCH * BLOCK_SIZE;
+            }
+            pthread_rwlock_wrlock(&fs_lock);
+            memcpy((char *)disk_map[disk] + offset, (char *)disk_map[0] + offset, len);
+            pthread_rwlock_unlock(&fs_lock);
+            *moved += len;
+            throttle(start, *moved, options.rebuild_rate);
+        }
+    }
+    msync(disk_map[disk], super_block.d_blocks_ptr, MS_SYNC);
+    return 0;
+}
+
+//Online restriping of a RAID0 volume onto a disk added with WFS_IOC_ADD_DISK.
+//Block numbers, and so every block pointer, stay the same; only the place
+//of a block changes, from disk n % reshape_disks to disk n % num_disks.
+//Blocks are moved in order under fs_lock held for writing, and
+//reshape_pos tells the rest of wfs which geometry a block is in, so reads
+//and writes go on meanwhile. A batch starting in row r of the new geometry
+//moves at most r blocks, so it only overwrites the old places of blocks
+//below reshape_pos. It is flushed before reshape_pos is advanced on the
+//disks, and a reshape cut short carries on from there at the next mount.
+//Block numbers past the old capacity have nothing to move and become free
+//space as the reshape passes them. Throttled like a mirror rebuild.
+static void *reshape_worker(void *arg) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0;
+    size_t total = num_disks * super_block.num_data_blocks;
+    if (reshape_pos == 0 && copy_added_metadata(&start, &moved) < 0) {
+        return NULL;
+    }
+    while (!__atomic_load_n(&reshape_stop, __ATOMIC_RELAXED)) {
+        pthread_rwlock_wrlock(&fs_lock);
+        size_t first = reshape_pos;
+        size_t limit = first / num_disks;
+        if (limit < 1) {
+            limit = 1;
+        }
+        if (limit > RESHAPE_BATCH) {
+            limit = RESHAPE_BATCH;
+        }
+        struct timespec batch_start;
+        clock_gettime(CLOCK_MONOTONIC, &batch_start);
+        size_t end = first, new_blocks = 0;
+        while (end < total && end - first < limit) {
+            moved += reshape_block(end);
+            if (end++ >= reshape_disks * super_block.num_data_blocks) {
+                new_blocks++;
+            }
+            if (elapsed_ms(&batch_start) >= options.rebuild_budget) {
+                break;
+            }
+        }
+
+        //the moved blocks and tables go to disk before the cursor does
+        for (size_t disk = 0; disk < num_disks && end > first; disk++) {
+            size_t first_row = first / num_disks;
+            size_t rows = (end - 1) / num_disks - first_row + 1;
+            sync_disk_range(disk, super_block.d_blocks_ptr + (off_t)(first_row * BLOCK_SIZE), rows * BLOCK_SIZE);
+            sync_disk_range(disk, 0, super_block.d_bitmap_ptr + (off_t)(super_block.num_data_blocks / 8));
+        }
+        int done = end >= total;
+        reshape_pos = done ? 0 : end;
+        if (done) {
+            reshape_disks = 0;
+        }
+        super_block.free_blocks += new_blocks;
+        super_block.disk_free_blocks = ((struct wfs_sb *)disk_map[0])->disk_free_blocks;
+        super_block.reshape_disks = reshape_disks;
+        super_block.reshape_pos = reshape_pos;
+        for (size_t disk = 0; disk < num_disks; disk++) {
+            struct wfs_sb *sb = (struct wfs_sb *)disk_map[disk];
+            sb->free_blocks += new_blocks;
+            sb->reshape_disks = reshape_disks;
+            sb->reshape_pos = reshape_pos;
+            msync(disk_map[disk], BLOCK_SIZE, MS_SYNC);
+        }
+        pthread_rwlock_unlock(&fs_lock);
+        if (done) {
+            printf("Reshape done: %zu bytes moved in %.0f ms\n", moved, elapsed_ms(&start));
+            break;
+        }
+        throttle(&start, moved, options.rebuild_rate);
+    }
+    return NULL;
+}
+
+//Whether the disk image open as fd holds nothing but zeros. Only the parts
+//the host has data for are read.
+static int disk_is_blank(int fd, off_t size) {
+    static const char zeros[BLOCK_SIZE];
+    char buf[BLOCK_SIZE];
+    off_t offset = lseek(fd, 0, SEEK_DATA);
+    while (offset >= 0 && offset < size) {
+        off_t hole = lseek(fd, offset, SEEK_HOLE);
+        if (hole < 0) {
+            hole = size;
+        }
+        for (; offset < hole; offset += BLOCK_SIZE) {
+            ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
+            if (n < 0 || memcmp(buf, zeros, n) != 0) {
+                return 0;
+            }
+        }
+        offset = lseek(fd, hole, SEEK_DATA);
+    }
+    return 1;
+}
+
+//WFS_IOC_ADD_DISK: grow a RAID0 volume by the blank disk image at path and
+//start restriping onto it, as a disk of the given tier. An image that is not
+//all zeros is refused rather than overwritten. The new disk gets disk 0's
+//superblock and group descriptors (its own block tables are the zeros it
+//already holds), every superblock records the reshape before anything
+//moves, and reshape_worker() copies the rest of the metadata.
+static int add_disk(const char *path, int tier) {
+    if (raid_mode != RAID0) {
+        return -EOPNOTSUPP;
+    }
+    if (tier != WFS_TIER_FAST && tier != WFS_TIER_SLOW) {
+        return -EINVAL;
+    }
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat stat;
+    struct wfs_sb sb;
+    off_t required = super_block.d_blocks_ptr + (off_t)(super_block.num_data_blocks * BLOCK_SIZE);
+    int err = 0;
+    if (fstat(fd, &stat) < 0) {
+        err = -errno;
+    } else if (stat.st_size < required) {
+        err = -ENOSPC;
+    } else if (pread(fd, &sb, sizeof(sb), 0) == sizeof(sb) && sb.magic == WFS_MAGIC) {
+        err = -EEXIST;  // already a wfs disk, maybe one of ours
+    } else if (!disk_is_blank(fd, stat.st_size)) {
+        err = -ENOTEMPTY;
+    }
+    void *map = err ? MAP_FAILED : map_disk(fd, stat.st_size, super_block.d_blocks_ptr);
+    if (!err && map == MAP_FAILED) {
+        err = -errno;
+    }
+    if (err) {
+        close(fd);
+        return err;
+    }
+
+    pthread_rwlock_wrlock(&fs_lock);
+    if (reshape_disks) {
+        pthread_rwlock_unlock(&fs_lock);
+        munmap(map, stat.st_size);
+        close(fd);
+        return -EBUSY;
+    }
+    //the inode table initializer reads disk_map under a group lock only
+    for (size_t g = 0; g < super_block.num_groups; g++) {
+        pthread_mutex_lock(&group_locks[g]);
+    }
+    void **new_map = realloc(disk_map, (num_disks + 1) * sizeof(void *));
+    if (new_map) {
+        disk_map = new_map;
+    }
+    int *new_fds = new_map ? realloc(disk_fds, (num_disks + 1) * sizeof(int)) : NULL;
+    if (new_fds) {
+        disk_fds = new_fds;
+    }
+    int *new_health = new_fds ? realloc(disk_health, (num_disks + 1) * sizeof(int)) : NULL;
+    if (new_health) {
+        disk_health = new_health;
+    }
+    uint8_t *new_heat = new_health ? realloc(block_heat, (num_disks + 1) * super_block.num_data_blocks) : NULL;
+    if (new_heat) {
+        block_heat = new_heat;
+        memset(block_heat + num_disks * super_block.num_data_blocks, 0, super_block.num_data_blocks);
+    }
+    if (!new_heat || ((super_block.features & WFS_FEATURE_DEDUPE) &&
+                        grow_dedupe_index((num_disks + 1) * super_block.num_data_blocks) < 0)) {
+        err = -ENOMEM;
+    }
+    if (!err && reshape_running) {
+        pthread_join(reshape_thread, NULL);  // the last reshape is over
+        reshape_running = 0;
+    }
+    if (err) {
+        for (size_t g = 0; g < super_block.num_groups; g++) {
+            pthread_mutex_unlock(&group_locks[g]);
+        }
+        pthread_rwlock_unlock(&fs_lock);
+        munmap(map, stat.st_size);
+        close(fd);
+        return err;
+    }
+
+    memcpy(map, disk_map[0], super_block.gd_ptr + super_block.num_groups * sizeof(struct wfs_group_desc));
+    for (size_t g = 0; g < super_block.num_groups; g++) {
+        ((struct wfs_group_desc *)((char *)map + super_block.gd_ptr))[g].free_blocks =
+            group_span(g, super_block.blocks_per_group, super_block.num_data_blocks);
+    }
+    struct wfs_sb *new_sb = (struct wfs_sb *)map;
+    new_sb->disk_id = num_disks;
+    new_sb->disk_free_blocks = super_block.num_data_blocks;
+    new_sb->num_disks = num_disks + 1;
+    new_sb->reshape_disks = num_disks;
+    new_sb->reshape_pos = 0;
+    new_sb->tier = tier;
+    msync(map, super_block.gd_ptr + super_block.num_groups * sizeof(struct wfs_group_desc), MS_SYNC);
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        struct wfs_sb *sb = (struct wfs_sb *)disk_map[disk];
+        sb->num_disks = num_disks + 1;
+        sb->reshape_disks = num_disks;
+        sb->reshape_pos = 0;
+        msync(disk_map[disk], BLOCK_SIZE, MS_SYNC);
+    }
+    disk_map[num_disks] = map;
+    disk_fds[num_disks] = fd;
+    disk_health[num_disks] = DISK_HEALTHY;
+    reshape_disks = num_disks++;
+    reshape_pos = 0;
+    super_block.num_disks = num_disks;
+    super_block.reshape_disks = reshape_disks;
+    super_block.reshape_pos = 0;
+    tiered = is_tiered();
+    for (size_t g = 0; g < super_block.num_groups; g++) {
+        pthread_mutex_unlock(&group_locks[g]);
+    }
+    start_tier_worker();  // the new disk may be the first slow one
+
+    reshape_stop = 0;
+    if (pthread_create(&reshape_thread, NULL, reshape_worker, NULL) == 0) {
+        reshape_running = 1;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    printf("%s: added as disk %zu, restriping\n", path, num_disks - 1);
+    return 0;
+}
+
+//Move the blocks of a large file to the tier their heat calls for: blocks
+//not read or written for a pass or two to a slow disk, hot blocks on a slow
+//disk back to a fast one, as long as that tier has room. Blocks shared with
+//other files (or snapshots) stay where they are, and so do compressed
+//files, whose clusters are placed together. The file keeps its contents,
+//only its block pointers change. Returns the blocks moved.
+static size_t retier_inode(struct wfs_inode *inode) {
+    if (!S_ISREG(inode->mode) || is_inline(inode) || is_compressed(inode) || inode->size <= TIER_SMALL_FILE) {
+        return 0;
+    }
+    int reflink = super_block.features & WFS_FEATURE_REFLINK;
+    if (reflink && inode->blocks[N_BLOCKS-1] != 0 && *block_refs(inode->blocks[N_BLOCKS-1] - 1, 0) > 0) {
+        return 0;  // the pointers are shared too
+    }
+    size_t moved = 0;
+    size_t num_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (size_t b = 0; b < num_blocks && b < MAX_FILE_BLOCKS; b++) {
+        off_t ptr = get_block_ptr(inode, b);
+        if (ptr == 0 || (reflink && *block_refs(ptr - 1, 0) > 0)) {
+            continue;
+        }
+        uint8_t heat = __atomic_load_n(&block_heat[ptr - 1], __ATOMIC_RELAXED);
+        int tier = disk_tier(get_raid0_disk_index(ptr - 1));
+        int want = (heat == 0) ? WFS_TIER_SLOW : (heat >= TIER_HOT_HEAT) ? WFS_TIER_FAST : tier;
+        if (want == tier) {
+            continue;
+        }
+        int block_num = allocate_tier_block(inode_group(inode->num), want);
+        if (block_num < 0) {
+            continue;
+        }
+        memcpy(block_data(block_num + 1, 0), block_data(ptr, 0), BLOCK_SIZE);
+        uint64_t fp = (super_block.features & WFS_FEATURE_DEDUPE) ? *block_fingerprint(ptr - 1, 0) : 0;
+        *block_ptr_slot(inode, b) = block_num + 1;
+        block_heat[block_num] = heat;
+        free_data_block(ptr - 1);
+        if (fp != 0) {
+            dedupe_insert(fp, block_num + 1);
+        }
+        moved++;
+    }
+    if (moved > 0) {
+        sync_inode(inode);
+    }
+    return moved;
+}
+
+//Start tier_worker() if the volume tiers and it is not running yet; a RAID0
+//volume with disks on one tier only has nothing to move
+static void start_tier_worker(void) {
+    if (!tiered || tier_running) {
+        return;
+    }
+    tier_stop = 0;
+    if (pthread_create(&tier_thread, NULL, tier_worker, NULL) == 0) {
+        tier_running = 1;
+    }
+}
+
+//Hot/cold placement on a RAID0 volume with fast and slow disks. New blocks
+//go to the fast disks; every tier_interval seconds this walks the files and
+//moves the blocks of large ones by their heat (see retier_inode()), one
+//file per hold of fs_lock, then halves every block's heat, so heat counts
+//the recent past. Metadata and small files are never moved off the fast
+//tier. Moves are throttled like a mirror rebuild.
+static void *tier_worker(void *arg) {
+    while (!__atomic_load_n(&tier_stop, __ATOMIC_RELAXED)) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (elapsed_ms(&start) < options.tier_interval * 1e3) {
+            if (__atomic_load_n(&tier_stop, __ATOMIC_RELAXED)) {
+                return NULL;
+            }
+            sleep_ms(100);
+        }
+        if (!tiered || reshape_disks) {
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t moved = 0;
+        for (size_t num = 0; num < super_block.num_inodes && !__atomic_load_n(&tier_stop, __ATOMIC_RELAXED); num++) {
+            pthread_rwlock_wrlock(&fs_lock);
+            const char *bitmap = (const char *)disk_map[0] + super_block.i_bitmap_ptr;
+            if ((bitmap[num / 8] >> (num % 8)) & 1) {
+                struct wfs_inode *inode = get_inode_by_num(num);
+                if (!(inode->flags & WFS_INODE_SNAPSHOT)) {
+                    moved += retier_inode(inode);
+                }
+            }
+            pthread_rwlock_unlock(&fs_lock);
+            throttle(&start, moved * BLOCK_SIZE, options.rebuild_rate);
+        }
+        pthread_rwlock_rdlock(&fs_lock);
+        size_t total = volume_data_blocks();
+        pthread_rwlock_unlock(&fs_lock);
+        for (size_t b = 0; b < total; b++) {
+            uint8_t heat = __atomic_load_n(&block_heat[b], __ATOMIC_RELAXED);
+            __atomic_store_n(&block_heat[b], heat / 2, __ATOMIC_RELAXED);
+        }
+        if (moved > 0) {
+            printf("Tiering pass: %zu blocks moved in %.0f ms\n", moved, elapsed_ms(&start));
+        }
+    }
+    return NULL;
+}
+
+//Apply a change to the free inode/block counters and write it through to
+//every superblock, so the persisted summary always matches the bitmaps of a
+//cleanly unmounted volume. disk is the RAID0 disk whose bitmap changed, or -1
+//when the change was made to every disk's bitmap (inodes, mirrored blocks).
+//Allocations in different groups run concurrently, so the counters are only
+//ever updated with atomic adds.
+static void adjust_free_counts(long inode_delta, long block_delta, int disk) {
+    __atomic_add_fetch(&super_block.free_inodes, inode_delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&super_block.free_blocks, block_delta, __ATOMIC_RELAXED);
+    for (size_t d = 0; d < num_disks; d++) {
+        struct wfs_sb *sb = (struct wfs_sb *)disk_map[d];
+        __atomic_add_fetch(&sb->free_inodes, inode_delta, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sb->free_blocks, block_delta, __ATOMIC_RELAXED);
+        if (disk < 0 || d == disk) {
+            __atomic_add_fetch(&sb->disk_free_blocks, block_delta, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+//Rebuild the summary counters and group descriptors from the bitmaps. Only
+//needed after an unclean shutdown; a clean mount trusts what is on disk.
+//Runs before the filesystem is mounted, so no locks are taken.
+static void recount_free_counts(void) {
+    size_t used_inodes = 0;
+    size_t used_blocks = 0;
+    char *inode_bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
+    for (size_t g = 0; g < super_block.num_groups; g++) {
+        size_t span = group_span(g, super_block.inodes_per_group, super_block.num_inodes);
+        size_t first_byte = g * super_block.inodes_per_group / 8;
+        size_t group_used = 0;
+        for (size_t i = first_byte; i < first_byte + span / 8; i++) {
+            group_used += __builtin_popcount((unsigned char)inode_bitmap[i]);
+        }
+        for (size_t disk = 0; disk < num_disks; disk++) {
+            get_group_desc(disk, g)->free_inodes = span - group_used;
+        }
+        used_inodes += group_used;
+    }
+    //every disk keeps its own count; RAID0 disks each own a slice of the volume,
+    //mirrors hold one copy so the volume total is just disk 0's count
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        size_t disk_used = 0;
+        char *data_bitmap = (char *)disk_map[disk] + super_block.d_bitmap_ptr;
+        for (size_t g = 0; g < super_block.num_groups; g++) {
+            size_t span = group_span(g, super_block.blocks_per_group, super_block.num_data_blocks);
+            size_t first_byte = g * super_block.blocks_per_group / 8;
+            size_t group_used = 0;
+            for (size_t i = first_byte; i < first_byte + span / 8; i++) {
+                group_used += __builtin_popcount((unsigned char)data_bitmap[i]);
+            }
+            get_group_desc(disk, g)->free_blocks = span - group_used;
+            disk_used += group_used;
+        }
+        ((struct wfs_sb *)disk_map[disk])->disk_free_blocks = super_block.num_data_blocks - disk_used;
+        if (raid_mode == RAID0 || disk == 0) {
+            used_blocks += disk_used;
+        }
+    }
+    super_block.free_inodes = super_block.num_inodes - used_inodes;
+    super_block.free_blocks = volume_data_blocks() - used_blocks;
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        struct wfs_sb *sb = (struct wfs_sb *)disk_map[disk];
+        sb->free_inodes = super_block.free_inodes;
+        sb->free_blocks = super_block.free_blocks;
+    }
+    super_block.disk_free_blocks = ((struct wfs_sb *)disk_map[0])->disk_free_blocks;
+}
+
+//Mark every disk clean or dirty and flush the superblocks
+static void set_volume_state(int state) {
+    super_block.state = state;
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        ((struct wfs_sb *)disk_map[disk])->state = state;
+        msync(disk_map[disk], BLOCK_SIZE, MS_SYNC);
+    }
+}
+
+//Check a superblock read from disk_file. ref is the first disk's superblock
+//(NULL when checking the first disk); every disk has to agree on geometry.
+static int validate_superblock(const struct wfs_sb *sb, const struct wfs_sb *ref, off_t disk_size, const char *disk_file) {
+    if (sb->magic != WFS_MAGIC) {
+        fprintf(stderr, "%s: not a wfs disk (bad magic)\n", disk_file);
+        return -1;
+    }
+    if (sb->version != WFS_VERSION) {
+        fprintf(stderr, "%s: unsupported format version %d\n", disk_file, sb->version);
+        return -1;
+    }
+    if (sb->raid_mode != RAID0 && sb->raid_mode != RAID1 && sb->raid_mode != RAID1V &&
+        sb->raid_mode != RAID5 && sb->raid_mode != RAID6 && sb->raid_mode != RAID10) {
+        fprintf(stderr, "%s: invalid raid mode %d\n", disk_file, sb->raid_mode);
+        return -1;
+    }
+    //with parity or RAID10, num_data_blocks counts the data blocks of all the rows
+    int parity = sb->raid_mode == RAID5 ? 1 : sb->raid_mode == RAID6 ? 2 : 0;
+    if (parity && (sb->num_disks < parity + 2 || sb->num_data_blocks % (sb->num_disks - parity) != 0)) {
+        fprintf(stderr, "%s: %d disks do not fit raid mode %d\n", disk_file, sb->num_disks, sb->raid_mode);
+        return -1;
+    }
+    //RAID10 stripes over pairs of disks
+    if (sb->raid_mode == RAID10 && (sb->num_disks < 4 || sb->num_disks % 2 != 0 ||
+                                    sb->num_data_blocks % (sb->num_disks / 2) != 0)) {
+        fprintf(stderr, "%s: %d disks do not fit raid mode %d\n", disk_file, sb->num_disks, sb->raid_mode);
+        return -1;
+    }
+    size_t rows = parity ? sb->num_data_blocks / (sb->num_disks - parity) : sb->num_data_blocks;
+    if (sb->raid_mode == RAID10) {
+        rows = sb->num_data_blocks / (sb->num_disks / 2);
+    }
+    if (sb->num_inodes == 0 || sb->num_data_blocks == 0 ||
+        sb->num_inodes % 8 != 0 || sb->num_data_blocks % 8 != 0 ||
+        sb->i_bitmap_ptr < (off_t)sizeof(struct wfs_sb) ||
+        sb->d_bitmap_ptr != sb->i_bitmap_ptr + (off_t)(sb->num_inodes / 8) ||
+        sb->i_blocks_ptr < sb->d_bitmap_ptr + (off_t)(sb->num_data_blocks / 8) ||
+        sb->i_blocks_ptr % BLOCK_SIZE != 0 ||
+        sb->d_blocks_ptr != sb->i_blocks_ptr + (off_t)(sb->num_inodes * BLOCK_SIZE) ||
+        sb->d_blocks_ptr + (off_t)(rows * BLOCK_SIZE) > disk_size) {
+        fprintf(stderr, "%s: inconsistent disk layout\n", disk_file);
+        return -1;
+    }
+    if (sb->blocks_per_group == 0 || sb->blocks_per_group % 8 != 0 ||
+        sb->inodes_per_group == 0 || sb->inodes_per_group % 8 != 0 ||
+        sb->num_groups != (sb->num_data_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group ||
+        sb->num_groups * sb->inodes_per_group < sb->num_inodes ||
+        sb->gd_ptr < (off_t)sizeof(struct wfs_sb) ||
+        sb->i_bitmap_ptr < sb->gd_ptr + (off_t)(sb->num_groups * sizeof(struct wfs_group_desc))) {
+        fprintf(stderr, "%s: inconsistent allocation groups\n", disk_file);
+        return -1;
+    }
+    if (sb->features & ~WFS_FEATURES_SUPPORTED) {
+        fprintf(stderr, "%s: unsupported features 0x%x\n", disk_file, sb->features & ~WFS_FEATURES_SUPPORTED);
+        return -1;
+    }
+    if ((sb->features & WFS_FEATURE_REFLINK) &&
+        (sb->refcount_ptr < sb->gd_ptr + (off_t)(sb->num_groups * sizeof(struct wfs_group_desc)) ||
+         sb->i_bitmap_ptr < sb->refcount_ptr + (off_t)(sb->num_data_blocks * sizeof(uint16_t)))) {
+        fprintf(stderr, "%s: inconsistent refcount table\n", disk_file);
+        return -1;
+    }
+    if ((sb->features & WFS_FEATURE_SNAPSHOTS) &&
+        (!(sb->features & WFS_FEATURE_REFLINK) ||
+         sb->snapshots_ptr < sb->refcount_ptr + (off_t)(sb->num_data_blocks * sizeof(uint16_t)) ||
+         sb->i_bitmap_ptr < sb->snapshots_ptr + (off_t)(MAX_SNAPSHOTS * sizeof(struct wfs_snapshot) +
+                                                        sb->num_inodes * sizeof(struct wfs_inode_version)))) {
+        fprintf(stderr, "%s: inconsistent snapshot table\n", disk_file);
+        return -1;
+    }
+    if ((sb->features & WFS_FEATURE_DEDUPE) &&
+        (!(sb->features & WFS_FEATURE_REFLINK) ||
+         sb->dedupe_ptr < sb->refcount_ptr + (off_t)(sb->num_data_blocks * sizeof(uint16_t)) ||
+         ((sb->features & WFS_FEATURE_SNAPSHOTS) && sb->dedupe_ptr <= sb->snapshots_ptr) ||
+         sb->i_bitmap_ptr < sb->dedupe_ptr + (off_t)(sb->num_data_blocks * sizeof(uint64_t)))) {
+        fprintf(stderr, "%s: inconsistent fingerprint table\n", disk_file);
+        return -1;
+    }
+    if (sb->reshape_disks != 0 &&
+        (sb->raid_mode != RAID0 || sb->reshape_disks < 0 || sb->reshape_disks >= sb->num_disks ||
+         sb->reshape_pos >= sb->num_disks * sb->num_data_blocks)) {
+        fprintf(stderr, "%s: inconsistent reshape state\n", disk_file);
+        return -1;
+    }
+    if (sb->tier != WFS_TIER_FAST && sb->tier != WFS_TIER_SLOW) {
+        fprintf(stderr, "%s: invalid tier %d\n", disk_file, sb->tier);
+        return -1;
+    }
+    if (sb->num_disks != num_disks || sb->disk_id < 0 || sb->disk_id >= sb->num_disks) {
+        fprintf(stderr, "%s: disk %d of %d, but %zu disks were given\n",
+                disk_file, sb->disk_id, sb->num_disks, num_disks);
+        return -1;
+    }
+    if (ref && (sb->num_inodes != ref->num_inodes ||
+                sb->num_data_blocks != ref->num_data_blocks ||
+                sb->i_bitmap_ptr != ref->i_bitmap_ptr ||
+                sb->d_bitmap_ptr != ref->d_bitmap_ptr ||
+                sb->i_blocks_ptr != ref->i_blocks_ptr ||
+                sb->d_blocks_ptr != ref->d_blocks_ptr ||
+                sb->gd_ptr != ref->gd_ptr ||
+                sb->blocks_per_group != ref->blocks_per_group ||
+                sb->inodes_per_group != ref->inodes_per_group ||
+                sb->features != ref->features ||
+                sb->refcount_ptr != ref->refcount_ptr ||
+                sb->snapshots_ptr != ref->snapshots_ptr ||
+                sb->dedupe_ptr != ref->dedupe_ptr ||
+                sb->reshape_disks != ref->reshape_disks ||
+                sb->raid_mode != ref->raid_mode)) {
+        fprintf(stderr, "%s: geometry does not match the other disks\n", disk_file);
+        return -1;
+    }
+    return 0;
+}
+
+
+//======================DEBUG FUNCTIONS===========================//
+
+
+
+void debug_print_inode_bitmap() {
+    printf("\n=== Inode Bitmap Contents ===\n");
+    
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        printf("\nDisk %zu:\n", disk);
+        char *inode_bitmap = (char *)disk_map[disk] + super_block.i_bitmap_ptr;
+        
+        for (int i = 0; i < super_block.num_inodes; i++) {
+            int byte_offset = i / 8;
+            int bit_position = i % 8;
+            int is_allocated = (inode_bitmap[byte_offset] & (1 << bit_position)) ? 1 : 0;
+            
+            printf("%d", is_allocated);
+            if ((i + 1) % 8 == 0) printf(" "); // Space every 8 bits
+            if ((i + 1) % 32 == 0) printf("\n"); // Newline every 32 bits
+        }
+        printf("\n");
+    }
+    printf("===========================\n");
+}
+
+void debug_print_inodes(int disk_idx) {
+    printf("\n=== Allocated Inodes Contents ===\n");
+    
+    char *inode_region = (char *)disk_map[disk_idx] + super_block.i_blocks_ptr;
+    char *inode_bitmap = (char *)disk_map[0] + super_block.i_bitmap_ptr;
+    
+    for (int i = 0; i < super_block.num_inodes; i++) {
+        int byte_offset = i / 8;
+        int bit_position = i % 8;
+        int is_allocated = (inode_bitmap[byte_offset] & (1 << bit_position)) ? 1 : 0;
+        
+        if (is_allocated) {
+            struct wfs_inode *inode = (struct wfs_inode *)(inode_region + (i * BLOCK_SIZE));
+            printf("\nInode %d:\n", i);
+            printf("  mode: %d\n", inode->mode);
+            printf("  uid: %d\n", inode->uid);
+            printf("  gid: %d\n", inode->gid);
+            printf("  size: %ld\n", inode->size);
+            printf("  nlinks: %d\n", inode->nlinks);
+            printf("  blocks[0]: %ld\n", inode->blocks[0]);
+            printf("  atime: %ld\n", inode->atim);
+            printf("  mtime: %ld\n", inode->mtim);
+            printf("  ctime: %ld\n", inode->ctim);
+        }
+    }
+    printf("===========================\n");
+}
+
+void debug_print_data_bitmap(){
+    printf("\n=== Data Bitmap Contents ===\n");
     
     for (size_t disk = 0; disk < num_disks; disk++) {
         printf("\nDisk %zu:\n", disk);
@@ -621,169 +3396,1432 @@ void debug_print_data_bitmap(){
             if ((i + 1) % 8 == 0) printf(" "); // Space every 8 bits
             if ((i + 1) % 32 == 0) printf("\n"); // Newline every 32 bits
         }
-        printf("\n");
+        printf("\n");
+    }
+    printf("===========================\n");
+}
+
+void debug_dump_data_regions() {
+    printf("\n=== Comparing Data Block Regions ===\n");
+    
+    // // For each block in data region
+    // for (size_t block = 0; block < super_block.num_data_blocks; block++) {
+    //     printf("\nBlock %zu:\n", block);
+        
+    //     // Compare this block across all disks
+    //     for (size_t disk = 0; disk < num_disks; disk++) {
+    //         printf("Disk %zu: ", disk);
+    //         char *block_addr = (char *)disk_map[disk] + super_block.d_blocks_ptr + (block * BLOCK_SIZE);
+            
+    //         // Print first few bytes
+    //         for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
+    //             printf("%02x ", (unsigned char)block_addr[i]);
+    //         }
+    //         printf("...\n");
+            
+    //         // Print as ASCII if printable
+    //         printf("ASCII: ");
+    //         for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
+    //             char c = block_addr[i];
+    //             printf("%c", (c >= 32 && c <= 126) ? c : '.');
+    //         }
+    //         printf("...\n");
+    //     }
+    // }
+
+
+    printf("\nBlock %zu:\n", (size_t)1);
+        // Compare this block across all disks
+        for (size_t disk = 0; disk < num_disks; disk++) {
+            printf("Disk %zu: ", disk);
+            char *block_addr = (char *)disk_map[disk] + super_block.d_blocks_ptr + (1 * BLOCK_SIZE);
+            
+            // Print first few bytes
+            for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
+                printf("%02x ", (unsigned char)block_addr[i]);
+            }
+            printf("...\n");
+            
+            // Print as ASCII if printable
+            printf("ASCII: ");
+            for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
+                char c = block_addr[i];
+                printf("%c", (c >= 32 && c <= 126) ? c : '.');
+            }
+            printf("...\n");
+        }
+    printf("===========================\n");
+}
+
+
+
+
+//======================FUSE OPERATIONS===========================//
+
+
+//Reply to a lookup/create with inode's attributes and count the new reference.
+//ino is the inode's number in the view it was found in.
+static void reply_entry(fuse_req_t req, fuse_ino_t ino, struct wfs_inode *inode) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ino;
+    e.attr_timeout = options.attr_timeout;
+    e.entry_timeout = options.entry_timeout;
+    fill_stat(inode, &e.attr);
+    e.attr.st_ino = ino;
+
+    //snapshot views are never freed under the kernel, so they are not counted
+    if (is_snapshot_ino(ino)) {
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    __atomic_add_fetch(&lookup_counts[inode->num], 1, __ATOMIC_RELAXED);
+    if (fuse_reply_entry(req, &e) != 0) {
+        //the kernel never saw the entry, so it will never forget it either
+        __atomic_sub_fetch(&lookup_counts[inode->num], 1, __ATOMIC_RELAXED);
+    }
+}
+
+//Drop nlookup kernel references; frees the inode if it was an orphan
+static void forget_inode(fuse_ino_t ino, uint64_t nlookup) {
+    if (ino == 0 || ino > super_block.num_inodes) {
+        return;
+    }
+    int num = ino - 1;
+    if (__atomic_sub_fetch(&lookup_counts[num], nlookup, __ATOMIC_RELAXED) != 0) {
+        return;
+    }
+    pthread_rwlock_wrlock(&fs_lock);
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    if (inode && inode->nlinks == 0 && __atomic_load_n(&lookup_counts[num], __ATOMIC_RELAXED) == 0) {
+        free_inode(inode);
+        orphan_count--;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+//Reply to a lookup that found nothing; the kernel may cache the negative entry
+static void reply_negative_entry(fuse_req_t req) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = options.negative_timeout;
+    fuse_reply_entry(req, &e);
+}
+
+//Attributes of /.snapshots: a read-only directory with one entry per snapshot,
+//owned like the root
+static void fill_snapshots_dir_stat(struct stat *stbuf) {
+    size_t count = 0;
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        count += (get_snapshot(0, i)->gen != 0);
+    }
+    fill_stat(get_inode_by_num(0), stbuf);
+    stbuf->st_ino = SNAPSHOTS_DIR_INO;
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_size = count * sizeof(struct wfs_dentry);
+    stbuf->st_nlink = 2 + count;
+    stbuf->st_blocks = 0;
+}
+
+//Whether name in directory parent is /.snapshots, which is not listed in
+//the root but can always be looked up, and cannot be created
+static int is_snapshots_dir(fuse_ino_t parent, const char *name) {
+    return parent == FUSE_ROOT_ID && (super_block.features & WFS_FEATURE_SNAPSHOTS) &&
+           strcmp(name, SNAPSHOTS_DIR) == 0;
+}
+
+//Address of copy number copy (below data_copies()) of file data, for 1-based
+//block pointer block_num. For RAID1/RAID1V the copy is the disk, for RAID10
+//the member of the block's mirror pair; the other modes keep one copy.
+static char *block_data(off_t block_num, size_t copy) {
+    if (raid_mode == RAID0) {
+        return (char *)disk_map[get_raid0_disk_index(block_num - 1)] + get_raid0_block_offset(block_num - 1);
+    }
+    if (parity_disks()) {
+        ensure_row((block_num - 1) / (num_disks - parity_disks()));
+        return (char *)disk_map[get_parity_disk_index(block_num - 1)] + get_parity_block_offset(block_num - 1);
+    }
+    if (raid_mode == RAID10) {
+        return (char *)disk_map[get_raid10_disk_index(block_num - 1, copy)] + get_raid10_block_offset(block_num - 1);
+    }
+    return (char *)disk_map[copy] + super_block.d_blocks_ptr + ((block_num - 1) * BLOCK_SIZE);
+}
+
+//Copy of data block block_num (1-based) that reads are served from. RAID10
+//alternates between the members of each pair row by row, so reads of a file
+//are spread over both disks of every pair.
+static size_t read_copy(off_t block_num) {
+    if (raid_mode != RAID10) {
+        return 0;
+    }
+    //a pair of a fast and a slow disk is read from the fast one
+    size_t pair = (block_num - 1) % (num_disks / 2);
+    if (disk_tier(2 * pair) != disk_tier(2 * pair + 1)) {
+        return disk_tier(2 * pair) == WFS_TIER_FAST ? 0 : 1;
+    }
+    return ((block_num - 1) / (num_disks / 2)) % 2;
+}
+
+//File data is stored in compressed clusters
+static int is_compressed(struct wfs_inode *inode) {
+    return S_ISREG(inode->mode) && (inode->flags & WFS_INODE_COMPRESSED) && !is_inline(inode);
+}
+
+//Cluster map of a compressed file, in its slot after the inode
+static uint16_t *cluster_map(struct wfs_inode *inode) {
+    return (uint16_t *)inline_data(inode);
+}
+
+//Blocks in cluster c; the last cluster of a full-size file is shorter
+static size_t cluster_blocks(size_t c) {
+    size_t left = MAX_FILE_BLOCKS - c * WFS_CLUSTER_BLOCKS;
+    return left < WFS_CLUSTER_BLOCKS ? left : WFS_CLUSTER_BLOCKS;
+}
+
+//Append an LZ4 length continuation (the part of n past the 4-bit field)
+static int lz4_put_length(char *dst, int pos, int cap, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (pos >= cap) return -1;
+        dst[pos++] = (char)255;
+    }
+    if (pos >= cap) return -1;
+    dst[pos++] = (char)n;
+    return pos;
+}
+
+//Compress len bytes into an LZ4 block of at most cap bytes. Greedy, with a
+//small hash table of recent 4-byte sequences, as in LZ4's fast mode.
+//Returns the compressed length, or 0 if it does not fit in cap.
+static int lz4_compress(const char *src, int len, char *dst, int cap) {
+    uint16_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    int pos = 0;
+    int anchor = 0;
+    int ip = 0;
+    while (ip < len - LZ4_MATCH_LIMIT) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, sizeof(seq));
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        uint32_t ref_seq;
+        memcpy(&ref_seq, src + ref, sizeof(ref_seq));
+        if (ref >= ip || ref_seq != seq) {
+            ip++;
+            continue;
+        }
+        int match_len = LZ4_MIN_MATCH;
+        while (ip + match_len < len - LZ4_LAST_LITERALS && src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+
+        //sequence: token, literal length, literals, offset, match length
+        size_t literals = ip - anchor;
+        size_t extra = match_len - LZ4_MIN_MATCH;
+        if (pos >= cap) return 0;
+        int token = pos++;
+        dst[token] = (char)(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15));
+        if (literals >= 15 && (pos = lz4_put_length(dst, pos, cap, literals - 15)) < 0) return 0;
+        if (pos + (int)literals + 2 > cap) return 0;
+        memcpy(dst + pos, src + anchor, literals);
+        pos += literals;
+        dst[pos++] = (char)((ip - ref) & 0xff);
+        dst[pos++] = (char)((ip - ref) >> 8);
+        if (extra >= 15 && (pos = lz4_put_length(dst, pos, cap, extra - 15)) < 0) return 0;
+        ip += match_len;
+        anchor = ip;
+    }
+
+    //the rest is literals
+    size_t literals = len - anchor;
+    if (pos >= cap) return 0;
+    dst[pos++] = (char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15 && (pos = lz4_put_length(dst, pos, cap, literals - 15)) < 0) return 0;
+    if (pos + (int)literals > cap) return 0;
+    memcpy(dst + pos, src + anchor, literals);
+    return pos + literals;
+}
+
+//Decompress an LZ4 block of len bytes into at most cap bytes. Returns the
+//decompressed length, or -1 if the block is malformed.
+static int lz4_decompress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *in = (const unsigned char *)src;
+    int ip = 0;
+    int op = 0;
+    while (ip < len) {
+        int token = in[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            int b;
+            do {
+                if (ip >= len) return -1;
+                b = in[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+        if (ip + (int)literals > len || op + (int)literals > cap) return -1;
+        memcpy(dst + op, in + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == len) {
+            break;  // the last sequence has no match
+        }
+
+        if (ip + 2 > len) return -1;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            int b;
+            do {
+                if (ip >= len) return -1;
+                b = in[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > op || op + (int)match_len > cap) return -1;
+        //byte by byte: a match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op;
+}
+
+//Write a whole block of data behind 1-based block pointer block_num, on every
+//mirror or with its parity
+static void write_block(off_t block_num, const char *data) {
+    for (size_t copy = 0; copy < data_copies(); copy++) {
+        memcpy(block_data(block_num, copy), data, BLOCK_SIZE);
+    }
+    update_parity(block_data(block_num, 0));
+}
+
+//Read cluster c of a compressed file into data (cluster_blocks(c) blocks).
+//A compressed cluster whose blocks follow each other in the mapping, the
+//usual case, is decompressed straight out of it. Returns 0 or -EIO.
+static int load_cluster(struct wfs_inode *inode, size_t c, char *data) {
+    size_t first = c * WFS_CLUSTER_BLOCKS;
+    size_t len = cluster_blocks(c) * BLOCK_SIZE;
+    uint16_t packed_len = cluster_map(inode)[c];
+    if (packed_len == 0) {
+        for (size_t i = 0; i < cluster_blocks(c); i++) {
+            off_t block_num = get_block_ptr(inode, first + i);
+            if (block_num) {
+                memcpy(data + i * BLOCK_SIZE, block_data(block_num, 0), BLOCK_SIZE);
+            } else {
+                memset(data + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            }
+        }
+        return 0;
+    }
+
+    size_t used = (packed_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char *start = NULL;
+    int contiguous = 1;
+    for (size_t i = 0; i < used; i++) {
+        off_t block_num = get_block_ptr(inode, first + i);
+        if (block_num == 0) {
+            return -EIO;
+        }
+        if (i == 0) {
+            start = block_data(block_num, 0);
+        } else if (block_data(block_num, 0) != start + i * BLOCK_SIZE) {
+            contiguous = 0;
+        }
+    }
+    const char *packed = start;
+    char gathered[CLUSTER_SIZE];
+    if (!contiguous) {
+        for (size_t i = 0; i < used; i++) {
+            memcpy(gathered + i * BLOCK_SIZE, block_data(get_block_ptr(inode, first + i), 0), BLOCK_SIZE);
+        }
+        packed = gathered;
+    }
+    return lz4_decompress(packed, packed_len, data, len) == (int)len ? 0 : -EIO;
+}
+
+//Store data as cluster c of a compressed file. It takes as many blocks as
+//its LZ4 form needs, or all of them as plain blocks if that saves nothing;
+//an all-zero cluster becomes a hole. Only the blocks used are written, on
+//every mirror. Returns 0 or a negative errno, leaving the old contents.
+static int store_cluster(struct wfs_inode *inode, size_t c, const char *data) {
+    size_t first = c * WFS_CLUSTER_BLOCKS;
+    size_t nblocks = cluster_blocks(c);
+    size_t len = nblocks * BLOCK_SIZE;
+
+    size_t nonzero = 0;
+    while (nonzero < len && data[nonzero] == 0) {
+        nonzero++;
+    }
+    if (nonzero == len) {
+        release_file_blocks(inode, first, first + nblocks);
+        cluster_map(inode)[c] = 0;
+        return 0;
+    }
+
+    char packed[CLUSTER_SIZE];
+    int packed_len = lz4_compress(data, len, packed, (nblocks - 1) * BLOCK_SIZE);
+    size_t used = packed_len > 0 ? (packed_len + BLOCK_SIZE - 1) / BLOCK_SIZE : nblocks;
+    const char *out = data;
+    if (packed_len > 0) {
+        memset(packed + packed_len, 0, used * BLOCK_SIZE - packed_len);
+        out = packed;
+    }
+    ssize_t got = allocate_range(inode, (off_t)first * BLOCK_SIZE, used * BLOCK_SIZE, 0);
+    if (got < (ssize_t)(used * BLOCK_SIZE)) {
+        return got < 0 ? got : -ENOSPC;
+    }
+    for (size_t i = 0; i < used; i++) {
+        write_block(get_block_ptr(inode, first + i), out + i * BLOCK_SIZE);
+    }
+    release_file_blocks(inode, first + used, first + nblocks);
+    cluster_map(inode)[c] = packed_len > 0 ? packed_len : 0;
+    return 0;
+}
+
+//map_inode_data() for a range of a compressed file that touches compressed
+//clusters: the range is decompressed into a buffer allocated with the
+//vector, so the caller's free() releases both. Clusters the range covers
+//completely are decompressed straight into it.
+static struct fuse_bufvec *map_compressed_data(struct wfs_inode *inode, size_t size, off_t offset) {
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + size);
+    if (!bufv) {
+        return NULL;
+    }
+    char *out = (char *)(bufv + 1);
+    struct fuse_bufvec init = FUSE_BUFVEC_INIT(size);
+    *bufv = init;
+    bufv->buf[0].mem = out;
+
+    char cluster[CLUSTER_SIZE];
+    size_t done = 0;
+    while (done < size) {
+        size_t c = (offset + done) / CLUSTER_SIZE;
+        size_t cluster_off = (offset + done) % CLUSTER_SIZE;
+        size_t len = cluster_blocks(c) * BLOCK_SIZE;
+        size_t n = len - cluster_off < size - done ? len - cluster_off : size - done;
+        if (n == len) {
+            if (load_cluster(inode, c, out + done) < 0) {
+                memset(out + done, 0, n);  // unreadable cluster, see wfs_read()
+            }
+        } else if (load_cluster(inode, c, cluster) == 0) {
+            memcpy(out + done, cluster + cluster_off, n);
+        } else {
+            memset(out + done, 0, n);
+        }
+        done += n;
+    }
+    return bufv;
+}
+
+//Describe [offset, offset + size) of a file as memory segments pointing
+//straight into the first disk's mapping (or the disk holding each block,
+//see read_copy()). Blocks that follow each other in the mapping share a segment, and
+//so do consecutive holes, which point at zero_run. The caller frees the result.
+static struct fuse_bufvec *map_inode_data(struct wfs_inode *inode, size_t size, off_t offset) {
+    size_t max_segments = (offset % BLOCK_SIZE + size + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + max_segments * sizeof(struct fuse_buf));
+    if (!bufv) {
+        return NULL;
+    }
+    memset(bufv, 0, sizeof(struct fuse_bufvec));
+
+    //inline data is a single segment in the inode slot
+    if (is_inline(inode)) {
+        bufv->count = 1;
+        bufv->buf[0].mem = inline_data(inode) + offset;
+        bufv->buf[0].size = size;
+        bufv->buf[0].fd = -1;
+        return bufv;
+    }
+    //plain clusters of a compressed file map like any other blocks
+    if (is_compressed(inode)) {
+        for (size_t c = offset / CLUSTER_SIZE; c * CLUSTER_SIZE < offset + size; c++) {
+            if (cluster_map(inode)[c] != 0) {
+                free(bufv);
+                return map_compressed_data(inode, size, offset);
+            }
+        }
+    }
+
+    size_t mapped = 0;
+    struct fuse_buf *seg = NULL;
+    while (mapped < size) {
+        size_t b = (offset + mapped) / BLOCK_SIZE;
+        size_t block_offset = (offset + mapped) % BLOCK_SIZE;
+        size_t bytes_this_block = BLOCK_SIZE - block_offset;
+        if (mapped + bytes_this_block > size) {
+            bytes_this_block = size - mapped;
+        }
+
+        off_t block_num = get_block_ptr(inode, b);
+        char *data;
+        int extend;
+        if (block_num && block_heat) {
+            uint8_t heat = __atomic_load_n(&block_heat[block_num - 1], __ATOMIC_RELAXED);
+            if (heat < UINT8_MAX) {
+                __atomic_store_n(&block_heat[block_num - 1], heat + 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (block_num) {
+            data = block_data(block_num, read_copy(block_num)) + block_offset;
+            extend = seg && seg->mem != zero_run && (char *)seg->mem + seg->size == data;
+        } else {
+            data = zero_run;
+            extend = seg && seg->mem == zero_run && seg->size + bytes_this_block <= ZERO_RUN_SIZE;
+        }
+        if (extend) {
+            seg->size += bytes_this_block;
+        } else {
+            seg = &bufv->buf[bufv->count++];
+            memset(seg, 0, sizeof(struct fuse_buf));
+            seg->mem = data;
+            seg->size = bytes_this_block;
+            seg->fd = -1;
+        }
+        mapped += bytes_this_block;
+    }
+    return bufv;
+}
+
+//Allocate every missing block behind [offset, offset + size). Each hole in
+//the range is filled with as few runs of consecutive blocks as possible.
+//New blocks are zeroed where the caller will not overwrite them: all of them
+//if zero_all is set (nothing is written), else only those the range covers
+//partially. Unless zero_all is set, the range is about to be written, so
+//shared blocks in it are copied first. Returns how many bytes from offset
+//are backed by writable blocks, or a negative errno.
+static ssize_t allocate_range(struct wfs_inode *inode, off_t offset, size_t size, int zero_all) {
+    size_t start_block = offset / BLOCK_SIZE;
+    size_t end_block = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (end_block > (N_BLOCKS - 1) + POINTERS_PER_BLOCK) {
+        return -EFBIG;
+    }
+
+    // Get indirect block if needed
+    off_t *indirect_ptrs = NULL;
+    if (end_block > N_BLOCKS - 1) {
+        indirect_ptrs = get_indirect_block(inode);
+        if (!indirect_ptrs) return -ENOSPC;
+    }
+
+    size_t b = start_block;
+    int indirect_dirty = 0;
+    while (b < end_block) {
+        if (get_block_ptr(inode, b) != 0) {
+            off_t block_start = (off_t)b * BLOCK_SIZE;
+            int partial = block_start < offset || block_start + BLOCK_SIZE > offset + (off_t)size;
+            int unshared = zero_all ? 0 : unshare_block(inode, b, partial);
+            if (unshared < 0) break;
+            if (unshared && b >= N_BLOCKS - 1) {
+                indirect_dirty = 1;
+            }
+            b++;
+            continue;
+        }
+        size_t hole = 1;
+        while (b + hole < end_block && get_block_ptr(inode, b + hole) == 0) {
+            hole++;
+        }
+        size_t got = 1;
+        int first = (hole > 1) ? allocate_data_run(inode_group(inode->num), hole, &got)
+                               : allocate_data_block(inode_group(inode->num));
+        if (first < 0) break;
+
+        for (size_t i = 0; i < got; i++, b++) {
+            if (b < N_BLOCKS - 1) { // Direct block
+                inode->blocks[b] = first + i + 1;
+            } else { // Indirect block
+                indirect_ptrs[b - (N_BLOCKS - 1)] = first + i + 1;
+                indirect_dirty = 1;
+            }
+            off_t block_start = (off_t)b * BLOCK_SIZE;
+            if (zero_all || block_start < offset || block_start + BLOCK_SIZE > offset + (off_t)size) {
+                zero_data_block(first + i);
+            }
+        }
+    }
+    if (indirect_dirty) {
+        sync_indirect_block(inode);
+    }
+
+    if (b == end_block) {
+        return size;
+    }
+    if (b == start_block) {
+        return -ENOSPC;
+    }
+    return b * BLOCK_SIZE - offset;  // short write up to the last block we got
+}
+
+//Copy src to the blocks behind offset, allocating them as needed. Data lands
+//in the mapping in one copy (straight out of the FUSE pipe when src is one);
+//mirrors are then copied from it, or parity updated. The caller updates the inode.
+//Returns bytes written or a negative errno.
+static ssize_t write_mapped(struct wfs_inode *inode, struct fuse_bufvec *src, off_t offset) {
+    size_t size = fuse_buf_size(src);
+    ssize_t len = is_inline(inode) ? size : allocate_range(inode, offset, size, 0);
+    if (len < 0) {
+        return len;
+    }
+
+    struct fuse_bufvec *dst = map_inode_data(inode, len, offset);
+    if (!dst) {
+        return -ENOMEM;
+    }
+    ssize_t bytes_written = fuse_buf_copy(dst, src, 0);
+    if (bytes_written > 0 && parity_disks() && !is_inline(inode)) {
+        // RAID5/RAID6: recompute the parity of each row written, once per row
+        size_t remaining = bytes_written;
+        size_t last_row = SIZE_MAX;
+        for (size_t i = 0; i < dst->count && remaining > 0; i++) {
+            size_t seg_size = dst->buf[i].size < remaining ? dst->buf[i].size : remaining;
+            update_parity_span(dst->buf[i].mem, seg_size, &last_row);
+            remaining -= seg_size;
+        }
+    } else if (bytes_written > 0 && data_copies() > 1 && !is_inline(inode)) {
+        // RAID1/RAID1V/RAID10: copy what landed on one disk to the others
+        size_t remaining = bytes_written;
+        for (size_t i = 0; i < dst->count && remaining > 0; i++) {
+            size_t seg_size = dst->buf[i].size < remaining ? dst->buf[i].size : remaining;
+            sync_block_data(dst->buf[i].mem, seg_size);
+            remaining -= seg_size;
+        }
+    }
+    free(dst);
+    return bytes_written;
+}
+
+//write_mapped() of [from, to) of a write of data at offset, then index the
+//whole blocks written, whose fingerprints are in fps (0 for none)
+static ssize_t write_indexed_run(struct wfs_inode *inode, const char *data, off_t offset, off_t from, off_t to,
+                                 const uint64_t *fps) {
+    struct fuse_bufvec run = FUSE_BUFVEC_INIT(to - from);
+    run.buf[0].mem = (char *)data + (from - offset);
+    ssize_t written = write_mapped(inode, &run, from);
+    off_t first = (from + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    for (off_t pos = first; written > 0 && pos + BLOCK_SIZE <= from + written; pos += BLOCK_SIZE) {
+        if (fps[pos / BLOCK_SIZE] != 0) {
+            dedupe_insert(fps[pos / BLOCK_SIZE], get_block_ptr(inode, pos / BLOCK_SIZE));
+        }
+    }
+    return written;
+}
+
+//Write with dedupe: a whole block whose contents are already in some indexed
+//block shares that block (taking a reference) instead of being written; the
+//rest is written in runs, and the whole blocks among them are indexed.
+//Blocks repeated within the write are caught too. Returns bytes written or
+//a negative errno.
+static ssize_t write_deduped(struct wfs_inode *inode, const char *data, size_t size, off_t offset) {
+    off_t end = offset + size;
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    if (end > max_size) {
+        end = max_size > offset ? max_size : offset;
+    }
+    uint64_t fps[MAX_FILE_BLOCKS] = {0};
+    off_t run = offset;  // start of the part not yet written
+    for (off_t pos = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE; pos + BLOCK_SIZE <= end; pos += BLOCK_SIZE) {
+        size_t b = pos / BLOCK_SIZE;
+        const char *block = data + (pos - offset);
+        fps[b] = fingerprint(block);
+        off_t dup = dedupe_find(fps[b], block);
+        if (dup == 0) {
+            //maybe a copy of a block earlier in the pending run, which is indexed once written
+            for (off_t prev = pos - BLOCK_SIZE; prev >= run && dup == 0; prev -= BLOCK_SIZE) {
+                if (fps[prev / BLOCK_SIZE] == fps[b] && memcmp(data + (prev - offset), block, BLOCK_SIZE) == 0) {
+                    dup = -1;
+                }
+            }
+            if (dup == 0) {
+                continue;
+            }
+        }
+
+        if (pos > run) {
+            ssize_t written = write_indexed_run(inode, data, offset, run, pos, fps);
+            if (written < pos - run) {
+                run += written > 0 ? written : 0;
+                return run > offset ? run - offset : written;
+            }
+            run = pos;
+        }
+        if (dup < 0) {
+            dup = dedupe_find(fps[b], block);
+        }
+        off_t cur = get_block_ptr(inode, b);
+        if (dup != 0 && dup == cur) {
+            run = pos + BLOCK_SIZE;  // already holds these contents
+            continue;
+        }
+        off_t *slot = block_ptr_slot(inode, b);
+        if (dup == 0 || !slot || take_block_ref(dup - 1) < 0) {
+            continue;  // written with the next run
+        }
+        *slot = dup;
+        if (cur != 0) {
+            free_data_block(cur - 1);
+        }
+        if (b >= N_BLOCKS - 1) {
+            sync_indirect_block(inode);
+        }
+        run = pos + BLOCK_SIZE;
+    }
+    if (end > run) {
+        ssize_t written = write_indexed_run(inode, data, offset, run, end, fps);
+        if (written < end - run) {
+            run += written > 0 ? written : 0;
+            return run > offset ? run - offset : written;
+        }
+    }
+    return end > offset ? end - offset : -EFBIG;
+}
+
+//Write src at offset, allocating blocks as needed, and update the size and
+//times. Returns bytes written or a negative errno.
+static ssize_t write_inode_data(struct wfs_inode *inode, struct fuse_bufvec *src, off_t offset) {
+    size_t size = fuse_buf_size(src);
+    //inline files stay inline while they fit, and move to a block once they don't
+    if (is_inline(inode) && offset + size > INLINE_DATA_SIZE) {
+        int err = promote_inline_data(inode);
+        if (err < 0) {
+            return err;
+        }
+    }
+    if (is_compressed(inode)) {
+        return write_compressed_data(inode, src, offset);
+    }
+
+    ssize_t bytes_written;
+    //dedupe needs the data in memory; wfs_init() keeps write payloads out of pipes
+    if ((super_block.features & WFS_FEATURE_DEDUPE) && !is_inline(inode) && S_ISREG(inode->mode) &&
+        src->count == 1 && !(src->buf[0].flags & FUSE_BUF_IS_FD) && src->idx == 0 && src->off == 0) {
+        bytes_written = write_deduped(inode, src->buf[0].mem, size, offset);
+    } else {
+        bytes_written = write_mapped(inode, src, offset);
+    }
+
+    // Update inode metadata
+    if (bytes_written > 0) {
+        if (offset + bytes_written > inode->size) {
+            inode->size = offset + bytes_written;
+        }
+        inode->mtim = inode->ctim = time(NULL);
     }
-    printf("===========================\n");
+    sync_inode(inode);
+    return bytes_written;
 }
 
-void debug_dump_data_regions() {
-    printf("\n=== Comparing Data Block Regions ===\n");
-    
-    // // For each block in data region
-    // for (size_t block = 0; block < super_block.num_data_blocks; block++) {
-    //     printf("\nBlock %zu:\n", block);
-        
-    //     // Compare this block across all disks
-    //     for (size_t disk = 0; disk < num_disks; disk++) {
-    //         printf("Disk %zu: ", disk);
-    //         char *block_addr = (char *)disk_map[disk] + super_block.d_blocks_ptr + (block * BLOCK_SIZE);
-            
-    //         // Print first few bytes
-    //         for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
-    //             printf("%02x ", (unsigned char)block_addr[i]);
-    //         }
-    //         printf("...\n");
-            
-    //         // Print as ASCII if printable
-    //         printf("ASCII: ");
-    //         for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
-    //             char c = block_addr[i];
-    //             printf("%c", (c >= 32 && c <= 126) ? c : '.');
-    //         }
-    //         printf("...\n");
-    //     }
-    // }
+//write_inode_data() for a compressed file: every cluster the write touches
+//is read (unless it is overwritten whole), patched and stored again.
+static ssize_t write_compressed_data(struct wfs_inode *inode, struct fuse_bufvec *src, off_t offset) {
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    size_t size = fuse_buf_size(src);
+    if (offset >= max_size) {
+        return -EFBIG;
+    }
+    if (size > (size_t)(max_size - offset)) {
+        size = max_size - offset;
+    }
 
+    char cluster[CLUSTER_SIZE];
+    size_t done = 0;
+    int err = 0;
+    while (done < size) {
+        size_t c = (offset + done) / CLUSTER_SIZE;
+        size_t cluster_off = (offset + done) % CLUSTER_SIZE;
+        size_t len = cluster_blocks(c) * BLOCK_SIZE;
+        size_t n = len - cluster_off < size - done ? len - cluster_off : size - done;
+        if (n < len && (err = load_cluster(inode, c, cluster)) < 0) {
+            break;
+        }
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(n);
+        dst.buf[0].mem = cluster + cluster_off;
+        ssize_t copied = fuse_buf_copy(&dst, src, 0);
+        if (copied <= 0) {
+            err = copied;
+            break;
+        }
+        if ((err = store_cluster(inode, c, cluster)) < 0) {
+            break;
+        }
+        done += copied;
+        if ((size_t)copied < n) {
+            break;
+        }
+    }
 
-    printf("\nBlock %zu:\n", (size_t)1);
-        // Compare this block across all disks
-        for (size_t disk = 0; disk < num_disks; disk++) {
-            printf("Disk %zu: ", disk);
-            char *block_addr = (char *)disk_map[disk] + super_block.d_blocks_ptr + (1 * BLOCK_SIZE);
-            
-            // Print first few bytes
-            for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
-                printf("%02x ", (unsigned char)block_addr[i]);
+    if (done > 0) {
+        if (offset + (off_t)done > inode->size) {
+            inode->size = offset + done;
+        }
+        inode->mtim = inode->ctim = time(NULL);
+    }
+    sync_inode(inode);
+    return done > 0 ? (ssize_t)done : err;
+}
+
+//Zero the stored bytes of [offset, offset + len): the inline area or the
+//allocated blocks in the range, on every disk. Holes are left alone and
+//shared blocks are copied first. Returns 0 or -ENOSPC.
+static int zero_file_range(struct wfs_inode *inode, off_t offset, off_t len) {
+    if (is_inline(inode)) {
+        if (offset < (off_t)INLINE_DATA_SIZE) {
+            off_t n = (off_t)INLINE_DATA_SIZE - offset;
+            memset(inline_data(inode) + offset, 0, len < n ? len : n);
+        }
+        return 0;  // mirrored by the caller's sync_inode()
+    }
+    while (len > 0) {
+        size_t block_offset = offset % BLOCK_SIZE;
+        off_t n = BLOCK_SIZE - block_offset;
+        if (n > len) {
+            n = len;
+        }
+        int unshared = unshare_block(inode, offset / BLOCK_SIZE, 1);
+        if (unshared < 0) {
+            return unshared;
+        }
+        if (unshared && offset / BLOCK_SIZE >= N_BLOCKS - 1) {
+            sync_indirect_block(inode);
+        }
+        off_t block_num = get_block_ptr(inode, offset / BLOCK_SIZE);
+        for (size_t copy = 0; block_num && copy < data_copies(); copy++) {
+            memset(block_data(block_num, copy) + block_offset, 0, n);
+        }
+        if (block_num) {
+            update_parity(block_data(block_num, 0));
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//Free file blocks [first, end) and clear their pointers. The indirect block
+//goes too once it maps nothing. The caller syncs the inode.
+static void release_file_blocks(struct wfs_inode *inode, size_t first, size_t end) {
+    size_t max_blocks = (N_BLOCKS - 1) + POINTERS_PER_BLOCK;
+    if (end > max_blocks) {
+        end = max_blocks;
+    }
+    if (first >= end) {
+        return;
+    }
+    if (first < N_BLOCKS - 1) {
+        size_t direct_end = end < N_BLOCKS - 1 ? end : N_BLOCKS - 1;
+        free_block_ptrs(&inode->blocks[first], direct_end - first);
+        memset(&inode->blocks[first], 0, (direct_end - first) * sizeof(off_t));
+    }
+    if (end > N_BLOCKS - 1 && inode->blocks[N_BLOCKS-1] != 0) {
+        off_t *indirect_ptrs = get_indirect_block(inode);
+        size_t lo = first > N_BLOCKS - 1 ? first - (N_BLOCKS - 1) : 0;
+        size_t hi = end - (N_BLOCKS - 1);
+        free_block_ptrs(&indirect_ptrs[lo], hi - lo);
+        memset(&indirect_ptrs[lo], 0, (hi - lo) * sizeof(off_t));
+
+        size_t in_use = 0;
+        for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+            in_use += (indirect_ptrs[i] != 0);
+        }
+        //synced even when freed, so mirrors keep identical free blocks
+        sync_indirect_block(inode);
+        if (in_use == 0) {
+            free_data_block(inode->blocks[N_BLOCKS-1] - 1);
+            inode->blocks[N_BLOCKS-1] = 0;
+        }
+    }
+}
+
+//Shrink a compressed file: clusters past the new end are freed and the
+//last one is stored again without the cut off tail.
+static int truncate_compressed(struct wfs_inode *inode, off_t size) {
+    size_t end = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (size % CLUSTER_SIZE != 0) {
+        char cluster[CLUSTER_SIZE];
+        size_t c = size / CLUSTER_SIZE;
+        int err = load_cluster(inode, c, cluster);
+        if (err == 0) {
+            memset(cluster + size % CLUSTER_SIZE, 0, cluster_blocks(c) * BLOCK_SIZE - size % CLUSTER_SIZE);
+            err = store_cluster(inode, c, cluster);
+        }
+        if (err < 0) {
+            return err;
+        }
+    }
+    release_file_blocks(inode, end * WFS_CLUSTER_BLOCKS, SIZE_MAX);
+    for (size_t c = end; c * WFS_CLUSTER_BLOCKS < MAX_FILE_BLOCKS; c++) {
+        cluster_map(inode)[c] = 0;
+    }
+    return 0;
+}
+
+//Set the size of a file. Shrinking frees every block past the new end in one
+//pass over the pointers and zeroes the rest of the last block, so the file
+//reads as zeros if it grows again. Growing allocates nothing.
+static int truncate_inode(struct wfs_inode *inode, off_t size) {
+    if (size > (off_t)((N_BLOCKS - 1) + POINTERS_PER_BLOCK) * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+    if (is_inline(inode) && size > (off_t)INLINE_DATA_SIZE) {
+        int err = promote_inline_data(inode);
+        if (err < 0) {
+            return err;
+        }
+    }
+    if (size < inode->size) {
+        if (is_inline(inode)) {
+            zero_file_range(inode, size, inode->size - size);
+        } else if (is_compressed(inode)) {
+            int err = truncate_compressed(inode, size);
+            if (err < 0) {
+                sync_inode(inode);
+                return err;
             }
-            printf("...\n");
-            
-            // Print as ASCII if printable
-            printf("ASCII: ");
-            for (int i = 0; i < 16 && i < BLOCK_SIZE; i++) {
-                char c = block_addr[i];
-                printf("%c", (c >= 32 && c <= 126) ? c : '.');
+        } else {
+            if (size % BLOCK_SIZE != 0) {
+                int err = zero_file_range(inode, size, BLOCK_SIZE - size % BLOCK_SIZE);
+                if (err < 0) {
+                    sync_inode(inode);
+                    return err;
+                }
             }
-            printf("...\n");
+            release_file_blocks(inode, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, SIZE_MAX);
         }
-    printf("===========================\n");
+    }
+    if (size != inode->size) {
+        inode->size = size;
+        inode->mtim = time(NULL);
+    }
+    inode->ctim = time(NULL);
+    sync_inode(inode);
+    return 0;
 }
 
+//fallocate: reserve zeroed blocks for [offset, offset + len) so later writes
+//allocate nothing. Holes are filled with runs of consecutive blocks. The file
+//grows to cover the range unless keep_size is set.
+static int preallocate_range(struct wfs_inode *inode, off_t offset, off_t len, int keep_size) {
+    off_t max_size = (off_t)((N_BLOCKS - 1) + POINTERS_PER_BLOCK) * BLOCK_SIZE;
+    if (offset >= max_size || len > max_size - offset) {
+        return -EFBIG;
+    }
+    int err = 0;
+    if (is_inline(inode) && offset + len > (off_t)INLINE_DATA_SIZE) {
+        err = promote_inline_data(inode);
+    }
+    if (err == 0 && !is_inline(inode)) {
+        ssize_t reserved = allocate_range(inode, offset, len, 1);
+        if (reserved < 0) {
+            err = reserved;
+        } else if (reserved < len) {
+            err = -ENOSPC;  // what we got stays allocated
+        }
+    }
+    if (err == 0 && !keep_size && offset + len > inode->size) {
+        inode->size = offset + len;
+        inode->mtim = time(NULL);
+    }
+    inode->ctim = time(NULL);
+    sync_inode(inode);
+    return err;
+}
 
+//fallocate PUNCH_HOLE: free the blocks inside [offset, offset + len) and zero
+//the partial blocks at either end. The size never changes. Returns 0, or
+//-ENOSPC if a shared partial block could not be copied.
+static int punch_hole(struct wfs_inode *inode, off_t offset, off_t len) {
+    off_t max_size = (off_t)((N_BLOCKS - 1) + POINTERS_PER_BLOCK) * BLOCK_SIZE;
+    int err = 0;
+    if (offset < max_size) {
+        if (len > max_size - offset) {
+            len = max_size - offset;
+        }
+        size_t first_full = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t end_full = (offset + len) / BLOCK_SIZE;
+        if (is_inline(inode) || first_full >= end_full) {
+            err = zero_file_range(inode, offset, len);
+        } else {
+            release_file_blocks(inode, first_full, end_full);
+            err = zero_file_range(inode, offset, (off_t)first_full * BLOCK_SIZE - offset);
+            if (err == 0) {
+                err = zero_file_range(inode, (off_t)end_full * BLOCK_SIZE, offset + len - (off_t)end_full * BLOCK_SIZE);
+            }
+        }
+    }
+    inode->mtim = inode->ctim = time(NULL);
+    sync_inode(inode);
+    return err;
+}
 
+//Copy len bytes of src at off_in to dst at off_out through the mappings: the
+//source range is described in place and written to dst in one copy, holes
+//included. Returns bytes copied or a negative errno.
+static ssize_t copy_range(struct wfs_inode *src, off_t off_in, struct wfs_inode *dst, off_t off_out, size_t len) {
+    struct fuse_bufvec *bufv = map_inode_data(src, len, off_in);
+    if (!bufv) {
+        return -ENOMEM;
+    }
+    ssize_t copied = write_inode_data(dst, bufv, off_out);
+    free(bufv);
+    return copied;
+}
 
-//======================FUSE OPERATIONS===========================//
+//copy_file_range. With reflinks, whole blocks that line up in both files are
+//shared instead of copied, so cloning a file only writes block pointers;
+//the unaligned head and tail are copied. The last, partial block of src is
+//shared too when the copy ends both files. Returns bytes copied or a
+//negative errno. len must not reach past the end of src.
+static ssize_t clone_range(struct wfs_inode *src, off_t off_in, struct wfs_inode *dst, off_t off_out, size_t len) {
+    off_t max_size = (off_t)((N_BLOCKS - 1) + POINTERS_PER_BLOCK) * BLOCK_SIZE;
+    if (off_out >= max_size) {
+        return -EFBIG;
+    }
+    if (len > (size_t)(max_size - off_out)) {
+        len = max_size - off_out;
+    }
 
+    size_t head = 0;
+    size_t shared_blocks = 0;
+    //compressed blocks only mean something at their place in their own file
+    if ((super_block.features & WFS_FEATURE_REFLINK) && !is_inline(src) &&
+        !(src->flags & WFS_INODE_COMPRESSED) && !(dst->flags & WFS_INODE_COMPRESSED) &&
+        off_in % BLOCK_SIZE == off_out % BLOCK_SIZE) {
+        head = (BLOCK_SIZE - off_in % BLOCK_SIZE) % BLOCK_SIZE;
+        if (head > len) {
+            head = len;
+        }
+        shared_blocks = (len - head) / BLOCK_SIZE;
+        if ((len - head) % BLOCK_SIZE != 0 && off_in + (off_t)len == src->size && off_out + (off_t)len >= dst->size) {
+            shared_blocks++;
+        }
+    }
+    if (shared_blocks == 0) {
+        return copy_range(src, off_in, dst, off_out, len);
+    }
 
-//get file/directory attributes
-//gets inode information and fills stbuf with inode information
-int wfs_getattr(const char *path, struct stat *stbuf) {
-    printf("getattr called: %s\n", path);
-    struct wfs_inode *inode = get_inode(path);
-    if (!inode) {
-        return -ENOENT;
+    size_t done = 0;
+    if (head > 0) {
+        ssize_t copied = copy_range(src, off_in, dst, off_out, head);
+        if (copied < (ssize_t)head) {
+            return copied;
+        }
+        done = head;
+    }
+    if (is_inline(dst)) {
+        int err = promote_inline_data(dst);
+        if (err < 0) {
+            return done > 0 ? (ssize_t)done : err;
+        }
     }
 
-    //calculate total number of blocks
-    int num_blocks = 0;
-    for (int i = 0; i < N_BLOCKS; i++)
-    {
-        if (inode->blocks[i] != 0)
-        {
-            num_blocks++;
+    size_t src_block = (off_in + done) / BLOCK_SIZE;
+    size_t dst_block = (off_out + done) / BLOCK_SIZE;
+    size_t b;
+    for (b = 0; b < shared_blocks; b++) {
+        off_t *slot = block_ptr_slot(dst, dst_block + b);
+        if (!slot) {
+            break;  // no room for the indirect block
+        }
+        off_t block_num = get_block_ptr(src, src_block + b);
+        if (*slot == block_num) {
+            continue;
+        }
+        //a hole stays a hole; a block with too many sharers ends the clone
+        if (block_num != 0 && take_block_ref(block_num - 1) < 0) {
+            break;
         }
+        if (*slot != 0) {
+            free_data_block(*slot - 1);
+        }
+        *slot = block_num;
     }
+    sync_indirect_block(dst);
+    size_t cloned = b * BLOCK_SIZE;
+    done += cloned < len - done ? cloned : len - done;
 
-    //Fill stbuf with inode information
-    stbuf->st_uid = inode->uid;
-    stbuf->st_gid = inode->gid;
-    stbuf->st_atime = inode->atim;
-    stbuf->st_mtime = inode->mtim;
-    stbuf->st_ctime = inode->ctim;
-    stbuf->st_mode = inode->mode;
-    stbuf->st_size = inode->size;
-    stbuf->st_nlink = inode->nlinks;
-    stbuf->st_blksize = BLOCK_SIZE;
-    stbuf->st_blocks = num_blocks;
+    if (done > (size_t)0 && off_out + (off_t)done > dst->size) {
+        dst->size = off_out + done;
+    }
+    dst->mtim = dst->ctim = time(NULL);
+    sync_inode(dst);
+
+    //whatever could not be shared is copied
+    if (done < len) {
+        ssize_t copied = copy_range(src, off_in + done, dst, off_out + done, len - done);
+        if (copied < 0) {
+            return done > 0 ? (ssize_t)done : copied;
+        }
+        done += copied;
+    }
+    return done;
+}
 
-    return 0;
+
+//called once the filesystem is mounted (and daemonized), so it is safe to start threads here
+//Negotiates the connection: large writes, full readahead, splicing, and
+//cache behaviour to match the cache mount options. Explicit -o settings for
+//the connection (max_write=, max_readahead=, ...) are applied last and win.
+void wfs_init(void *userdata, struct fuse_conn_info *conn) {
+    //let libfuse splice read replies to the kernel and write payloads into write_buf
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+    //dedupe hashes write payloads, so it wants them in memory rather than in a pipe
+    if ((conn->capable & FUSE_CAP_SPLICE_READ) && !(super_block.features & WFS_FEATURE_DEDUPE)) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
+    //writes of up to MAX_WRITE per request instead of one page at a time;
+    //libfuse sizes max_pages from this
+    conn->max_write = MAX_WRITE;
+    //conn->max_readahead starts at the kernel's own limit, keep all of it
+    if (conn->capable & FUSE_CAP_ASYNC_READ) {
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    }
+    //with auto_cache the kernel also drops cached pages when it sees a new mtime
+    if (options.auto_cache && (conn->capable & FUSE_CAP_AUTO_INVAL_DATA)) {
+        conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
+    }
+    if (conn->capable & FUSE_CAP_PARALLEL_DIROPS) {
+        conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+    }
+    //chattr +c on directories
+    if (conn->capable & FUSE_CAP_IOCTL_DIR) {
+        conn->want |= FUSE_CAP_IOCTL_DIR;
+    }
+    //libfuse asks for atomic O_TRUNC by default, which would leave truncating
+    //to open(); have the kernel send it as a setattr like ftruncate instead
+    conn->want &= ~FUSE_CAP_ATOMIC_O_TRUNC;
+    //timestamps are stored in whole seconds
+    conn->time_gran = 1000000000;
+    if (conn_opts) {
+        fuse_apply_conn_info_opts(conn_opts, conn);
+    }
+
+    if (super_block.i_init_hwm < super_block.num_inodes) {
+        itable_init_stop = 0;
+        if (pthread_create(&itable_init_thread, NULL, itable_init_worker, NULL) == 0) {
+            itable_init_running = 1;
+        }
+    }
+    if ((raid_mode == RAID1 || raid_mode == RAID1V) && disk_health[1] == DISK_HEALTHY) {
+        scrub_stop = 0;
+        scrub.state = options.scrub ? WFS_SCRUB_RUNNING : WFS_SCRUB_IDLE;
+        scrub.rate = options.scrub_rate;
+        scrub.total = super_block.num_data_blocks;
+        if (pthread_create(&scrub_thread, NULL, scrub_worker, NULL) == 0) {
+            scrub_running = 1;
+        }
+    }
+    if (reshape_disks) {
+        reshape_stop = 0;
+        if (pthread_create(&reshape_thread, NULL, reshape_worker, NULL) == 0) {
+            reshape_running = 1;
+        }
+    }
+    start_tier_worker();
+    for (size_t disk = 0; disk < num_disks; disk++) {
+        if (disk_health[disk] == DISK_REBUILDING) {
+            rebuild_stop = 0;
+            if (pthread_create(&rebuild_thread, NULL, rebuild_worker, NULL) == 0) {
+                rebuild_running = 1;
+            }
+            break;
+        }
+    }
+}
+
+void wfs_destroy(void *userdata) {
+    if (itable_init_running) {
+        __atomic_store_n(&itable_init_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(itable_init_thread, NULL);
+        itable_init_running = 0;
+    }
+    if (rebuild_running) {
+        __atomic_store_n(&rebuild_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(rebuild_thread, NULL);
+        rebuild_running = 0;
+    }
+    if (scrub_running) {
+        pthread_mutex_lock(&scrub_lock);
+        scrub_stop = 1;
+        pthread_cond_signal(&scrub_cond);
+        pthread_mutex_unlock(&scrub_lock);
+        pthread_join(scrub_thread, NULL);
+        scrub_running = 0;
+    }
+    if (reshape_running) {
+        __atomic_store_n(&reshape_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(reshape_thread, NULL);
+        reshape_running = 0;
+    }
+    if (tier_running) {
+        __atomic_store_n(&tier_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(tier_thread, NULL);
+        tier_running = 0;
+    }
+    //the kernel holds no references any more, so open-but-unlinked inodes can go
+    if (orphan_count > 0) {
+        reclaim_orphans();
+    }
+    //counters are written through on every change, so only the state flips here
+    set_volume_state(WFS_STATE_CLEAN);
+}
+
+//resolve one path component; the only place names are looked up
+void wfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    TRACE("lookup called: %lu/%s\n", (unsigned long)parent, name);
+    pthread_rwlock_rdlock(&fs_lock);
+    if (is_snapshots_dir(parent, name)) {
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = SNAPSHOTS_DIR_INO;
+        e.attr_timeout = options.attr_timeout;
+        e.entry_timeout = options.entry_timeout;
+        fill_snapshots_dir_stat(&e.attr);
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (parent == SNAPSHOTS_DIR_INO) {
+        //a snapshot's root is the root inode as of the snapshot
+        int snap = find_snapshot(name);
+        if (snap < 0) {
+            pthread_rwlock_unlock(&fs_lock);
+            reply_negative_entry(req);
+            return;
+        }
+        fuse_ino_t ino = ((fuse_ino_t)(snap + 1) << SNAPSHOT_INO_SHIFT) | FUSE_ROOT_ID;
+        reply_entry(req, ino, get_inode_by_ino(ino));
+        pthread_rwlock_unlock(&fs_lock);
+        return;
+    }
+    struct wfs_inode *dir = get_inode_by_ino(parent);
+    if (!dir) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!S_ISDIR(dir->mode)) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct wfs_dentry *entry = find_dir_entry(dir, name);
+    struct wfs_inode *inode = entry ? get_inode_by_ino(view_ino(parent, entry->num)) : NULL;
+    if (!inode) {
+        pthread_rwlock_unlock(&fs_lock);
+        reply_negative_entry(req);
+        return;
+    }
+    reply_entry(req, view_ino(parent, entry->num), inode);
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+void wfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    forget_inode(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+void wfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        forget_inode(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+//get file/directory attributes
+void wfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    TRACE("getattr called: %lu\n", (unsigned long)ino);
+    struct stat stbuf;
+    read_lock_file(ino);
+    if (ino == SNAPSHOTS_DIR_INO && (super_block.features & WFS_FEATURE_SNAPSHOTS)) {
+        fill_snapshots_dir_stat(&stbuf);
+        unlock_file(ino, 0);
+        fuse_reply_attr(req, &stbuf, options.attr_timeout);
+        return;
+    }
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    if (!inode) {
+        unlock_file(ino, 0);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fill_stat(inode, &stbuf);
+    stbuf.st_ino = ino;
+    unlock_file(ino, 0);
+    fuse_reply_attr(req, &stbuf, options.attr_timeout);
 }
 
-int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    printf("readdir called: %s\n", path);
+//filesystem statistics come straight from the superblock counters, no bitmap scan
+void wfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+    //RAID0 capacity is the sum of every disk, mirrors only count one copy;
+    //num_data_blocks of a parity or RAID10 volume already counts only data
+    size_t free_blocks = __atomic_load_n(&super_block.free_blocks, __ATOMIC_RELAXED);
+    size_t free_inodes = __atomic_load_n(&super_block.free_inodes, __ATOMIC_RELAXED);
+
+    struct statvfs stbuf;
+    memset(&stbuf, 0, sizeof(struct statvfs));
+    stbuf.f_bsize = BLOCK_SIZE;
+    stbuf.f_frsize = BLOCK_SIZE;
+    stbuf.f_blocks = volume_data_blocks();
+    stbuf.f_bfree = free_blocks;
+    stbuf.f_bavail = free_blocks;
+    stbuf.f_files = super_block.num_inodes;
+    stbuf.f_ffree = free_inodes;
+    stbuf.f_favail = free_inodes;
+    stbuf.f_namemax = MAX_NAME - 1;
+    fuse_reply_statfs(req, &stbuf);
+}
+
+//List /.snapshots. The entry of snapshot record n is followed by offset n + 3.
+static void readdir_snapshots(fuse_req_t req, size_t size, off_t off) {
+    char *buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t len = 0;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    for (off_t n = off; n < MAX_SNAPSHOTS + 2; n++) {
+        const char *name;
+        if (n < 2) {
+            name = n == 0 ? "." : "..";
+            st.st_ino = n == 0 ? SNAPSHOTS_DIR_INO : FUSE_ROOT_ID;
+        } else if (get_snapshot(0, n - 2)->gen != 0) {
+            name = get_snapshot(0, n - 2)->name;
+            st.st_ino = ((fuse_ino_t)(n - 1) << SNAPSHOT_INO_SHIFT) | FUSE_ROOT_ID;
+        } else {
+            continue;
+        }
+        size_t entry_size = fuse_add_direntry(req, buf + len, size - len, name, &st, n + 1);
+        if (entry_size > size - len) break;  // Buffer full
+        len += entry_size;
+    }
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
 
+//Directory offsets: 1 and 2 follow "." and "..", an entry in slot n of the
+//directory is followed by n + 3. Slots never move, so offsets stay valid
+//while entries are added or removed between calls.
+void wfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    TRACE("readdir called: %lu\n", (unsigned long)ino);
+
+    pthread_rwlock_rdlock(&fs_lock);
+    if (ino == SNAPSHOTS_DIR_INO && (super_block.features & WFS_FEATURE_SNAPSHOTS)) {
+        readdir_snapshots(req, size, off);
+        pthread_rwlock_unlock(&fs_lock);
+        return;
+    }
     // Get directory inode
-    struct wfs_inode *dir_inode = get_inode(path);
-    if (!dir_inode) return -ENOENT;
-    if (!S_ISDIR(dir_inode->mode)) return -ENOTDIR;
+    struct wfs_inode *dir_inode = get_inode_by_ino(ino);
+    if (!dir_inode || !S_ISDIR(dir_inode->mode)) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, dir_inode ? ENOTDIR : ENOENT);
+        return;
+    }
+
+    char *buf = malloc(size);
+    if (!buf) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t len = 0;
+    size_t entry_size;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
 
     // Add . and .. entries
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    st.st_mode = S_IFDIR;
+    st.st_ino = ino;
+    if (off < 1) {
+        entry_size = fuse_add_direntry(req, buf + len, size - len, ".", &st, 1);
+        if (entry_size > size - len) goto full;
+        len += entry_size;
+    }
+    if (off < 2) {
+        entry_size = fuse_add_direntry(req, buf + len, size - len, "..", &st, 2);
+        if (entry_size > size - len) goto full;
+        len += entry_size;
+    }
 
     // Read through directory blocks
     for (int block_idx = 0; block_idx < N_BLOCKS - 1; block_idx++) {
-        if (dir_inode->blocks[block_idx] == 0) continue;
-
-        // Get block location based on RAID mode
-        size_t disk_idx;
-        off_t block_offset;
-        
-        if (raid_mode == RAID0) {
-            disk_idx = get_raid0_disk_index(dir_inode->blocks[block_idx] - 1);
-            block_offset = get_raid0_block_offset(dir_inode->blocks[block_idx] - 1);
-        } else {
-            disk_idx = 0;
-            block_offset = super_block.d_blocks_ptr + 
-                          ((dir_inode->blocks[block_idx] - 1) * BLOCK_SIZE);
+        size_t count;
+        struct wfs_dentry *entries = get_dir_entries(dir_inode, block_idx, &count);
+        if (!entries) continue;
+
+        // Fill buffer with valid entries not returned by an earlier call
+        for (size_t i = 0; i < count; i++) {
+            off_t next_off = block_idx * ENTRIES_PER_BLOCK + i + 3;
+            if (entries[i].num == 0 || next_off <= off) continue;
+
+            st.st_ino = view_ino(ino, entries[i].num);
+            struct wfs_inode *child = get_inode_by_ino(st.st_ino);
+            if (!child) continue;
+            st.st_mode = child->mode;
+            entry_size = fuse_add_direntry(req, buf + len, size - len, entries[i].name, &st, next_off);
+            if (entry_size > size - len) goto full;  // Buffer full
+            len += entry_size;
         }
+    }
 
-        // Read directory entries
-        struct wfs_dentry *entries = (struct wfs_dentry *)((char *)disk_map[disk_idx] + block_offset);
-        int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
-        
-        // Fill buffer with valid entries
-        for (int i = 0; i < entries_per_block; i++) {
-            if (entries[i].num != 0) {  // Valid entry
-                // Get entry's inode
-                struct wfs_inode *entry_inode = (struct wfs_inode *)((char *)disk_map[0] + 
-                    super_block.i_blocks_ptr + (entries[i].num * BLOCK_SIZE));
-                
-                struct stat st = {0};
-                st.st_ino = entries[i].num;
-                st.st_mode = entry_inode->mode;
-                
-                if (filler(buf, entries[i].name, &st, 0))
-                    return 0;  // Buffer full
-            }
+full:
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
+
+//create an inode of the given mode in parent and reply with its entry
+static void make_node(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    pthread_rwlock_wrlock(&fs_lock);
+    //mkdir in /.snapshots takes a snapshot
+    if (parent == SNAPSHOTS_DIR_INO && S_ISDIR(mode)) {
+        size_t snap;
+        int err = take_snapshot(name, &snap);
+        if (err < 0) {
+            fuse_reply_err(req, -err);
+        } else {
+            fuse_ino_t ino = ((fuse_ino_t)(snap + 1) << SNAPSHOT_INO_SHIFT) | FUSE_ROOT_ID;
+            reply_entry(req, ino, get_inode_by_ino(ino));
         }
+        pthread_rwlock_unlock(&fs_lock);
+        return;
+    }
+    if (is_snapshot_ino(parent) || is_snapshots_dir(parent, name)) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, is_snapshot_ino(parent) ? EROFS : EEXIST);
+        return;
+    }
+    struct wfs_inode *dir = get_inode_by_ino(parent);
+    if (!dir || !S_ISDIR(dir->mode)) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, dir ? ENOTDIR : ENOENT);
+        return;
     }
-    
-    return 0;
-}
 
-int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    printf("mknod called: %s\n", path);
-    //set mode to file
-    // mode |= S_IFREG;
-    //handle insertion
-    int insertion = handle_inode_insertion(path, mode);
-    if (insertion != 0){
-        return insertion;
+    struct wfs_inode *new_inode;
+    int insertion = handle_inode_insertion(dir, name, mode, &new_inode);
+    if (insertion != 0) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, -insertion);
+        return;
     }
+    reply_entry(req, num_to_ino(new_inode->num), new_inode);
+    pthread_rwlock_unlock(&fs_lock);
+}
 
-    // //print data bitmap 
-    debug_print_data_bitmap();
-    return 0;//success
+void wfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    TRACE("mknod called: %lu/%s\n", (unsigned long)parent, name);
+    make_node(req, parent, name, mode);
 }
 
 
@@ -794,268 +4832,495 @@ int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 // update data bitmap if new data block is allocated
 //raid1: update datablocks on all disks and update data bitmap on all disks
 //raid0: update datablocks on one disk and update data bitmap on one disk (Which disk to update?)
-int wfs_mkdir(const char *path, mode_t mode) {
-    printf("mkdir called: %s\n", path);
+void wfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    TRACE("mkdir called: %lu/%s\n", (unsigned long)parent, name);
 
     //set mode to directory
-    mode |= S_IFDIR;
-
-    //handle insertion
-    int insertion = handle_inode_insertion(path, mode);
-    if (insertion != 0){
-        return insertion;
-    }
-    return 0;//success
+    make_node(req, parent, name, mode | S_IFDIR);
 }
 
-int wfs_unlink(const char *path) {
-    printf("unlink called: %s\n", path);
-    
-    struct wfs_inode *inode = get_inode(path);
-    if (!inode) return -ENOENT;
-    if (!S_ISREG(inode->mode)) return -EISDIR;
-
-    char *parent_path = get_parent_path(path);
-    char *file_name = get_file_name(path);
-    struct wfs_inode *parent = get_inode(parent_path);
-    if (!parent) {
-        free(parent_path);
-        free(file_name);
-        return -ENOENT;
-    }
+void wfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    TRACE("unlink called: %lu/%s\n", (unsigned long)parent, name);
+    int err = 0;
 
-    int ret = remove_dir_entry(parent, file_name);
-    if (ret < 0) {
-        free(parent_path);
-        free(file_name);
-        return ret;
+    pthread_rwlock_wrlock(&fs_lock);
+    if (is_snapshot_ino(parent)) {
+        err = EROFS;
+        goto out;
+    }
+    struct wfs_inode *dir = get_inode_by_ino(parent);
+    struct wfs_dentry *entry = dir ? find_dir_entry(dir, name) : NULL;
+    if (!entry) {
+        err = ENOENT;
+        goto out;
+    }
+    struct wfs_inode *inode = get_inode_by_num(entry->num);
+    if (S_ISDIR(inode->mode)) {
+        err = EISDIR;
+        goto out;
     }
 
-    free_inode(inode);
-
-    free(parent_path);
-    free(file_name);
-    return 0;
+    err = -cow_inode(dir);
+    if (err == 0) {
+        err = -cow_inode(inode);
+    }
+    if (err == 0) {
+        err = -remove_dir_entry(dir, name);
+    }
+    if (err == 0) {
+        release_inode(inode);
+    }
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_err(req, err);
 }
 
-int wfs_rmdir(const char *path) {
-    printf("rmdir called: %s\n", path);
-    
-    // Don't allow removing root
-    if (strcmp(path, "/") == 0) {
-        return -EBUSY;
+void wfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    TRACE("rmdir called: %lu/%s\n", (unsigned long)parent, name);
+    int err = 0;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    //rmdir in /.snapshots deletes a snapshot
+    if (parent == SNAPSHOTS_DIR_INO) {
+        err = -delete_snapshot(name);
+        goto out;
+    }
+    if (is_snapshot_ino(parent)) {
+        err = EROFS;
+        goto out;
+    }
+    struct wfs_inode *dir = get_inode_by_ino(parent);
+    struct wfs_dentry *entry = dir ? find_dir_entry(dir, name) : NULL;
+    if (!entry) {
+        err = ENOENT;
+        goto out;
     }
 
     // Get directory inode
-    struct wfs_inode *inode = get_inode(path);
-    if (!inode) return -ENOENT;
-    if (!S_ISDIR(inode->mode)) return -ENOTDIR;
+    struct wfs_inode *inode = get_inode_by_num(entry->num);
+    if (!S_ISDIR(inode->mode)) {
+        err = ENOTDIR;
+        goto out;
+    }
     
     // Check if directory is empty
-    if (inode->size > 0) {
-        return -ENOTEMPTY;
-    }
-
-    // Get parent
-    char *parent_path = get_parent_path(path);
-    char *dir_name = get_file_name(path);
-    struct wfs_inode *parent = get_inode(parent_path);
-    if (!parent) {
-        free(parent_path);
-        free(dir_name);
-        return -ENOENT;
+    if (inode->size > 0) {
+        err = ENOTEMPTY;
+        goto out;
     }
 
     // Remove from parent directory
-    int ret = remove_dir_entry(parent, dir_name);
-    if (ret < 0) {
-        free(parent_path);
-        free(dir_name);
-        return ret;
+    err = -cow_inode(dir);
+    if (err == 0) {
+        err = -cow_inode(inode);
+    }
+    if (err == 0) {
+        err = -remove_dir_entry(dir, name);
+    }
+    if (err != 0) {
+        goto out;
     }
 
     // Update parent's link count (for removed ..)
-    parent->nlinks--;
+    dir->nlinks--;
+    sync_inode(dir);
+
+    // Free directory's inode and blocks once the kernel lets go of it
+    release_inode(inode);
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_err(req, err);
+}
 
-    // Update parent inode on all disks
-    for (size_t disk = 0; disk < num_disks; disk++) {
-        char *inode_block = (char *)disk_map[disk] + super_block.i_blocks_ptr + 
-                           (parent->num * BLOCK_SIZE);
-        memcpy(inode_block, parent, sizeof(struct wfs_inode));
+//Decide whether the kernel may keep cached pages of the file across this open
+void wfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    //auto_cache updates the inode's cache stamp
+    if (options.auto_cache) {
+        pthread_rwlock_wrlock(&fs_lock);
+    } else {
+        pthread_rwlock_rdlock(&fs_lock);
+    }
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    if (!inode || !S_ISREG(inode->mode)) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, inode ? EISDIR : ENOENT);
+        return;
+    }
+    if (is_snapshot_ino(ino) && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))) {
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_err(req, EROFS);
+        return;
     }
 
-    // Free directory's inode and blocks
-    free_inode(inode);
-    free(parent_path);
-    free(dir_name);
-    return 0;
+    if (options.direct_io) {
+        fi->direct_io = 1;
+    } else if (options.auto_cache) {
+        //keep the cache only if nothing changed since the previous open
+        struct cache_stamp *stamp = &cache_stamps[inode->num];
+        fi->keep_cache = (stamp->size == inode->size && stamp->mtim == inode->mtim);
+        stamp->size = inode->size;
+        stamp->mtim = inode->mtim;
+    } else if (options.kernel_cache) {
+        //all writes go through this mount, so cached pages never go stale
+        fi->keep_cache = 1;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_open(req, fi);
 }
 
-int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("read called: %s, size=%zu, offset=%ld\n", path, size, offset);
-    
-    struct wfs_inode *inode = get_inode(path);
-    if (!inode) return -ENOENT;
-    if (!S_ISREG(inode->mode)) return -EISDIR;
+//Directory listings are cached by the kernel too; it drops them whenever
+//the directory changes through this mount
+void wfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&fs_lock);
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    pthread_rwlock_unlock(&fs_lock);
+    if (ino != SNAPSHOTS_DIR_INO && (!inode || !S_ISDIR(inode->mode))) {
+        fuse_reply_err(req, inode ? ENOTDIR : ENOENT);
+        return;
+    }
+    if (!options.direct_io) {
+        fi->cache_readdir = 1;
+        fi->keep_cache = 1;
+    }
+    fuse_reply_open(req, fi);
+}
+
+//Reply with segments pointing into the disk mappings; libfuse hands them to
+//the kernel without copying them in userspace. The read lock is held until
+//the reply is sent so no writer can change the blocks underneath it.
+void wfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    TRACE("read called: %lu, size=%zu, offset=%ld\n", (unsigned long)ino, size, off);
+    __atomic_add_fetch(&foreground_ops, 1, __ATOMIC_RELAXED);
+
+    read_lock_file(ino);
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    if (!inode || !S_ISREG(inode->mode)) {
+        unlock_file(ino, 0);
+        fuse_reply_err(req, inode ? EISDIR : ENOENT);
+        return;
+    }
 
     // Check offset bounds
-    if (offset >= inode->size) return 0;
-    if (offset + size > inode->size) {
-        size = inode->size - offset;
+    if (off >= inode->size) {
+        unlock_file(ino, 0);
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if (off + size > inode->size) {
+        size = inode->size - off;
     }
 
-    // Calculate block range
-    size_t start_block = offset / BLOCK_SIZE;
-    size_t end_block = (offset + size - 1) / BLOCK_SIZE;
-    
-    // Get indirect block if needed
-    off_t *indirect_ptrs = NULL;
-    if (end_block >= N_BLOCKS - 1) {
-        indirect_ptrs = get_indirect_block(inode);
-        if (!indirect_ptrs) return -EIO;
+    struct fuse_bufvec *bufv = map_inode_data(inode, size, off);
+    if (!bufv) {
+        unlock_file(ino, 0);
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    unlock_file(ino, 0);
+    free(bufv);
+}
 
-    // Read data blocks
-    size_t bytes_read = 0;
-    size_t buf_offset = 0;
+//Writes come in as a buffer vector, which is the FUSE pipe itself when
+//splice reads are enabled; write_inode_data() copies it into the mapping.
+void wfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    TRACE("write_buf called: %lu, size=%zu, offset=%ld\n", (unsigned long)ino, fuse_buf_size(bufv), off);
+    __atomic_add_fetch(&foreground_ops, 1, __ATOMIC_RELAXED);
+
+    int exclusive;
+    struct wfs_inode *inode = write_lock_file(ino, &exclusive);
+    if (!inode || !S_ISREG(inode->mode) || is_snapshot_ino(ino)) {
+        unlock_file(ino, exclusive);
+        fuse_reply_err(req, !inode ? ENOENT : is_snapshot_ino(ino) ? EROFS : EISDIR);
+        return;
+    }
+    ssize_t bytes_written = cow_inode(inode);
+    if (bytes_written == 0) {
+        bytes_written = write_inode_data(inode, bufv, off);
+    }
+    unlock_file(ino, exclusive);
+    if (bytes_written < 0) {
+        fuse_reply_err(req, -bytes_written);
+    } else {
+        fuse_reply_write(req, bytes_written);
+    }
+}
 
-    for (size_t b = start_block; b <= end_block && bytes_read < size; b++) {
-        // Get block number
-        off_t block_num;
-        if (b < N_BLOCKS - 1) {
-            block_num = inode->blocks[b];
-        } else {
-            block_num = indirect_ptrs[b - (N_BLOCKS - 1)];
-        }
-        if (block_num == 0) continue;  // Skip unallocated blocks
+//Move a directory entry, O(1) in the size of the file: only dentries change.
+//An existing target is replaced by repointing its entry in place, and the new
+//name always exists before the old one is removed, so a crash at any point
+//leaves the file reachable and "write a temp file, rename it over" stays safe.
+//RENAME_NOREPLACE and RENAME_EXCHANGE are supported.
+void wfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags) {
+    TRACE("rename called: %lu/%s -> %lu/%s\n", (unsigned long)parent, name, (unsigned long)newparent, newname);
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if (strlen(newname) >= MAX_NAME) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    int err = 0;
 
-        // Calculate offsets
-        size_t block_offset = (b == start_block) ? offset % BLOCK_SIZE : 0;
-        size_t bytes_this_block = BLOCK_SIZE - block_offset;
-        if (bytes_read + bytes_this_block > size) {
-            bytes_this_block = size - bytes_read;
+    pthread_rwlock_wrlock(&fs_lock);
+    if (is_snapshot_ino(parent) || is_snapshot_ino(newparent)) {
+        err = EROFS;
+        goto out;
+    }
+    if (is_snapshots_dir(newparent, newname)) {
+        err = EEXIST;
+        goto out;
+    }
+    struct wfs_inode *dir = get_inode_by_ino(parent);
+    struct wfs_inode *newdir = get_inode_by_ino(newparent);
+    if (!dir || !newdir) {
+        err = ENOENT;
+        goto out;
+    }
+    if (!S_ISDIR(dir->mode) || !S_ISDIR(newdir->mode)) {
+        err = ENOTDIR;
+        goto out;
+    }
+    struct wfs_dentry *entry = find_dir_entry(dir, name);
+    if (!entry) {
+        err = ENOENT;
+        goto out;
+    }
+    struct wfs_inode *inode = get_inode_by_num(entry->num);
+    struct wfs_dentry *target = find_dir_entry(newdir, newname);
+    if (target == entry) {
+        goto out;  // renamed to itself
+    }
+    if (target && (flags & RENAME_NOREPLACE)) {
+        err = EEXIST;
+        goto out;
+    }
+    if (!target && (flags & RENAME_EXCHANGE)) {
+        err = ENOENT;
+        goto out;
+    }
+    //a directory cannot move below itself
+    if (S_ISDIR(inode->mode) && dir != newdir && dir_contains(inode, newdir->num)) {
+        err = EINVAL;
+        goto out;
+    }
+    //keep what snapshots see of everything involved; copying may move
+    //directory blocks, so the entries are looked up again
+    err = -cow_inode(dir);
+    if (err == 0 && newdir != dir) {
+        err = -cow_inode(newdir);
+    }
+    if (err == 0) {
+        err = -cow_inode(inode);
+    }
+    if (err == 0 && target) {
+        err = -cow_inode(get_inode_by_num(target->num));
+    }
+    if (err != 0) {
+        goto out;
+    }
+    entry = find_dir_entry(dir, name);
+    target = find_dir_entry(newdir, newname);
+    time_t now = time(NULL);
+
+    if (flags & RENAME_EXCHANGE) {
+        struct wfs_inode *other = get_inode_by_num(target->num);
+        if (S_ISDIR(other->mode) && dir != newdir && dir_contains(other, dir->num)) {
+            err = EINVAL;
+            goto out;
         }
+        set_dir_entry_num(target, inode->num);
+        set_dir_entry_num(entry, other->num);
+        dir->mtim = dir->ctim = newdir->mtim = newdir->ctim = now;
+        inode->ctim = other->ctim = now;
+        sync_inode(dir);
+        sync_inode(newdir);
+        sync_inode(inode);
+        sync_inode(other);
+        goto out;
+    }
 
-        // Read block based on RAID mode
-        if (raid_mode == RAID0) {
-            size_t disk_idx = get_raid0_disk_index(block_num - 1);
-            off_t block_addr = get_raid0_block_offset(block_num - 1);
-            memcpy(buf + buf_offset, 
-                  (char *)disk_map[disk_idx] + block_addr + block_offset,
-                  bytes_this_block);
-        } else {
-            off_t block_addr = super_block.d_blocks_ptr + ((block_num - 1) * BLOCK_SIZE);
-            memcpy(buf + buf_offset,
-                  (char *)disk_map[0] + block_addr + block_offset,
-                  bytes_this_block);
+    struct wfs_inode *replaced = NULL;
+    if (target) {
+        replaced = get_inode_by_num(target->num);
+        if (S_ISDIR(replaced->mode) && !S_ISDIR(inode->mode)) {
+            err = EISDIR;
+            goto out;
+        }
+        if (!S_ISDIR(replaced->mode) && S_ISDIR(inode->mode)) {
+            err = ENOTDIR;
+            goto out;
+        }
+        if (S_ISDIR(replaced->mode) && replaced->size > 0) {
+            err = ENOTEMPTY;
+            goto out;
+        }
+        set_dir_entry_num(target, inode->num);
+    } else {
+        err = -add_entry_to_parent_directory(newdir, newname, inode->num);
+        if (err != 0) {
+            goto out;
         }
-
-        bytes_read += bytes_this_block;
-        buf_offset += bytes_this_block;
     }
-
-    return bytes_read;
+    newdir->mtim = newdir->ctim = now;
+    sync_inode(newdir);
+
+    //by name: adding to an inline directory may have moved its entries
+    remove_dir_entry(dir, name);
+    inode->ctim = now;
+    sync_inode(inode);
+    if (replaced) {
+        release_inode(replaced);
+    }
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_err(req, err);
 }
 
-int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("write called: %s, size=%zu, offset=%ld\n", path, size, offset); 
-    // Get file inode
-    struct wfs_inode *inode = get_inode(path);
-    if (!inode) {
-        return -ENOENT;
+//Copy between (or within) files without the data passing through the
+//kernel; with reflinks aligned blocks are shared, see clone_range()
+void wfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+                         fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags) {
+    TRACE("copy_file_range called: %lu:%ld -> %lu:%ld, len=%zu\n", (unsigned long)ino_in, off_in,
+           (unsigned long)ino_out, off_out, len);
+    if (flags != 0 || off_in < 0 || off_out < 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
     }
 
-    // Check if regular file
-    if (!S_ISREG(inode->mode)) {
-        return -EISDIR;
+    pthread_rwlock_wrlock(&fs_lock);
+    struct wfs_inode *src = get_inode_by_ino(ino_in);
+    struct wfs_inode *dst = get_inode_by_ino(ino_out);
+    ssize_t copied = 0;
+    if (!src || !dst) {
+        copied = -ENOENT;
+    } else if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+        copied = -EISDIR;
+    } else if (is_snapshot_ino(ino_out)) {
+        copied = -EROFS;  // copying out of a snapshot is fine
+    } else if (off_in < src->size && (copied = cow_inode(dst)) == 0) {
+        if (len > (size_t)(src->size - off_in)) {
+            len = src->size - off_in;
+        }
+        if (src == dst && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) {
+            copied = -EINVAL;  // overlapping ranges of one file
+        } else {
+            copied = clone_range(src, off_in, dst, off_out, len);
+        }
     }
+    pthread_rwlock_unlock(&fs_lock);
+    if (copied < 0) {
+        fuse_reply_err(req, -copied);
+    } else {
+        fuse_reply_write(req, copied);
+    }
+}
 
-    // Calculate blocks needed
-    size_t end_pos = offset + size;
-    size_t start_block = offset / BLOCK_SIZE;
-
-    printf("Start block: %ld\n", start_block);
-    size_t end_block = (end_pos + BLOCK_SIZE - 1) / BLOCK_SIZE;
+//Only SEEK_DATA and SEEK_HOLE reach the filesystem; the kernel handles the rest
+void wfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi) {
+    TRACE("lseek called: %lu, off=%ld, whence=%d\n", (unsigned long)ino, off, whence);
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
 
-    // Get indirect block if needed
-    off_t *indirect_ptrs = NULL;
-    if (end_block >= N_BLOCKS - 1) {
-        indirect_ptrs = get_indirect_block(inode);
-        if (!indirect_ptrs) return -ENOSPC;
+    read_lock_file(ino);
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    off_t result = -ENOENT;
+    if (inode) {
+        result = off < 0 ? -ENXIO : seek_data_or_hole(inode, off, whence);
+    }
+    unlock_file(ino, 0);
+    if (result < 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_lseek(req, result);
     }
+}
 
-    // Write data to blocks
-    size_t bytes_written = 0;
-    size_t buf_offset = 0;
-    
-    for (size_t b = start_block; b < end_block && bytes_written < size; b++) {
-        // Get block number 
-        off_t block_num;
-        if (b < N_BLOCKS - 1) { // Direct block
-            if (inode->blocks[b] == 0) {
-                int new_block = allocate_data_block();
-                if (new_block < 0) return -ENOSPC;
-                inode->blocks[b] = new_block + 1;
-            }
-            block_num = inode->blocks[b];
-        } else { // Indirect block
-            size_t indirect_idx = b - (N_BLOCKS - 1);
-            if (indirect_ptrs[indirect_idx] == 0) { // Allocate new indirect block
-                int new_block = allocate_data_block();
-                if (new_block < 0) return -ENOSPC;
-                indirect_ptrs[indirect_idx] = new_block + 1;
-            }
-            block_num = indirect_ptrs[indirect_idx];
-        }
-        
-        // Calculate offsets within block
-        size_t block_offset = (b == start_block) ? offset % BLOCK_SIZE : 0;
-        size_t bytes_this_block = BLOCK_SIZE - block_offset;
-        if (bytes_written + bytes_this_block > size) {
-            bytes_this_block = size - bytes_written;
+//chmod, chown, utimens and (f)truncate. The size is changed first, so a
+//failed truncate leaves the other attributes alone.
+void wfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    TRACE("setattr called: %lu, to_set=0x%x\n", (unsigned long)ino, to_set);
+
+    int exclusive;
+    struct wfs_inode *inode = write_lock_file(ino, &exclusive);
+    int err = !inode ? -ENOENT : is_snapshot_ino(ino) ? -EROFS : cow_inode(inode);
+    if (err < 0) {
+        unlock_file(ino, exclusive);
+        fuse_reply_err(req, -err);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        err = S_ISREG(inode->mode) ? truncate_inode(inode, attr->st_size) : -EISDIR;
+        if (err < 0) {
+            unlock_file(ino, exclusive);
+            fuse_reply_err(req, -err);
+            return;
         }
+    }
+    time_t now = time(NULL);
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        inode->mode = (inode->mode & S_IFMT) | (attr->st_mode & 07777);
+    }
+    if (to_set & FUSE_SET_ATTR_UID) {
+        inode->uid = attr->st_uid;
+    }
+    if (to_set & FUSE_SET_ATTR_GID) {
+        inode->gid = attr->st_gid;
+    }
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+        inode->atim = now;
+    } else if (to_set & FUSE_SET_ATTR_ATIME) {
+        inode->atim = attr->st_atime;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        inode->mtim = now;
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+        inode->mtim = attr->st_mtime;
+    }
+    inode->ctim = now;
+    sync_inode(inode);
 
-        if (raid_mode == RAID0) {
-            // RAID0: Write to striped disk
-            size_t disk_idx = get_raid0_disk_index(block_num - 1);
-            off_t block_addr = get_raid0_block_offset(block_num - 1);
-            char *block = (char *)disk_map[disk_idx] + block_addr;
-            memcpy(block + block_offset, buf + buf_offset, bytes_this_block);
-
-            // Update indirect block if using one
-            if (b >= N_BLOCKS - 1) {
-                disk_idx = get_raid0_disk_index(inode->blocks[N_BLOCKS-1] - 1);
-                block_addr = get_raid0_block_offset(inode->blocks[N_BLOCKS-1] - 1);
-                memcpy((char *)disk_map[disk_idx] + block_addr, indirect_ptrs, BLOCK_SIZE);
-            }
-        } else {
-            // RAID1/RAID1V: Write to all disks
-            off_t block_addr = super_block.d_blocks_ptr + ((block_num - 1) * BLOCK_SIZE);
-            for (size_t disk = 0; disk < num_disks; disk++) {
-                char *block = (char *)disk_map[disk] + block_addr;
-                memcpy(block + block_offset, buf + bytes_written, bytes_this_block);
-                if (b >= N_BLOCKS - 1) {
-                    off_t indirect_addr = super_block.d_blocks_ptr + 
-                                        ((inode->blocks[N_BLOCKS-1] - 1) * BLOCK_SIZE);
-                    memcpy((char *)disk_map[disk] + indirect_addr, indirect_ptrs, BLOCK_SIZE);
-                }
-            }
-        }        
-        bytes_written += bytes_this_block;
-        buf_offset += bytes_this_block;
+    struct stat stbuf;
+    fill_stat(inode, &stbuf);
+    unlock_file(ino, exclusive);
+    fuse_reply_attr(req, &stbuf, options.attr_timeout);
+}
+
+//Preallocation (mode 0 or FALLOC_FL_KEEP_SIZE) and hole punching
+//(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)
+void wfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    TRACE("fallocate called: %lu, mode=0x%x, offset=%ld, length=%ld\n", (unsigned long)ino, mode, offset, length);
+    if (offset < 0 || length <= 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) ||
+        ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
     }
-    // Update inode metadata
-    inode->size = (end_pos > inode->size) ? end_pos : inode->size;
-    inode->mtim = inode->ctim = time(NULL);
 
-    // Update inode on all disks
-    for (size_t disk = 0; disk < num_disks; disk++) {
-        char *inode_block = (char *)disk_map[disk] + super_block.i_blocks_ptr + 
-                           (inode->num * BLOCK_SIZE);
-        memcpy(inode_block, inode, sizeof(struct wfs_inode));
+    int exclusive;
+    struct wfs_inode *inode = write_lock_file(ino, &exclusive);
+    int err = 0;
+    if (!inode || !S_ISREG(inode->mode)) {
+        err = inode ? -ENODEV : -ENOENT;
+    } else if (is_snapshot_ino(ino)) {
+        err = -EROFS;
+    } else if (is_compressed(inode)) {
+        err = -EOPNOTSUPP;  // blocks of compressed clusters are not at their file offsets
+    } else if ((err = cow_inode(inode)) < 0) {
+        //no room to keep the snapshots' version
+    } else if (mode & FALLOC_FL_PUNCH_HOLE) {
+        err = punch_hole(inode, offset, length);
+    } else {
+        err = preallocate_range(inode, offset, length, mode & FALLOC_FL_KEEP_SIZE);
     }
-    debug_print_data_bitmap();
-    return bytes_written;
+    unlock_file(ino, exclusive);
+    fuse_reply_err(req, -err);
 }
 
 
@@ -1064,16 +5329,147 @@ int wfs_write(const char *path, const char *buf, size_t size, off_t offset, stru
 //======================MAIN FUNCTION===========================//
 
 
-// add fuse ops here
-static struct fuse_operations ops = {
+//FS_IOC_GETFLAGS / FS_IOC_SETFLAGS, for chattr +c / lsattr. Only the
+//compression flag exists. Files made in a compressed directory are
+//compressed; a file can only change while it has no data blocks.
+void wfs_ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd, void *arg, struct fuse_file_info *fi,
+               unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+    TRACE("ioctl called: %lu, cmd=0x%x\n", (unsigned long)ino, cmd);
+    if (flags & FUSE_IOCTL_COMPAT) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    //scrub control works through any inode of the volume
+    if (cmd == WFS_IOC_SCRUB_GET || cmd == WFS_IOC_SCRUB_SET) {
+        struct wfs_scrub_ctl ctl;
+        if (cmd == WFS_IOC_SCRUB_SET) {
+            if (in_bufsz < sizeof(ctl)) {
+                fuse_reply_err(req, EINVAL);
+                return;
+            }
+            memcpy(&ctl, in_buf, sizeof(ctl));
+            int err = req_is_admin(req) ? set_scrub(&ctl) : -EPERM;
+            if (err < 0) {
+                fuse_reply_err(req, -err);
+            } else {
+                fuse_reply_ioctl(req, 0, NULL, 0);
+            }
+            return;
+        }
+        if (out_bufsz < sizeof(ctl)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        pthread_mutex_lock(&scrub_lock);
+        ctl = scrub;
+        pthread_mutex_unlock(&scrub_lock);
+        fuse_reply_ioctl(req, 0, &ctl, sizeof(ctl));
+        return;
+    }
+    if (cmd == WFS_IOC_ADD_DISK) {
+        struct wfs_add_disk add;
+        if (in_bufsz < sizeof(add)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&add, in_buf, sizeof(add));
+        add.path[sizeof(add.path) - 1] = '\0';
+        int err = req_is_admin(req) ? add_disk(add.path, add.tier) : -EPERM;
+        if (err < 0) {
+            fuse_reply_err(req, -err);
+        } else {
+            fuse_reply_ioctl(req, 0, NULL, 0);
+        }
+        return;
+    }
+    if (cmd == WFS_IOC_RESHAPE_GET) {
+        if (out_bufsz < sizeof(struct wfs_reshape_status)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        pthread_rwlock_rdlock(&fs_lock);
+        struct wfs_reshape_status status = {
+            .num_disks = num_disks,
+            .old_disks = reshape_disks,
+            .position = reshape_pos,
+            .total = reshape_disks ? num_disks * super_block.num_data_blocks : 0,
+        };
+        pthread_rwlock_unlock(&fs_lock);
+        fuse_reply_ioctl(req, 0, &status, sizeof(status));
+        return;
+    }
+    if (cmd != FS_IOC_GETFLAGS && cmd != FS_IOC_SETFLAGS) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+
+    int attr = 0;
+    int err = 0;
+    if (cmd == FS_IOC_SETFLAGS) {
+        if (in_bufsz < sizeof(attr)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&attr, in_buf, sizeof(attr));
+        pthread_rwlock_wrlock(&fs_lock);
+    } else {
+        if (out_bufsz < sizeof(attr)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        pthread_rwlock_rdlock(&fs_lock);
+    }
+    struct wfs_inode *inode = get_inode_by_ino(ino);
+    if (!inode) {
+        err = -ENOENT;
+    } else if (cmd == FS_IOC_GETFLAGS) {
+        attr = (inode->flags & WFS_INODE_COMPRESSED) ? FS_COMPR_FL : 0;
+    } else if (attr & ~FS_COMPR_FL) {
+        err = -EOPNOTSUPP;
+    } else if (!!(attr & FS_COMPR_FL) == !!(inode->flags & WFS_INODE_COMPRESSED)) {
+        //nothing to change
+    } else if (is_snapshot_ino(ino)) {
+        err = -EROFS;
+    } else if (!(super_block.features & WFS_FEATURE_COMPRESSION) || !(S_ISREG(inode->mode) || S_ISDIR(inode->mode))) {
+        err = -EOPNOTSUPP;
+    } else if (S_ISREG(inode->mode) && inode->size > 0 && !is_inline(inode)) {
+        err = -EBUSY;
+    } else if ((err = cow_inode(inode)) == 0) {
+        inode->flags ^= WFS_INODE_COMPRESSED;
+        inode->ctim = time(NULL);
+        sync_inode(inode);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    if (err < 0) {
+        fuse_reply_err(req, -err);
+    } else {
+        fuse_reply_ioctl(req, 0, cmd == FS_IOC_GETFLAGS ? &attr : NULL, cmd == FS_IOC_GETFLAGS ? sizeof(attr) : 0);
+    }
+}
+
+static struct fuse_lowlevel_ops ops = {
+    .init = wfs_init,
+    .destroy = wfs_destroy,
+    .lookup = wfs_lookup,
+    .forget = wfs_forget,
+    .forget_multi = wfs_forget_multi,
     .getattr = wfs_getattr,
+    .setattr = wfs_setattr,
+    .open = wfs_open,
+    .opendir = wfs_opendir,
     .mknod = wfs_mknod,
     .mkdir = wfs_mkdir,
     .unlink = wfs_unlink,
     .rmdir = wfs_rmdir,
+    .rename = wfs_rename,
     .read = wfs_read,
-    .write = wfs_write,
+    .write_buf = wfs_write_buf,
+    .fallocate = wfs_fallocate,
+    .lseek = wfs_lseek,
+    .copy_file_range = wfs_copy_file_range,
+    .ioctl = wfs_ioctl,
     .readdir = wfs_readdir,
+    .statfs = wfs_statfs,
 };
 
 // cleanup helper
@@ -1081,9 +5477,43 @@ void cleanup_resources() {
     if (disk_map) {
         free(disk_map);
     }
+    if (disk_fds) {
+        for (size_t i = 0; i < num_disks; i++) {
+            if (disk_fds[i] >= 0) {
+                close(disk_fds[i]);
+            }
+        }
+        free(disk_fds);
+    }
     if (disk_files) {
         free(disk_files);
     }
+    if (group_locks) {
+        free(group_locks);
+    }
+    if (lookup_counts) {
+        free(lookup_counts);
+    }
+    if (cache_stamps) {
+        free(cache_stamps);
+    }
+    if (dedupe_index) {
+        free(dedupe_index);
+    }
+    if (block_heat) {
+        free(block_heat);
+    }
+    if (disk_health) {
+        free(disk_health);
+    }
+    if (row_ready) {
+        free(row_ready);
+    }
+    if (conn_opts) {
+        free(conn_opts);
+    }
+    free(options.rebuild);
+    options.rebuild = NULL;
 }
 
 //Main function 
@@ -1096,9 +5526,10 @@ int main(int argc, char **argv){
 
     //Get disk names from argv and store them in disk_files
 
+    //the disks come first; the mount point is always the last argument
     size_t i;
-    for (i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-f") == 0) {
+    for (i = 1; i < argc - 1; i++) {
+        if (argv[i][0] == '-') {
             break; // Stop at FUSE options
         }
         disk_files = realloc(disk_files, (num_disks + 1) * sizeof(char *));
@@ -1114,6 +5545,30 @@ int main(int argc, char **argv){
         exit(EXIT_FAILURE);
     }
 
+    //FUSE gets the program name and everything after the disks
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    struct fuse_cmdline_opts opts;
+    fuse_opt_add_arg(&args, argv[0]);
+    for (; i < argc; i++) {
+        fuse_opt_add_arg(&args, argv[i]);
+    }
+    if (fuse_parse_cmdline(&args, &opts) != 0 || opts.mountpoint == NULL) {
+        cleanup_resources();
+        fprintf(stderr, "Usage: %s <disk1> <disk2> [FUSE options] <mount_point>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    trace_requests = opts.debug;
+    //our own -o options first, then the connection tuning ones libfuse knows
+    if (fuse_opt_parse(&args, &options, wfs_opt_spec, NULL) != 0) {
+        cleanup_resources();
+        exit(EXIT_FAILURE);
+    }
+    conn_opts = fuse_parse_conn_info_opts(&args);
+    if (conn_opts == NULL) {
+        cleanup_resources();
+        exit(EXIT_FAILURE);
+    }
+
     //Initialize disk_map with pointers to each disk
 
     disk_map = malloc(num_disks * sizeof(void *));
@@ -1124,58 +5579,360 @@ int main(int argc, char **argv){
     }
     memset(disk_map, 0, num_disks * sizeof(void *)); // Initialize to NULL
 
-    //Map each disk file to memory
-    off_t disk_size = 0;
-    int current_disk_id = -1;
+    //descriptors stay open for the life of the mount (hole punching, zeroing)
+    disk_fds = malloc(num_disks * sizeof(int));
+    if (!disk_fds) {
+        cleanup_resources();
+        perror("Error allocating memory for disk descriptors");
+        exit(EXIT_FAILURE);
+    }
     for (i = 0; i < num_disks; i++) {
-        int fd = open(disk_files[i], O_RDWR);
-        if (fd < 0) {
-            cleanup_resources();
-            perror("Error opening disk file");
-            exit(EXIT_FAILURE);
+        disk_fds[i] = -1;
+    }
+
+    //Validate each superblock, then map the disk file to memory
+    //Only the superblocks are read here; nothing is scanned on a clean volume
+    //A disk that cannot be opened is missing, one without a wfs superblock is
+    //blank; mirrors can do without them (see disk_health)
+    struct disk_probe {
+        int fd;
+        off_t size;
+        struct wfs_sb sb;
+        int member; //has a valid superblock of this volume
+    } probes[num_disks];
+    struct wfs_sb first_sb;
+    int have_first = 0;
+    int dirty = 0;
+    int degraded = 0;
+    unsigned long events = 0;
+    for (i = 0; i < num_disks; i++) {
+        struct disk_probe *probe = &probes[i];
+        probe->member = 0;
+        probe->fd = open(disk_files[i], O_RDWR);
+        if (probe->fd < 0) {
+            fprintf(stderr, "%s: %s\n", disk_files[i], strerror(errno));
+            degraded = 1;
+            continue;
         }
         struct stat stat;
-        fstat(fd, &stat);
-
-        disk_size = stat.st_size; //size of disk file
+        fstat(probe->fd, &stat);
+        probe->size = stat.st_size; //size of disk file
 
         //get superblock from disk file
-        struct wfs_sb sb_temp;
-        void *disk_ptr = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (disk_ptr == MAP_FAILED) {
-            perror("Error mapping disk file");
+        memset(&probe->sb, 0, sizeof(struct wfs_sb));
+        if (pread(probe->fd, &probe->sb, sizeof(struct wfs_sb), 0) != sizeof(struct wfs_sb) ||
+            probe->sb.magic != WFS_MAGIC) {
+            fprintf(stderr, "%s: no wfs superblock\n", disk_files[i]);
+            degraded = 1;
+            continue;
+        }
+        if (validate_superblock(&probe->sb, have_first ? &first_sb : NULL, probe->size, disk_files[i]) < 0) {
+            close(probe->fd);
+            probe->fd = -1;
             cleanup_resources();
             exit(EXIT_FAILURE);
         }
-        memcpy(&sb_temp, disk_ptr, sizeof(struct wfs_sb));
-        
+        for (size_t j = 0; j < i; j++) {
+            if (probes[j].member && probes[j].sb.disk_id == probe->sb.disk_id) {
+                fprintf(stderr, "%s: disk_id %d appears twice\n", disk_files[i], probe->sb.disk_id);
+                cleanup_resources();
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!have_first) {
+            first_sb = probe->sb;
+            have_first = 1;
+        }
+        probe->member = 1;
+        if (probe->sb.events > events) {
+            events = probe->sb.events;
+        }
+    }
 
-        //Store disk pointer in disk_map based on disk_id
+    //disks that missed writes while the others were mounted, or whose
+    //rebuild was cut short, are no better than blank ones (but keep their id)
+    int id_taken[num_disks];
+    memset(id_taken, 0, sizeof(id_taken));
+    size_t healthy = 0;
+    for (i = 0; i < num_disks; i++) {
+        struct disk_probe *probe = &probes[i];
+        if (probe->member) {
+            id_taken[probe->sb.disk_id] = 1;
+        }
+        if (probe->member && (probe->sb.rebuilding || probe->sb.events < events)) {
+            fprintf(stderr, "%s: out of date\n", disk_files[i]);
+            probe->member = 0;
+            degraded = 1;
+        } else if (probe->member) {
+            healthy++;
+            if (probe->sb.state != WFS_STATE_CLEAN) {
+                dirty = 1;
+            }
+        }
+    }
+    if (healthy == 0) {
+        fprintf(stderr, "Error: no up-to-date disk\n");
+        cleanup_resources();
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num_disks && !probes[i].member; i++);
+    first_sb = probes[i].sb;
+    int mirror = first_sb.raid_mode == RAID1 || first_sb.raid_mode == RAID1V;
+    size_t spare_parity = first_sb.raid_mode == RAID5 ? 1 : first_sb.raid_mode == RAID6 ? 2 : 0;
+    //a mirror holds every data block, a RAID5/RAID6 disk a block of each row
+    size_t disk_blocks = spare_parity ? first_sb.num_data_blocks / (num_disks - spare_parity)
+                                      : first_sb.num_data_blocks;
+    off_t required = first_sb.d_blocks_ptr + (off_t)(disk_blocks * BLOCK_SIZE);
+    if (degraded && !mirror && num_disks - healthy > spare_parity) {
+        fprintf(stderr, "Error: only RAID1/RAID1V volumes, RAID5 ones with one disk and RAID6 ones "
+                        "with two can be mounted with disks missing\n");
+        cleanup_resources();
+        exit(EXIT_FAILURE);
+    }
+    disk_health = calloc(num_disks, sizeof(int));
+    if (!disk_health) {
+        cleanup_resources();
+        perror("Error allocating disk state");
+        exit(EXIT_FAILURE);
+    }
 
-        current_disk_id = sb_temp.disk_id;
-        if (current_disk_id >= num_disks || current_disk_id < 0) {
-            fprintf(stderr, "Invalid disk_id %d\n", current_disk_id);
-            cleanup_resources();
-            exit(EXIT_FAILURE);
+    //order[] is the order of the disks in disk_map. Mirrors are
+    //interchangeable: healthy disks come first in disk_id order, fast ones
+    //first as reads go to the first disk, then the others in the order given,
+    //and only the superblocks keep the disk_id. RAID5/RAID6 stripe by
+    //disk_id, so disk i goes to disk_map[i]: a stale disk back to its own
+    //place, blank and missing ones to the places of the disks that are gone.
+    size_t order[num_disks];
+    int placed[num_disks];
+    size_t next = 0;
+    memset(placed, 0, sizeof(placed));
+    for (int tier = WFS_TIER_FAST; tier <= (mirror ? WFS_TIER_SLOW : WFS_TIER_FAST); tier++) {
+        for (int id = 0; id < first_sb.num_disks; id++) {
+            for (i = 0; i < num_disks; i++) {
+                if (probes[i].member && probes[i].sb.disk_id == id && (!mirror || probes[i].sb.tier == tier)) {
+                    order[spare_parity ? (size_t)id : next++] = i;
+                    placed[i] = 1;
+                }
+            }
+        }
+    }
+    if (spare_parity) {
+        int slot_taken[num_disks];
+        memset(slot_taken, 0, sizeof(slot_taken));
+        for (i = 0; i < num_disks; i++) {
+            if (placed[i]) {
+                slot_taken[probes[i].sb.disk_id] = 1;
+            }
         }
+        for (i = 0; i < num_disks; i++) {
+            if (!placed[i] && probes[i].fd >= 0 && probes[i].sb.magic == WFS_MAGIC &&
+                !slot_taken[probes[i].sb.disk_id]) {
+                order[probes[i].sb.disk_id] = i;
+                slot_taken[probes[i].sb.disk_id] = placed[i] = 1;
+            }
+        }
+        for (i = 0; i < num_disks; i++) {
+            if (!placed[i]) {
+                for (next = 0; slot_taken[next]; next++);
+                order[next] = i;
+                slot_taken[next] = placed[i] = 1;
+            }
+        }
+    } else {
+        for (i = 0; i < num_disks; i++) {
+            if (!placed[i]) {
+                order[next++] = i;
+            }
+        }
+    }
 
-        disk_map[current_disk_id] = disk_ptr;
-        if(disk_map[current_disk_id] == MAP_FAILED) {
-            perror("Error mapping disk file");
+    const char *primary = NULL;
+    size_t source = 0;  // a healthy disk, to copy metadata from
+    for (next = num_disks; next-- > 0;) {
+        if (probes[order[next]].member) {
+            primary = disk_files[order[next]];
+            source = next;
+        }
+    }
+    for (next = 0; next < num_disks; next++) {
+        i = order[next];
+        struct disk_probe *probe = &probes[i];
+        if (probe->member) {
+            disk_health[next] = DISK_HEALTHY;
+            disk_fds[next] = probe->fd;
+            disk_map[next] = map_disk(probe->fd, probe->size, first_sb.d_blocks_ptr);
+        } else if (probe->fd < 0) {
+            //writes to a missing disk land in memory that is thrown away
+            printf("%s: missing, mounting degraded\n", disk_files[i]);
+            disk_health[next] = DISK_MISSING;
+            disk_map[next] = mmap(NULL, required, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        } else {
+            //a disk without a superblock is only written over when asked to
+            struct stat target, disk;
+            if (probe->sb.magic != WFS_MAGIC &&
+                (!options.rebuild || stat(options.rebuild, &target) != 0 || fstat(probe->fd, &disk) != 0 ||
+                 target.st_dev != disk.st_dev || target.st_ino != disk.st_ino)) {
+                fprintf(stderr, "%s: not a disk of this volume; mount with -o rebuild=%s to rebuild onto it\n",
+                        disk_files[i], disk_files[i]);
+                cleanup_resources();
+                exit(EXIT_FAILURE);
+            }
+            if (probe->size < required) {
+                fprintf(stderr, "%s: too small to rebuild onto, needs %ld bytes\n", disk_files[i], (long)required);
+                cleanup_resources();
+                exit(EXIT_FAILURE);
+            }
+            printf("%s: rebuilding from %s\n", disk_files[i], primary);
+            disk_health[next] = DISK_REBUILDING;
+            disk_fds[next] = probe->fd;
+            disk_map[next] = map_disk(probe->fd, probe->size, first_sb.d_blocks_ptr);
+        }
+        if (disk_map[next] == MAP_FAILED) {
+            disk_map[next] = NULL;
             cleanup_resources();
+            perror("Error mapping disk file");
             exit(EXIT_FAILURE);
         }
-        close(fd);
+    }
+
+    //a mirror being rebuilt gets everything before the inode table now (it is
+    //small), inode slots and data blocks in the background once mounted.
+    //RAID5/RAID6 places read from disk_map[0] like any other, so a disk
+    //standing in for a lost one gets all of the metadata, and its data blocks
+    //are reconstructed as they are used, see recover_row().
+    off_t metadata = spare_parity ? first_sb.d_blocks_ptr : first_sb.i_blocks_ptr;
+    for (next = 0; next < num_disks; next++) {
+        struct disk_probe *probe = &probes[order[next]];
+        if (disk_health[next] == DISK_HEALTHY || (disk_health[next] == DISK_MISSING && !spare_parity)) {
+            continue;
+        }
+        //a stale disk keeps its id, a blank one takes that of a disk that is gone
+        int disk_id = spare_parity ? (int)next : probe->sb.disk_id;
+        if (!spare_parity && probe->sb.magic != WFS_MAGIC) {
+            for (disk_id = 0; id_taken[disk_id]; disk_id++);
+            id_taken[disk_id] = 1;
+        }
+        memcpy(disk_map[next], disk_map[source], metadata);
+        struct wfs_sb *sb = (struct wfs_sb *)disk_map[next];
+        sb->disk_id = disk_id;
+        if (disk_health[next] == DISK_REBUILDING) {
+            sb->tier = probe->sb.magic == WFS_MAGIC ? probe->sb.tier : WFS_TIER_FAST;
+            sb->rebuilding = 1;
+            msync(disk_map[next], metadata, MS_SYNC);
+        }
+    }
+    //the disks here now have every write; any disk not here falls behind
+    for (i = 0; i < num_disks; i++) {
+        if (disk_health[i] != DISK_MISSING) {
+            ((struct wfs_sb *)disk_map[i])->events = events + 1;
+        }
     }
 
     //store dirst superblock for reference
-    super_block = *(struct wfs_sb *)disk_map[0];
+    super_block = *(struct wfs_sb *)disk_map[source];
     //set raid mode
     raid_mode = super_block.raid_mode;   
 
+    //rows are reconstructed on the disks that are not here yet
+    if (spare_parity) {
+        gf_init();
+        for (i = 0; i < num_disks; i++) {
+            if (disk_health[i] != DISK_HEALTHY) {
+                lost_disks[num_lost++] = i;
+            }
+        }
+        row_ready = calloc(super_block.num_data_blocks / 8 + 1, 1);
+        if (!row_ready) {
+            cleanup_resources();
+            perror("Error allocating row state");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //a reshape goes on where it stopped; the superblocks are updated one after
+    //the other, and a disk that got the newest cursor has the blocks it covers
+    reshape_disks = super_block.reshape_disks;
+    for (i = 0; i < num_disks && reshape_disks; i++) {
+        size_t pos = ((struct wfs_sb *)disk_map[i])->reshape_pos;
+        if (pos > reshape_pos) {
+            reshape_pos = pos;
+        }
+    }
+    super_block.reshape_pos = reshape_pos;
+
+    group_locks = malloc(super_block.num_groups * sizeof(pthread_mutex_t));
+    if (!group_locks) {
+        cleanup_resources();
+        perror("Error allocating group locks");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < super_block.num_groups; i++) {
+        pthread_mutex_init(&group_locks[i], NULL);
+    }
+    for (i = 0; i < NUM_INODE_LOCKS; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    for (i = 0; i < NUM_ROW_LOCKS; i++) {
+        pthread_mutex_init(&row_locks[i], NULL);
+    }
+
+    lookup_counts = calloc(super_block.num_inodes, sizeof(uint64_t));
+    cache_stamps = calloc(super_block.num_inodes, sizeof(struct cache_stamp));
+    if (raid_mode == RAID0) {
+        block_heat = calloc(num_disks, super_block.num_data_blocks);
+        tiered = is_tiered();
+    }
+    if (!lookup_counts || !cache_stamps || (raid_mode == RAID0 && !block_heat)) {
+        cleanup_resources();
+        perror("Error allocating inode state");
+        exit(EXIT_FAILURE);
+    }
+
+    //the counters can only be trusted if the last unmount was clean
+    if (dirty) {
+        printf("WFS volume was not unmounted cleanly, recounting free space\n");
+        reclaim_orphans();
+        recount_free_counts();
+    }
+    if ((super_block.features & WFS_FEATURE_DEDUPE) && build_dedupe_index(dirty) < 0) {
+        cleanup_resources();
+        perror("Error allocating dedupe index");
+        exit(EXIT_FAILURE);
+    }
+    set_volume_state(WFS_STATE_DIRTY);
+
     //print inode bitmap and inodes
     //debug_print_inode_bitmap();
     //debug_print_data_bitmap();
     printf("WFS starting...\n");
-    return fuse_main(argc-(num_disks + 1), &argv[num_disks+ 1], &ops, NULL);
+    session = fuse_session_new(&args, &ops, sizeof(ops), NULL);
+    if (session == NULL) {
+        cleanup_resources();
+        exit(EXIT_FAILURE);
+    }
+    if (fuse_set_signal_handlers(session) != 0 || fuse_session_mount(session, opts.mountpoint) != 0) {
+        fuse_session_destroy(session);
+        cleanup_resources();
+        exit(EXIT_FAILURE);
+    }
+    fuse_daemonize(opts.foreground);
+
+    int ret;
+    if (opts.singlethread) {
+        ret = fuse_session_loop(session);
+    } else {
+        struct fuse_loop_config config;
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        ret = fuse_session_loop_mt(session, &config);
+    }
+
+    fuse_session_unmount(session);
+    fuse_remove_signal_handlers(session);
+    fuse_session_destroy(session);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    cleanup_resources();
+    return ret ? 1 : 0;
 }
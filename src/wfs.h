@@ -3,8 +3,10 @@
 
 
 #include <time.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 
 
 #define BLOCK_SIZE (512) //bits  
@@ -14,18 +16,86 @@
 #define IND_BLOCK  (D_BLOCK+1)
 #define N_BLOCKS   (IND_BLOCK+1)
 
+#define WFS_MAGIC   (0x57465331) // "WFS1"
+#define WFS_VERSION (1)
+
+// Superblock state: a dirty volume was not unmounted cleanly and its
+// summary counters have to be rebuilt from the bitmaps
+#define WFS_STATE_CLEAN (0)
+#define WFS_STATE_DIRTY (1)
+
+// Inode slots are zeroed in the background after mount, this many at a time
+#define INODE_INIT_CHUNK (256)
+
+// Default allocation group size in data blocks (per disk), must be a multiple of 8
+#define BLOCKS_PER_GROUP (4096)
+
+// Optional on-disk features, chosen by mkfs and recorded in the superblock.
+// wfs refuses to mount a volume with a feature it does not know.
+#define WFS_FEATURE_INLINE_DATA (1 << 0) // small files and directories live in their inode slot
+#define WFS_FEATURE_REFLINK     (1 << 1) // files can share data blocks, counted in the refcount table
+#define WFS_FEATURE_SNAPSHOTS   (1 << 2) // read-only snapshots under /.snapshots, needs WFS_FEATURE_REFLINK
+#define WFS_FEATURE_COMPRESSION (1 << 3) // files can store their data LZ4 compressed
+#define WFS_FEATURE_DEDUPE      (1 << 4) // identical file blocks are shared on write, needs WFS_FEATURE_REFLINK
+#define WFS_FEATURES_SUPPORTED  (WFS_FEATURE_INLINE_DATA | WFS_FEATURE_REFLINK | WFS_FEATURE_SNAPSHOTS | \
+                                 WFS_FEATURE_COMPRESSION | WFS_FEATURE_DEDUPE)
+
+// Storage tier of a disk, chosen by mkfs. RAID0 puts new blocks and
+// metadata on fast disks and moves cold blocks of large files to slow ones;
+// mirrors read from fast disks.
+#define WFS_TIER_FAST (0)
+#define WFS_TIER_SLOW (1)
+
+// Most files that can share one data block
+#define MAX_BLOCK_REFS ((size_t)UINT16_MAX + 1)
+
+// Snapshot table entries, one block's worth
+#define MAX_SNAPSHOTS (16)
+
+// Inode flags
+#define WFS_INODE_INLINE   (1 << 0) // data is stored inline, after the inode in its slot
+#define WFS_INODE_SNAPSHOT (1 << 1) // an old version of another inode, kept for snapshots
+#define WFS_INODE_DELETED  (1 << 2) // deleted, but snapshots still see old versions of it
+#define WFS_INODE_COMPRESSED (1 << 3) // file data is compressed; for a directory, new files in it are
+
+// Compressed files are stored in clusters of this many blocks
+#define WFS_CLUSTER_BLOCKS (8)
+
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image. 
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
-0    ^                   ^
-i_bitmap_ptr        i_blocks_ptr
+                                      d_bitmap_ptr       d_blocks_ptr
+                                           v                  v
++----+-----+------+-------+--------+---------+---------+--------+-------------+
+| SB | GDT | REFS | SNAPS | HASHES | IBITMAP | DBITMAP | INODES | DATA BLOCKS |
++----+-----+------+-------+--------+---------+---------+--------+-------------+
+0    ^     ^      ^       ^        ^                   ^
+gd_ptr  refcount_ptr  snapshots_ptr  dedupe_ptr  i_bitmap_ptr  i_blocks_ptr
+
+  The data blocks of each disk are split into allocation groups of
+  blocks_per_group blocks, and the inodes into the same number of groups of
+  inodes_per_group. Group g owns bits [g * blocks_per_group, ...) of the data
+  bitmap and [g * inodes_per_group, ...) of the inode bitmap. The GDT holds
+  one wfs_group_desc per group with that group's free counts on this disk.
+
+  REFS only exists with WFS_FEATURE_REFLINK. It holds a uint16_t for every
+  data block of the disk: how many files share the block besides the first.
+  Blocks that are not shared have 0, so only sharing ever touches it.
+
+  SNAPS only exists with WFS_FEATURE_SNAPSHOTS: MAX_SNAPSHOTS wfs_snapshot
+  records followed by a wfs_inode_version for every inode. Taking a snapshot
+  only adds a record with the current generation. An inode is copied to a
+  free slot (WFS_INODE_SNAPSHOT, sharing its blocks) the first time it
+  changes after a snapshot that can see it; the copies of an inode form a
+  chain through the version table, newest first.
+
+  HASHES only exists with WFS_FEATURE_DEDUPE: a uint64_t fingerprint for
+  every data block of the disk, indexed like REFS. A file block written
+  whole gets its fingerprint, and keeps it until it is written in place or
+  freed; 0 means none. wfs builds its in-memory index from the table at
+  mount, so a later write of the same contents shares the block.
 
 */
 
@@ -38,8 +108,36 @@ struct wfs_sb {
     off_t i_blocks_ptr;
     off_t d_blocks_ptr;
     // Extend after this line
-    int raid_mode; //raid mode 0, 1, 1v
+    int raid_mode; //raid mode 0, 1, 1v, 5, 6, 10
     int disk_id; //disk id
+    size_t i_init_hwm; //inode slots below this have been initialized, the rest may hold stale data
+    unsigned int magic; //WFS_MAGIC
+    int version; //on-disk format version, WFS_VERSION
+    int num_disks; //number of disks in the volume
+    int state; //WFS_STATE_CLEAN or WFS_STATE_DIRTY
+    size_t free_inodes; //unallocated inodes
+    size_t free_blocks; //unallocated data blocks in the whole volume
+    size_t disk_free_blocks; //unallocated blocks in this disk's own data bitmap
+    size_t blocks_per_group; //data blocks per allocation group (per disk)
+    size_t inodes_per_group; //inodes per allocation group
+    size_t num_groups; //number of allocation groups
+    off_t gd_ptr; //group descriptor table
+    unsigned int features; //WFS_FEATURE_* flags
+    off_t refcount_ptr; //block reference counts, with WFS_FEATURE_REFLINK
+    off_t snapshots_ptr; //snapshot table and inode versions, with WFS_FEATURE_SNAPSHOTS
+    unsigned int snap_gen; //generation of the live filesystem, the next snapshot takes it
+    off_t dedupe_ptr; //block fingerprints, with WFS_FEATURE_DEDUPE
+    unsigned long events; //bumped on every disk present at each mount; a disk that falls behind missed writes
+    int rebuilding; //1 while this disk is being rebuilt from a mirror, its contents cannot be read yet
+    int reshape_disks; //RAID0 disks before the disk being added, 0 if no reshape is running
+    size_t reshape_pos; //RAID0 block numbers below this are striped over num_disks, the rest over reshape_disks
+    int tier; //WFS_TIER_FAST or WFS_TIER_SLOW, how fast this disk is
+};
+
+// Allocation group descriptor
+struct wfs_group_desc {
+    size_t free_blocks; //unallocated blocks in this group of this disk's data bitmap
+    size_t free_inodes; //unallocated inodes in this group
 };
 
 // Inode
@@ -56,6 +154,30 @@ struct wfs_inode {
     time_t ctim;      /* Time of last status change */
 
     off_t blocks[N_BLOCKS]; 
+    unsigned int flags; /* WFS_INODE_* flags */
+};
+
+// Every inode has a whole BLOCK_SIZE slot to itself. With the inline data
+// feature, a file or directory that fits in the rest of the slot is stored
+// there, and its block pointers stay unused.
+#define INLINE_DATA_SIZE (BLOCK_SIZE - sizeof(struct wfs_inode))
+
+// A compressed file that is not inline keeps its cluster map in the same
+// place: one uint16_t per cluster, the LZ4 length of the cluster stored in
+// its first blocks, or 0 if the cluster is stored as plain blocks (or holes).
+
+// Snapshot record. A free record has gen 0.
+struct wfs_snapshot {
+    char name[MAX_NAME];
+    unsigned int gen; //sees inode versions of this generation and older
+};
+
+// Version of an inode slot: the generation its contents date from, and the
+// slot holding its previous version (0 if none). Slot 0 is the root, which
+// is never a copy.
+struct wfs_inode_version {
+    unsigned int gen;
+    int prev;
 };
 
 // Directory entry
@@ -64,4 +186,47 @@ struct wfs_dentry {
     int num;
 };
 
+// Mirror scrubbing of RAID1/RAID1V volumes, controlled and watched at runtime
+// with ioctl() on any file or directory of the mounted volume. SET only
+// takes state and rate, and needs root or CAP_SYS_ADMIN; GET fills in the
+// rest. A copy that differs from the majority is rewritten; with two copies
+// there is no majority, so mismatches are only counted in unrepairable.
+#define WFS_SCRUB_IDLE    (0) // no pass running; setting it cancels a pass
+#define WFS_SCRUB_RUNNING (1) // setting it starts a pass or resumes a paused one
+#define WFS_SCRUB_PAUSED  (2)
+
+struct wfs_scrub_ctl {
+    uint32_t state;        // WFS_SCRUB_*
+    uint32_t rate;         // KiB/s compared at most, 0 for no limit
+    uint64_t position;     // next data block of the pass
+    uint64_t total;        // data blocks in the volume
+    uint64_t checked;      // allocated blocks compared in this (or the last) pass
+    uint64_t repaired;     // copies rewritten from the majority, since mount
+    uint64_t unrepairable; // mismatched blocks whose copies have no majority (any mismatch on two disks), since mount
+};
+
+#define WFS_IOC_SCRUB_GET _IOR('W', 1, struct wfs_scrub_ctl)
+#define WFS_IOC_SCRUB_SET _IOW('W', 2, struct wfs_scrub_ctl)
+
+// Growing a RAID0 volume while it is mounted. WFS_IOC_ADD_DISK (root or
+// CAP_SYS_ADMIN only) adds the disk image at path, which must be all zeros
+// and at least as large as the others, and restripes the volume onto it in
+// the background; the new capacity becomes usable as the reshape reaches
+// it. Give the new disk to wfs with the others from then on.
+// WFS_IOC_RESHAPE_GET reports the progress.
+struct wfs_add_disk {
+    char path[1024];
+    int tier; // WFS_TIER_* of the new disk
+};
+
+struct wfs_reshape_status {
+    uint32_t num_disks; // disks in the volume
+    uint32_t old_disks; // disks before the one being added, 0 if no reshape is running
+    uint64_t position;  // block numbers below this are restriped
+    uint64_t total;     // block numbers to restripe
+};
+
+#define WFS_IOC_ADD_DISK     _IOW('W', 3, struct wfs_add_disk)
+#define WFS_IOC_RESHAPE_GET  _IOR('W', 4, struct wfs_reshape_status)
+
 #endif // WFS_H
\ No newline at end of file
@@ -3,17 +3,30 @@
 import argparse
 import wfsverify
 
-def corrupt_disk(disks):
+def corrupt_disk(disks, region):
     filesystems = [wfsverify.WfsState(disk) for disk in disks]
 
     for fs in filesystems:
-        fs.clear_datablock_region()
+        if region == "data":
+            fs.clear_datablock_region()
+        elif region == "ibitmap":
+            # marks inodes 8-15 in use on this disk only
+            fs.flip_byte(fs.get_ibit() + 1)
+        elif region == "block":
+            fs.flip_byte(fs.get_dblock_region())
+        elif region == "dbitmap":
+            # frees the first allocated data block in this disk's bitmap
+            block = fs.list_allocated_datablocks()[0]
+            fs.flip_byte(fs.get_dbit() + block // 8, 1 << (block % 8))
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
     parser.add_argument("--disks", nargs="+", help="list of disks")
+    parser.add_argument("--region", default="data", choices=["data", "ibitmap", "block", "dbitmap"],
+                        help="clear the data region, flip a byte of the inode bitmap or the first data block, "
+                        "or free the first allocated data block")
 
     args = parser.parse_args()
 
-    corrupt_disk(args.disks)
+    corrupt_disk(args.disks, args.region)
 
@@ -33,11 +33,14 @@
 	     (gen-disks numdisks)
 	     "; "))
 
-(defun make-mkfs-args (raid numdisks inodes blocks)
-  "Generate mkfs args string."
-  (let* ((disk-params
-	  (mapconcat (lambda (disk) (format "-d %s" disk))
-		     (gen-disks numdisks) " "))
+(defun make-mkfs-args (raid numdisks inodes blocks &optional slow)
+  "Generate mkfs args string. The last SLOW disks are given as slow disks."
+  (let* ((fast (- numdisks (or slow 0)))
+	 (disk-params
+	  (mapconcat (lambda (n)
+		       (format "%s %s" (if (> n fast) "-s" "-d")
+			       (disk-path (format "test-disk%d" n))))
+		     (number-sequence 1 numdisks) " "))
 	 (base-cmd
 	  (format "%s -i %d -b %d" disk-params inodes blocks)))
     (if (< numdisks 2) ; skip raid if one disk
@@ -96,6 +99,20 @@ except Exception as e:
     "%s(os.stat(\"%s\").st_mode)"
     (if isdir "S_ISDIR" "S_ISREG") path)))
 
+(defun py-checks (checks)
+  "Python that runs CHECKS in the mounted filesystem, then prints Correct.
+
+Each check is a python statement, possibly spanning lines, wrapped in
+try.. except; a failed assert prints its message. Single quotes would
+end the shell string, so the python must use double quotes."
+  (string-join
+   (append
+    (list "python3 -c '" "import os, errno, ctypes\n" (py-chdir "mnt"))
+    (mapcar (lambda (check)
+	      (py-try-except (replace-regexp-in-string "\n" "\n    " check)))
+	    checks)
+    (list "\nprint(\"Correct\")' \\\n"))))
+
 (defun create-fs-state (mountpoint fs-state prefix)
   "Generate python commands to create filesystem state.
 
@@ -211,15 +228,16 @@ FS-STATE the state of the filesystem."
 	num
       (+ num (- k remain)))))
 
-(defun setup-cmd (numdisks raid)
+(defun setup-cmd (numdisks raid &optional flags)
   "This is always the pre command for filesystem tests.
 
-It creates disks, runs mkfs on them, and mounts with FUSE."
+It creates disks, runs mkfs on them with any extra FLAGS, and mounts
+with FUSE."
   (string-join
    (list
     "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
     (create-disk-cmd numdisks "1M")
-    (concat "../solution/mkfs " (default-fs-mkfs-args raid numdisks))
+    (concat "../solution/mkfs " (default-fs-mkfs-args raid numdisks) flags)
     (mount-cmd numdisks "mnt"))
    " && ")) ; will stop and return pre-rc if anything goes wrong
 
@@ -273,16 +291,125 @@ RUN-RC return code of run command (metadata verifier)"
 	   (string-join (gen-disks numdisks) " "))
    output pre-rc run-rc ""))
 
-(defun verify-metadata-cmd (fs-state extra-blocks numdisks)
+(defun data-disks (raid numdisks)
+  "How many disks' worth of data blocks the superblock counts.
+
+RAID5, RAID6 and RAID10 count the data blocks of the whole volume."
+  (cond ((string= raid "5") (- numdisks 1))
+	((string= raid "6") (- numdisks 2))
+	((string= raid "10") (/ numdisks 2))
+	(t 1)))
+
+(defun mkfs-layout-test (desc raid numdisks slow flags output pre-rc run-rc)
+  "Test template for mkfs layouts and features, on the default fs size.
+
+DESC description of the test
+RAID raid mode as string (0, 1, 1v, 5, 6 or 10)
+NUMDISKS number of disks in the filesystem
+SLOW how many of them (the last ones) are slow disks
+FLAGS extra mkfs options
+OUTPUT expected output (usually \"Success\")
+PRE-RC return code of pre command (truncate disks and mkfs)
+RUN-RC return code of run command (metadata verifier)"
+  (define-test
+   (concat "mkfs: " desc)
+   (string-join
+    (list
+     "mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (concat "../solution/mkfs " (make-mkfs-args raid numdisks 32 224 slow) flags))
+    "; ")
+   (format "rm -f %s" (disk-path "test-disk*"))
+   (format "./wfs-check-metadata.py --mode mkfs --inodes %d --blocks %d --disks %s"
+	   32
+	   (* 224 (data-disks raid numdisks))
+	   (string-join (gen-disks numdisks) " "))
+   output pre-rc run-rc ""))
+
+(defun fsck-cmd (numdisks flag)
+  "Run fsck.wfs with FLAG on NUMDISKS disks and print its exit status.
+
+The pass headers and the time taken are left out."
+  (format "../solution/fsck.wfs %s %s | grep -v '^Pass' | sed 's/ in [0-9]* ms$//'; echo \"rc ${PIPESTATUS[0]}\""
+	  flag (string-join (gen-disks numdisks) " ")))
+
+(defun fsck-test (desc raid numdisks flags corrupt-disk region output)
+  "Test template for fsck.wfs: check, repair, and check again.
+
+DESC description of the test
+RAID raid mode as string
+NUMDISKS number of disks in the filesystem
+FLAGS extra mkfs options
+CORRUPT-DISK the disk corrupt-disk.py damages first, or nil
+REGION what it damages (its --region)
+OUTPUT expected output of the three runs"
+  (define-test
+   (concat "fsck: " desc)
+   (string-join
+    (list
+     "mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (concat "../solution/mkfs " (make-mkfs-args raid numdisks 32 224) flags))
+    "; ")
+   (format "rm -f %s" (disk-path "test-disk*"))
+   (string-join
+    (append
+     (when corrupt-disk
+       (list (format "./corrupt-disk.py --region %s --disks %s"
+		     region (disk-path (format "test-disk%d" corrupt-disk)))))
+     (list (fsck-cmd numdisks "-n") (fsck-cmd numdisks "-y") (fsck-cmd numdisks "-n")))
+    "; ")
+   output "0" "0" ""))
+
+(defun fsck-workload-test (desc raid numdisks flags fs-state op region output)
+  "Test template for fsck.wfs on a volume populated through the filesystem.
+
+The mounted filesystem is initialized to FS-STATE, OP runs in it and it
+is unmounted. Without REGION, fsck.wfs -n must find the volume clean;
+with one, corrupt-disk.py damages it on every disk, and fsck.wfs must
+report the damage with -n, repair it with -y and then find it clean.
+
+DESC description of the test
+RAID raid mode as string
+NUMDISKS number of disks in the filesystem
+FLAGS extra mkfs options
+FS-STATE a list describing the filesystem state
+OP a workload to run after initializing it, or nil
+REGION what corrupt-disk.py damages (its --region), or nil
+OUTPUT expected output"
+  (define-test
+   (concat "fsck: " desc)
+   (setup-cmd numdisks raid flags)
+   (teardown-cmd)
+   (string-join
+    (append
+     (list
+      (string-join
+       (append (list (fs-state-cmds fs-state "d"))
+	       (when op (list op))
+	       (list (umount-cmd "mnt")))
+       " && ")
+      "sleep 1") ; wfs only marks the volume clean once fusermount has returned
+     (when region
+       (list (format "./corrupt-disk.py --region %s --disks %s"
+		     region (string-join (gen-disks numdisks) " "))))
+     (list (fsck-cmd numdisks "-n"))
+     (when region
+       (list (fsck-cmd numdisks "-y") (fsck-cmd numdisks "-n"))))
+    "; ")
+   output "0" "0" ""))
+
+(defun verify-metadata-cmd (fs-state extra-blocks numdisks &optional extra-args)
   (let ((metadata (count-metadata fs-state numdisks)))
       (format
-       "./wfs-check-metadata.py --mode raid%s --blocks %d --altblocks %d --dirs %d --files %d --disks %s"
+       "./wfs-check-metadata.py --mode raid%s --blocks %d --altblocks %d --dirs %d --files %d --disks %s%s"
        raid
        (+ (alist-get 'blocks metadata) extra-blocks)
        (+ (alist-get 'blocks metadata) (alist-get 'indirect-adjust metadata))
        (alist-get 'dir-inodes metadata)
        (alist-get 'file-inodes metadata)
-       (string-join (gen-disks numdisks) " "))))
+       (string-join (gen-disks numdisks) " ")
+       (or extra-args ""))))
 
 (defun filesystem-init (desc fs-state raid numdisks output rc)
   "Test template for filesystem initialization.
@@ -343,6 +470,42 @@ OUTPUT the expected output. Generally \"Correct\" or an error."
    output
    "0" rc "")) ; pre-rc should always be 0
 
+(defun feature-workload
+    (desc flags op post-state post-extra-blocks check-args fsck raid numdisks output)
+  "Test template for a workload on an empty filesystem made with mkfs FLAGS.
+
+After OP the filesystem is unmounted and its metadata must match
+POST-STATE. Inline data, reflinks, compression and deduplication store
+less than POST-STATE needs, which a negative POST-EXTRA-BLOCKS accounts
+for.
+
+DESC test description.
+FLAGS extra mkfs options
+OP the workload, usually built with py-checks
+POST-STATE the expected state of the filesystem after OP
+POST-EXTRA-BLOCKS blocks to add to those POST-STATE needs
+CHECK-ARGS extra wfs-check-metadata.py arguments, or nil
+FSCK if non-nil, fsck.wfs -n must then find the volume clean
+RAID raid mode as string
+NUMDISKS the number of disks to create
+OUTPUT the expected output."
+  (define-test
+   desc
+   (setup-cmd numdisks raid flags)
+   (teardown-cmd)
+   (string-join
+    (append
+     (list
+      op
+      (umount-cmd "mnt")
+      (verify-metadata-cmd post-state post-extra-blocks numdisks check-args))
+     (when fsck
+       ;; wfs only marks the volume clean once fusermount has returned
+       (list "sleep 1" (fsck-cmd numdisks "-n"))))
+    " && ")
+   output
+   "0" "0" ""))
+
 (defun n-file-directory (n sz)
   (if (= n 0)
       nil
@@ -391,6 +554,19 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
   (list desc fs-state workload post-state post-blocks raid numdisks
 	errmsg "1"))
 
+(defun feature-workload-success
+    (desc flags workload post-state post-blocks check-args msg raid numdisks)
+  "Convenience function to generate feature workload tests.
+
+DESC description of the test
+FLAGS extra mkfs options
+WORKLOAD python checks run in the empty filesystem
+POST-STATE the expected state of the filesystem after WORKLOAD
+POST-BLOCKS blocks to add to those POST-STATE needs
+CHECK-ARGS extra wfs-check-metadata.py arguments, or nil"
+  (list desc flags (py-checks workload) post-state post-blocks check-args nil
+	raid numdisks msg))
+
 (defun gen-raid-test-with-fn (fn testlist raidconfigs)
   (apply #'append
 	 (mapcar (lambda (config)
@@ -503,4 +679,256 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))
+
+   ((testcase . ,#'mkfs-layout-test)
+    ; desc raid numdisks slow flags output pre-rc run-rc
+    (configs . (("raid5, three disks" "5" 3 0 "" "Success" "0" "0")
+		("raid6, four disks" "6" 4 0 "" "Success" "0" "0")
+		("raid10, four disks" "10" 4 0 "" "Success" "0" "0")
+		("raid1v, three disks" "1v" 3 0 "" "Success" "0" "0")
+		("raid5 needs three disks" "5" 2 0 "" "" "1" "1")
+		("raid6 needs four disks" "6" 3 0 "" "" "1" "1")
+		("raid10 needs an even number of disks" "10" 5 0 "" "" "1" "1")
+		("small allocation groups" "0" 2 0 " -g 64" "Success" "0" "0")
+		("bad allocation group size" "1" 2 0 " -g 60" "" "1" "1")
+		("inline data" "0" 2 0 " -I" "Success" "0" "0")
+		("reflinks" "1" 2 0 " -R" "Success" "0" "0")
+		("snapshots" "1" 2 0 " -S" "Success" "0" "0")
+		("compression" "0" 2 0 " -C" "Success" "0" "0")
+		("deduplication" "1" 2 0 " -D" "Success" "0" "0")
+		("a slow disk" "0" 3 1 "" "Success" "0" "0")
+		("raid6 with every feature" "6" 5 0 " -I -S -C -D -g 64" "Success" "0" "0"))))
+
+   ((testcase . ,#'fsck-test)
+    ; desc raid numdisks flags corrupt-disk region output
+    (configs . (("raid1 -- repair a corrupted mirror" "1" 2 "" 2 "ibitmap"
+		 ,(string-join
+		   '("Inode bitmap differs between disk 0 and disk 1"
+		     "1/32 inodes, 0/224 blocks used"
+		     "1 problems found"
+		     "rc 4"
+		     "Inode bitmap differs between disk 0 and disk 1 (fixed)"
+		     "1/32 inodes, 0/224 blocks used"
+		     "1 problems found, all fixed,"
+		     "rc 1"
+		     "1/32 inodes, 0/224 blocks used"
+		     "0 problems found"
+		     "rc 0")
+		   "\n"))
+		("raid5 -- repair parity" "5" 3 "" 1 "block"
+		 ,(string-join
+		   '("1/32 inodes, 0/448 blocks used"
+		     "Row 0: P parity does not match the data"
+		     "1 problems found"
+		     "rc 4"
+		     "1/32 inodes, 0/448 blocks used"
+		     "Row 0: P parity does not match the data (fixed)"
+		     "1 problems found, all fixed,"
+		     "rc 1"
+		     "1/32 inodes, 0/448 blocks used"
+		     "0 problems found"
+		     "rc 0")
+		   "\n"))
+		("raid10 with every feature -- clean" "10" 4 " -I -S -C -D -g 64" nil nil
+		 ,(string-join
+		   '("1/32 inodes, 0/448 blocks used" "0 problems found" "rc 0"
+		     "1/32 inodes, 0/448 blocks used" "0 problems found" "rc 0"
+		     "1/32 inodes, 0/448 blocks used" "0 problems found" "rc 0")
+		   "\n")))))
+   ((testcase . ,#'feature-workload)
+;;    (desc flags op post-state post-extra-blocks check-args fsck raid numdisks output)
+    (configs . ,(gen-raid-test-with-fn
+		 #'feature-workload-success
+		 `(("rename: within and across directories" ""
+		    ("os.mkdir(\"d1\"); os.mkdir(\"d2\")"
+		     "with open(\"file1\", \"wb\") as f: f.write(b\"a\" * 1000)"
+		     "with open(\"file2\", \"wb\") as f: f.write(b\"b\" * 600)"
+		     "os.rename(\"file1\", \"file3\")\nassert not os.path.exists(\"file1\") and os.stat(\"file3\").st_size == 1000, \"rename within a directory\""
+		     "os.rename(\"file3\", \"d1/file3\")\nassert sorted(os.listdir(\".\")) == [\"d1\", \"d2\", \"file2\"], \"rename across directories\""
+		     "with open(\"d1/file3\", \"rb\") as f: assert f.read() == b\"a\" * 1000, \"d1/file3 changed\""
+		     "os.rename(\"file2\", \"d1/file3\")\nassert not os.path.exists(\"file2\"), \"rename over a file left the source\""
+		     "with open(\"d1/file3\", \"rb\") as f: assert f.read() == b\"b\" * 600, \"rename over a file kept the old contents\""
+		     "with open(\"d2/file4\", \"wb\") as f: f.write(b\"c\" * 100)"
+		     "libc = ctypes.CDLL(None, use_errno=True)\nassert libc.renameat2(-100, b\"d2/file4\", -100, b\"d1/file3\", 1) == -1, \"RENAME_NOREPLACE replaced a file\"\nassert ctypes.get_errno() == errno.EEXIST, os.strerror(ctypes.get_errno())"
+		     "with open(\"d1/file3\", \"rb\") as f: assert f.read() == b\"b\" * 600 and os.path.exists(\"d2/file4\"), \"RENAME_NOREPLACE changed something\""
+		     "try:\n    os.rename(\"d1\", \"d1/d3\")\nexcept OSError as e:\n    assert e.errno == errno.EINVAL, e\nelse:\n    assert False, \"moved a directory below itself\""
+		     "os.rename(\"d2\", \"d1/d2\")\nassert os.listdir(\".\") == [\"d1\"] and os.listdir(\"d1/d2\") == [\"file4\"], \"moving a directory\"")
+		    ,'((("file3" . 600) (("file4" . 100)))) 0 nil "Correct\nCorrect"))
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'feature-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'feature-workload-success
+		 `(("truncate: shrink and grow" ""
+		    ("with open(\"file1\", \"wb\") as f: f.write(b\"a\" * 8192)"
+		     "assert os.stat(\"file1\").st_blocks == 17, \"blocks of an 8192 byte file\""
+		     "free = os.statvfs(\".\").f_bfree\nos.truncate(\"file1\", 1000)\nassert os.statvfs(\".\").f_bfree == free + 15, \"shrinking to 1000 bytes did not free 15 blocks\""
+		     "assert os.stat(\"file1\").st_size == 1000 and os.stat(\"file1\").st_blocks == 2, \"size and blocks after shrinking\""
+		     "os.truncate(\"file1\", 6000)\nassert os.statvfs(\".\").f_bfree == free + 15, \"growing allocated blocks\""
+		     "with open(\"file1\", \"rb\") as f: assert f.read() == b\"a\" * 1000 + bytes(5000), \"the grown tail is not zeros\"")
+		    ,'(("file1" . 1000)) 0 nil "Correct\nCorrect")
+		   ("fallocate: preallocate and punch a hole" ""
+		    ("fd = os.open(\"file1\", os.O_RDWR | os.O_CREAT)\nos.posix_fallocate(fd, 0, 3584)\nos.close(fd)"
+		     "assert os.stat(\"file1\").st_size == 3584 and os.stat(\"file1\").st_blocks == 7, \"size and blocks after posix_fallocate\""
+		     "with open(\"file1\", \"rb\") as f: assert f.read() == bytes(3584), \"preallocated blocks are not zeros\""
+		     "with open(\"file2\", \"wb\") as f: f.write(b\"a\" * 3584)"
+		     "libc = ctypes.CDLL(None, use_errno=True)\nfd = os.open(\"file2\", os.O_RDWR)\n# FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE\nrc = libc.fallocate(fd, 3, ctypes.c_long(512), ctypes.c_long(1024))\nos.close(fd)\nassert rc == 0, os.strerror(ctypes.get_errno())"
+		     "assert os.stat(\"file2\").st_size == 3584 and os.stat(\"file2\").st_blocks == 5, \"size and blocks after punching a hole\""
+		     "with open(\"file2\", \"rb\") as f: assert f.read() == b\"a\" * 512 + bytes(1024) + b\"a\" * 2048, \"the hole is not zeros\"")
+		    ,'(("file1" . 3584) ("file2" . 2560)) 0 " --contiguous 1" "Correct\nCorrect"))
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'feature-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'feature-workload-success
+		 `(("sparse: write past the end, seek holes and data" ""
+		    ("fd = os.open(\"file1\", os.O_RDWR | os.O_CREAT)\nos.pwrite(fd, b\"a\" * 512, 5120)\nos.pwrite(fd, b\"b\" * 100, 0)"
+		     "assert os.fstat(fd).st_size == 5632 and os.fstat(fd).st_blocks == 3, \"size and blocks of a sparse file\""
+		     "assert os.lseek(fd, 0, os.SEEK_DATA) == 0 and os.lseek(fd, 0, os.SEEK_HOLE) == 512, \"data and hole from 0\""
+		     "assert os.lseek(fd, 512, os.SEEK_DATA) == 5120 and os.lseek(fd, 5120, os.SEEK_HOLE) == 5632, \"data and hole from 512\""
+		     "try:\n    os.lseek(fd, 5632, os.SEEK_DATA)\nexcept OSError as e:\n    assert e.errno == errno.ENXIO, e\nelse:\n    assert False, \"SEEK_DATA found data at the end of the file\""
+		     "assert os.pread(fd, 100, 5632) == b\"\", \"read past the end\""
+		     "assert os.pread(fd, 5632, 0) == b\"b\" * 100 + bytes(5020) + b\"a\" * 512, \"contents of a sparse file\"\nos.close(fd)")
+		    ,'(("file1" . 1024)) 1 nil "Correct\nCorrect")) ; two data blocks and the indirect block
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'feature-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'feature-workload-success
+		 `(("reflink: copy_file_range shares blocks" " -R"
+		    ("with open(\"file1\", \"wb\") as f: f.write(b\"a\" * 3584)"
+		     "free = os.statvfs(\".\").f_bfree\nfd1 = os.open(\"file1\", os.O_RDWR)\nfd2 = os.open(\"file2\", os.O_WRONLY | os.O_CREAT)\nn = os.copy_file_range(fd1, fd2, 3584)\nos.close(fd2)\nassert n == 3584, n"
+		     "assert os.statvfs(\".\").f_bfree == free and os.stat(\"file2\").st_blocks == 7, \"the copy allocated blocks\""
+		     "with open(\"file2\", \"r+b\") as f: f.seek(512); f.write(b\"b\" * 100)"
+		     "assert os.statvfs(\".\").f_bfree == free - 1, \"writing to the copy did not unshare exactly one block\""
+		     "with open(\"file1\", \"rb\") as f: assert f.read() == b\"a\" * 3584, \"writing to the copy changed the original\""
+		     "with open(\"file2\", \"rb\") as f: assert f.read() == b\"a\" * 512 + b\"b\" * 100 + b\"a\" * 2972, \"contents of the copy\""
+		     "try:\n    os.copy_file_range(fd1, fd1, 1024, 0, 512)\nexcept OSError as e:\n    assert e.errno == errno.EINVAL, e\nelse:\n    assert False, \"copied between overlapping ranges of a file\"\nos.close(fd1)")
+		    ,'(("file1" . 3584) ("file2" . 3584)) -6 nil "Correct\nCorrect")) ; file2 shares all but one block
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'feature-workload)
+    ; fsck.wfs prints the volume's size, which differs between the configs
+    (configs . ,(mapcar
+		 (lambda (config)
+		   (list (format "raid%s -- snapshot: old contents, read-only, freed on rmdir" (nth 0 config))
+			 " -S"
+			 (py-checks
+			  '("with open(\"file1\", \"wb\") as f: f.write(b\"a\" * 1024)"
+			    "with open(\"file2\", \"wb\") as f: f.write(b\"b\" * 1024)"
+			    "os.mkdir(\".snapshots/s1\")"
+			    "with open(\"file1\", \"r+b\") as f: f.write(b\"c\" * 512)"
+			    "os.unlink(\"file2\")"
+			    "with open(\".snapshots/s1/file1\", \"rb\") as f: assert f.read() == b\"a\" * 1024, \"the snapshot of file1 changed\""
+			    "with open(\".snapshots/s1/file2\", \"rb\") as f: assert f.read() == b\"b\" * 1024, \"the snapshot of file2 changed\""
+			    "with open(\"file1\", \"rb\") as f: assert f.read() == b\"c\" * 512 + b\"a\" * 512, \"contents of file1\""
+			    "try:\n    open(\".snapshots/s1/file1\", \"r+b\")\nexcept OSError as e:\n    assert e.errno == errno.EROFS, e\nelse:\n    assert False, \"opened a file in a snapshot for writing\""
+			    "try:\n    os.mknod(\".snapshots/s1/file3\")\nexcept OSError as e:\n    assert e.errno == errno.EROFS, e\nelse:\n    assert False, \"created a file in a snapshot\""
+			    "free = os.statvfs(\".\").f_bfree\nos.rmdir(\".snapshots/s1\")\nassert os.statvfs(\".\").f_bfree >= free + 2, \"removing the snapshot did not free its blocks\""
+			    "assert os.listdir(\".snapshots\") == [], \"the snapshot is still listed\""))
+			 '(("file1" . 1024)) 0 nil t (nth 0 config) (nth 1 config)
+			 (format "Correct\nCorrect\n2/32 inodes, 3/%d blocks used\n0 problems found\nrc 0"
+				 (nth 2 config))))
+		 '(("1" 2 224) ("0" 3 672)))))
+   ((testcase . ,#'feature-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'feature-workload-success
+		 `(("inline data: small files and directories live in the inode" " -I"
+		    ("free = os.statvfs(\".\").f_bfree"
+		     "with open(\"file1\", \"wb\") as f: f.write(b\"a\" * 300)"
+		     "assert os.stat(\"file1\").st_blocks == 0 and os.statvfs(\".\").f_bfree == free, \"a 300 byte file took a data block\""
+		     "with open(\"file1\", \"ab\") as f: f.write(b\"b\" * 200)"
+		     "assert os.stat(\"file1\").st_blocks == 1 and os.statvfs(\".\").f_bfree == free - 1, \"a 500 byte file did not move to one data block\""
+		     "with open(\"file1\", \"rb\") as f: assert f.read() == b\"a\" * 300 + b\"b\" * 200, \"contents after leaving the inode\""
+		     "os.mkdir(\"d1\")\nfor i in range(1, 14): os.mknod(f\"d1/file{i}\")"
+		     "assert sorted(os.listdir(\"d1\")) == sorted(f\"file{i}\" for i in range(1, 14)), \"entries of a directory grown out of its inode\""
+		     "assert os.stat(\"d1\").st_blocks == 1, \"blocks of a directory with 13 entries\"")
+		    ,(list (cons "file1" 500) (n-file-directory 13 0)) -1 nil "Correct\nCorrect")) ; the root directory stays inline
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'feature-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'feature-workload-success
+		 `(("compression: a compressible file takes fewer blocks" " -C"
+		    ("with open(\"file1\", \"wb\") as f: f.write(b\"a\" * 8192)"
+		     "assert os.stat(\"file1\").st_blocks == 3, \"blocks of a compressed file, two clusters and the indirect block\""
+		     "with open(\"file1\", \"rb\") as f: assert f.read() == b\"a\" * 8192, \"contents of a compressed file\""
+		     "import subprocess\nout = subprocess.run([\"lsattr\", \"file1\"], capture_output=True, text=True).stdout\nassert \"c\" in out.split()[0], \"lsattr does not show the c flag: \" + out")
+		    ,'(("file1" . 8192)) -14 nil "Correct\nCorrect"))
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'feature-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'feature-workload-success
+		 `(("deduplication: identical blocks are stored once" " -D"
+		    ("data = b\"a\" * 512 + b\"b\" * 512 + b\"c\" * 512 + b\"d\" * 512"
+		     "with open(\"file1\", \"wb\") as f: f.write(data)"
+		     "free = os.statvfs(\".\").f_bfree\nwith open(\"file2\", \"wb\") as f: f.write(data)"
+		     "assert os.statvfs(\".\").f_bfree == free and os.stat(\"file2\").st_blocks == 4, \"identical blocks were stored twice\""
+		     "with open(\"file1\", \"rb\") as f: assert f.read() == data, \"contents of file1\""
+		     "with open(\"file2\", \"rb\") as f: assert f.read() == data, \"contents of file2\"")
+		    ,'(("file1" . 2048) ("file2" . 2048)) -4 nil "Correct\nCorrect"))
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-init-and-workload)
+;;    (desc fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- degraded mount and rebuild onto a blank disk" ,'()
+		 ,(concat
+		   (string-join
+		    (list "./read-write.py 1 10"
+			  "cat mnt/file1 > file1.test"
+			  "fusermount -u mnt"
+			  (format "rm -f %s" (disk-path "test-disk2"))
+			  (format "%s 2> /dev/null" (mount-cmd 2 "mnt"))) ; mounts degraded
+		    "; ")
+		   "; "
+		   (string-join
+		    (list "diff mnt/file1 file1.test"
+			  "fusermount -u mnt"
+			  (format "truncate -s 1M %s" (disk-path "test-disk2"))
+			  (format "! %s 2> /dev/null" (mount-cmd 2 "mnt")) ; a blank disk needs -o rebuild=
+			  (format "../solution/wfs %s -s -o rebuild=%s mnt 2> /dev/null"
+				  (string-join (gen-disks 2) " ") (disk-path "test-disk2"))
+			  "diff mnt/file1 file1.test"
+			  "sleep 1") ; let the rebuild finish before unmounting
+		    " && "))
+		 ,'(("file1" . 1000)) 0 "1" 2 "Correct\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'fsck-workload-test)
+    ; desc raid numdisks flags fs-state op region output
+    (configs . (("raid1 -- populated volume is clean" "1" 2 ""
+		 ,'(("file1" . 1000) (("file2" . 8192)) ()) nil nil
+		 ,(string-join
+		   '("Correct" "5/32 inodes, 21/224 blocks used" "0 problems found" "rc 0")
+		   "\n"))
+		("raid0 -- populated volume is clean" "0" 3 ""
+		 ,'(("file1" . 1000) (("file2" . 8192)) ()) nil nil
+		 ,(string-join
+		   '("Correct" "5/32 inodes, 21/672 blocks used" "0 problems found" "rc 0")
+		   "\n"))
+		("raid1 with inline data, reflinks and snapshots -- populated volume is clean" "1" 2 " -I -R -S"
+		 ,'(("file1" . 1000) (("file2" . 8192)) ())
+		 ,(py-checks
+		   '("os.mkdir(\".snapshots/s1\")"
+		     "fd1 = os.open(\"file1\", os.O_RDONLY)\nfd2 = os.open(\"d2/file3\", os.O_WRONLY | os.O_CREAT)\nassert os.copy_file_range(fd1, fd2, 1000) == 1000, \"short copy\"\nos.close(fd1)\nos.close(fd2)"
+		     "with open(\"d1/file2\", \"r+b\") as f: f.write(b\"b\" * 512)"
+		     "os.unlink(\"file1\")"))
+		 nil
+		 ,(string-join
+		   '("Correct" "Correct" "10/32 inodes, 21/224 blocks used" "0 problems found" "rc 0")
+		   "\n"))
+		("raid1 -- repair a data block marked free" "1" 2 ""
+		 ,'(("file1" . 1000) (("file2" . 8192)) ()) nil "dbitmap"
+		 ,(string-join
+		   '("Correct"
+		     "Block 0: in use but marked free"
+		     "Group 0 on disk 0: 203 free blocks and 27 free inodes recorded, 204 and 27 counted"
+		     "Disk 0: 203 free blocks recorded in its bitmap, 204 counted"
+		     "Group 0 on disk 1: 203 free blocks and 27 free inodes recorded, 204 and 27 counted"
+		     "Disk 1: 203 free blocks recorded in its bitmap, 204 counted"
+		     "Disk 0: superblock records 203 free blocks and 27 free inodes, 204 and 27 counted"
+		     "Disk 1: superblock records 203 free blocks and 27 free inodes, 204 and 27 counted"
+		     "5/32 inodes, 20/224 blocks used"
+		     "7 problems found"
+		     "rc 4"
+		     "Block 0: in use but marked free (fixed)"
+		     "5/32 inodes, 21/224 blocks used"
+		     "1 problems found, all fixed,"
+		     "rc 1"
+		     "5/32 inodes, 21/224 blocks used"
+		     "0 problems found"
+		     "rc 0")
+		   "\n")))))))
@@ -4,7 +4,7 @@ GREEN='\033[0;32m'
 RED='\033[0;31m'
 NONE='\033[0m'
 
-ignore_output_list="3,7,8"
+ignore_output_list="3,7,8,62,63,64,66"
 
 # run_test testdir testnumber
 run_test () {
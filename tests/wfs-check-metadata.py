@@ -178,6 +178,16 @@ def verify_raid0(disks, expected_dirs, expected_files, expected_blocks, altblock
     # not a big deal though
     print("Correct")
 
+def verify_contiguous(disks, inodes):
+    """Verify the direct blocks of each of the inodes are consecutive."""
+    for disk in disks:
+        fs = wfsverify.WfsState(disk)
+        for inodep in inodes:
+            ptrs = [ptr for ptr in fs.read_block_ptrs(inodep)[:-1] if ptr != 0]
+            test_nonzero(f"direct blocks of inode {inodep} [{disk}]", len(ptrs))
+            test_eq(f"direct blocks of inode {inodep} are consecutive [{disk}]",
+                    ptrs, list(range(ptrs[0], ptrs[0] + len(ptrs))))
+
 def unimplemented(mode):
     print(f'{mode} verification not implemented')
     exit()
@@ -191,9 +201,13 @@ if __name__ == '__main__':
     parser.add_argument("--dirs", help="expected number of directories")
     parser.add_argument("--files", help="expected number of regular files")
     parser.add_argument("--disks", nargs="+", help="list of disks")
+    parser.add_argument("--contiguous", type=int, nargs="+", default=[],
+                        help="inodes whose direct blocks must be consecutive")
 
     args = parser.parse_args()
 
+    verify_contiguous(args.disks, args.contiguous)
+
     if args.mode == 'mkfs':
         verify_mkfs(args.disks, int(args.inodes), int(args.blocks))
     elif args.mode == 'raid1':
@@ -50,6 +50,11 @@ class WfsState:
         pos = self.get_iblock_region() + (inodep * self.blksize)
         return self.read_struct(pos, self.inode)
 
+    def read_block_ptrs(self, inodep):
+        """Return an inode's block pointers, the indirect one last; 0 is unused."""
+        blocks = self.read_inode(inodep)['blocks']
+        return [(blocks >> (64 * i)) & ((1 << 64) - 1) for i in range(8)]
+
     def read_superblock(self):
         """Read a superblock from disk and return a dict of its fields."""
         return self.read_struct(0, self.superblock)
@@ -72,6 +77,14 @@ class WfsState:
             diskf.seek(self.get_dblock_region() + self.blksize)
             diskf.write(b'\x00' * ((self.get_sb_datablocks() - 1) * self.blksize))
 
+    def flip_byte(self, pos, mask=0xff):
+        """Invert the bits in mask of the byte at offset pos of the disk."""
+        with open(self.disk, "r+b") as diskf:
+            diskf.seek(pos)
+            byte = diskf.read(1)[0]
+            diskf.seek(pos)
+            diskf.write(bytes([byte ^ mask]))
+
     def get_sb_inodes(self):
         """Return the total number of inodes in the filesystem."""
         return self.sb['inodes']